@@ -0,0 +1,431 @@
+// Game Boy side of the link cable, for driving the adapter without one
+// Connects to the SPI socket of the host build (HOST_SPI), and plays a script
+//   of Mobile Adapter packets into it, the way a game would.
+// Every byte written to the socket is one transfer, answered with the byte
+//   the adapter sent back at the same time.
+
+#define _GNU_SOURCE  // strtok_r()
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Microseconds between bytes
+// Games clock the adapter at 8KHz, which takes about a millisecond per byte.
+#define BYTE_US_DEFAULT 1000
+
+// Amount of idle bytes sent while waiting for a reply before giving up
+#define REPLY_TIMEOUT_BYTES 20000
+
+#define PACKET_MAX 0xFF
+
+#define IDLE_BYTE 0x4B
+#define DEVICE_GB 0x81
+#define DEVICE_ADAPTER 0x88
+
+#define CMD_TRANSFER_DATA 0x15
+#define CMD_TRANSFER_DATA_END 0x1F
+#define CMD_OPEN_TCP 0x23
+#define CMD_OPEN_UDP 0x25
+#define CMD_ERROR 0x6E
+#define CMD_REPLY_F 0x80
+
+static const struct command_name {
+    const char *name;
+    unsigned char cmd;
+} command_names[] = {
+    {"begin", 0x10},
+    {"end", 0x11},
+    {"dial", 0x12},
+    {"hangup", 0x13},
+    {"wait_call", 0x14},
+    {"transfer", CMD_TRANSFER_DATA},
+    {"reset", 0x16},
+    {"status", 0x17},
+    {"read_config", 0x19},
+    {"write_config", 0x1A},
+    {"login", 0x21},
+    {"logout", 0x22},
+    {"tcp_open", CMD_OPEN_TCP},
+    {"tcp_close", 0x24},
+    {"udp_open", CMD_OPEN_UDP},
+    {"udp_close", 0x26},
+    {"dns", 0x28},
+};
+
+struct packet {
+    unsigned char cmd;
+    unsigned char size;
+    unsigned char data[PACKET_MAX];
+};
+
+struct stats {
+    unsigned long count;
+    uint64_t total_us;
+    uint64_t max_us;
+};
+
+static int sock = -1;
+static unsigned byte_us = BYTE_US_DEFAULT;
+static uint64_t next_byte_us;
+
+static struct stats cmd_stats[0x80];
+static unsigned long bytes_sent;
+static unsigned long bytes_received;
+
+// Data received on each connection that no recv has waited for yet
+static unsigned long conn_received[0x100];
+static unsigned long errors;
+
+// Connection opened last, used wherever the script says "@"
+static unsigned char last_conn;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t us)
+{
+    uint64_t now = now_us();
+    if (us > now) usleep(us - now);
+}
+
+static unsigned char transfer(unsigned char c)
+{
+    sleep_until(next_byte_us);
+    next_byte_us = now_us() + byte_us;
+
+    unsigned char res;
+    if (write(sock, &c, 1) != 1 || read(sock, &res, 1) != 1) {
+        fprintf(stderr, "Lost the link to the adapter\n");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+static bool packet_send(const struct packet *packet)
+{
+    unsigned sum = packet->cmd + packet->size;
+    transfer(0x99);
+    transfer(0x66);
+    transfer(packet->cmd);
+    transfer(0);
+    transfer(0);
+    transfer(packet->size);
+    for (unsigned i = 0; i < packet->size; i++) {
+        transfer(packet->data[i]);
+        sum += packet->data[i];
+    }
+    transfer(sum >> 8);
+    transfer(sum);
+
+    unsigned char device = transfer(DEVICE_GB);
+    unsigned char ack = transfer(0);
+    if (device != DEVICE_ADAPTER || ack != (packet->cmd ^ CMD_REPLY_F)) {
+        fprintf(stderr, "Packet %02X not acknowledged (%02X %02X)\n",
+            packet->cmd, device, ack);
+        return false;
+    }
+    return true;
+}
+
+static bool packet_recv(struct packet *packet)
+{
+    unsigned waited = 0;
+    for (;;) {
+        if (transfer(IDLE_BYTE) != 0x99) {
+            if (++waited >= REPLY_TIMEOUT_BYTES) {
+                fprintf(stderr, "Timed out waiting for a reply\n");
+                return false;
+            }
+            continue;
+        }
+        if (transfer(IDLE_BYTE) == 0x66) break;
+    }
+
+    packet->cmd = transfer(IDLE_BYTE);
+    transfer(IDLE_BYTE);
+    unsigned size = transfer(IDLE_BYTE) << 8;
+    size |= transfer(IDLE_BYTE);
+    if (size > PACKET_MAX) {
+        fprintf(stderr, "Reply too large: %u bytes\n", size);
+        return false;
+    }
+    packet->size = size;
+
+    unsigned sum = packet->cmd + packet->size;
+    for (unsigned i = 0; i < packet->size; i++) {
+        packet->data[i] = transfer(IDLE_BYTE);
+        sum += packet->data[i];
+    }
+    unsigned checksum = transfer(IDLE_BYTE) << 8;
+    checksum |= transfer(IDLE_BYTE);
+
+    transfer(DEVICE_GB);
+    transfer(packet->cmd ^ CMD_REPLY_F);
+    if (checksum != (sum & 0xFFFF)) {
+        fprintf(stderr, "Reply %02X has a bad checksum\n", packet->cmd);
+        return false;
+    }
+    return true;
+}
+
+// Send a command and wait for its reply, keeping track of how long it took
+static bool transaction(const struct packet *packet, struct packet *reply)
+{
+    uint64_t start = now_us();
+    if (!packet_send(packet) || !packet_recv(reply)) {
+        errors++;
+        return false;
+    }
+    uint64_t took = now_us() - start;
+
+    struct stats *stats = &cmd_stats[packet->cmd & 0x7F];
+    stats->count++;
+    stats->total_us += took;
+    if (took > stats->max_us) stats->max_us = took;
+
+    if (reply->cmd == (CMD_ERROR | CMD_REPLY_F)) {
+        fprintf(stderr, "Command %02X failed with error %02X\n", packet->cmd,
+            reply->size >= 2 ? reply->data[1] : 0);
+        errors++;
+        return false;
+    }
+
+    if (packet->cmd == CMD_TRANSFER_DATA && packet->size) {
+        bytes_sent += packet->size - 1;
+    }
+    if (reply->cmd == (CMD_TRANSFER_DATA | CMD_REPLY_F) && reply->size) {
+        bytes_received += reply->size - 1;
+        conn_received[reply->data[0]] += reply->size - 1;
+    }
+    if ((packet->cmd == CMD_OPEN_TCP || packet->cmd == CMD_OPEN_UDP) &&
+            reply->size) {
+        last_conn = reply->data[0];
+        conn_received[last_conn] = 0;
+    }
+    return true;
+}
+
+// Keep asking for data until enough has arrived, or the connection closes
+// Data that came along with the reply to an earlier transfer counts too, as
+//   the server may answer before the transfer returns.
+static bool recv_data(unsigned char conn, unsigned long size)
+{
+    struct packet packet = {.cmd = CMD_TRANSFER_DATA, .size = 1, .data = {conn}};
+    struct packet reply;
+    while (conn_received[conn] < size) {
+        if (!transaction(&packet, &reply)) return false;
+        if (reply.cmd == (CMD_TRANSFER_DATA_END | CMD_REPLY_F)) {
+            conn_received[conn] = size;
+            break;
+        }
+    }
+    conn_received[conn] -= size;
+    return true;
+}
+
+static const char *command_name(unsigned char cmd)
+{
+    for (size_t i = 0; i < sizeof(command_names) / sizeof(*command_names); i++) {
+        if (command_names[i].cmd == cmd) return command_names[i].name;
+    }
+    return NULL;
+}
+
+static int parse_command(const char *word)
+{
+    for (size_t i = 0; i < sizeof(command_names) / sizeof(*command_names); i++) {
+        if (strcmp(command_names[i].name, word) == 0) return command_names[i].cmd;
+    }
+
+    char *end;
+    unsigned long cmd = strtoul(word, &end, 16);
+    if (*end || cmd >= CMD_REPLY_F) return -1;
+    return cmd;
+}
+
+// Arguments are hex bytes, "@" for the last connection, or quoted strings
+static bool parse_args(char *line, struct packet *packet)
+{
+    char *s = line;
+    for (;;) {
+        while (isspace((unsigned char)*s)) s++;
+        if (!*s) return true;
+
+        if (*s == '"') {
+            for (s++; *s && *s != '"'; s++) {
+                unsigned char c = *s;
+                if (c == '\\' && s[1]) {
+                    switch (*++s) {
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case '0': c = '\0'; break;
+                    default: c = *s; break;
+                    }
+                }
+                if (packet->size >= PACKET_MAX) return false;
+                packet->data[packet->size++] = c;
+            }
+            if (*s++ != '"') return false;
+            continue;
+        }
+
+        if (packet->size >= PACKET_MAX) return false;
+        if (*s == '@') {
+            packet->data[packet->size++] = last_conn;
+            s++;
+            continue;
+        }
+        char *end;
+        unsigned long byte = strtoul(s, &end, 16);
+        if (end == s || byte > 0xFF) return false;
+        packet->data[packet->size++] = byte;
+        s = end;
+    }
+}
+
+// Run one line of the script, lines starting with # being comments:
+//   <command> [args...]  Send a command, by name or number, and wait for
+//                        the reply
+//   recv <conn> <bytes>  Poll a connection until enough data arrives
+//   sleep <ms>           Do nothing for a while
+static bool run_line(char *line, unsigned lineno)
+{
+    char *save;
+    char *word = strtok_r(line, " \t\r\n", &save);
+    if (!word || *word == '#') return true;
+    char *rest = save;
+
+    if (strcmp(word, "sleep") == 0) {
+        usleep(strtoul(rest, NULL, 0) * 1000);
+        return true;
+    }
+    if (strcmp(word, "recv") == 0) {
+        char *conn = strtok_r(NULL, " \t\r\n", &save);
+        char *size = strtok_r(NULL, " \t\r\n", &save);
+        if (!conn || !size) {
+            fprintf(stderr, "line %u: recv needs a connection and a size\n",
+                lineno);
+            exit(EXIT_FAILURE);
+        }
+        return recv_data(*conn == '@' ? last_conn : strtoul(conn, NULL, 16),
+            strtoul(size, NULL, 0));
+    }
+
+    struct packet packet = {0};
+    struct packet reply;
+    int cmd = parse_command(word);
+    if (cmd < 0 || !parse_args(rest, &packet)) {
+        fprintf(stderr, "line %u: invalid command\n", lineno);
+        exit(EXIT_FAILURE);
+    }
+    packet.cmd = cmd;
+    return transaction(&packet, &reply);
+}
+
+static bool run_script(FILE *script)
+{
+    char line[0x400];
+    unsigned lineno = 0;
+    rewind(script);
+    while (fgets(line, sizeof(line), script)) {
+        if (!run_line(line, ++lineno)) {
+            fprintf(stderr, "Stopped at line %u\n", lineno);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int connect_adapter(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void print_stats(uint64_t elapsed_us)
+{
+    printf("%-12s %8s %10s %10s\n", "command", "count", "avg ms", "max ms");
+    for (unsigned i = 0; i < sizeof(cmd_stats) / sizeof(*cmd_stats); i++) {
+        struct stats *stats = &cmd_stats[i];
+        if (!stats->count) continue;
+
+        const char *name = command_name(i);
+        char number[8];
+        if (!name) {
+            snprintf(number, sizeof(number), "%02X", i);
+            name = number;
+        }
+        printf("%-12s %8lu %10.1f %10.1f\n", name, stats->count,
+            stats->total_us / 1000.0 / stats->count, stats->max_us / 1000.0);
+    }
+
+    double secs = elapsed_us / 1e6;
+    printf("%.3f seconds, %lu errors\n", secs, errors);
+    printf("Sent %lu bytes (%.1f B/s), received %lu bytes (%.1f B/s)\n",
+        bytes_sent, bytes_sent / secs, bytes_received, bytes_received / secs);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned repeat = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+        switch (opt) {
+        case 'b': byte_us = strtoul(optarg, NULL, 0); break;
+        case 'n': repeat = strtoul(optarg, NULL, 0); break;
+        default: goto usage;
+        }
+    }
+    if (argc - optind != 2) goto usage;
+
+    FILE *script = fopen(argv[optind + 1], "r");
+    if (!script) {
+        perror(argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    sock = connect_adapter(argv[optind]);
+    if (sock == -1) return EXIT_FAILURE;
+
+    uint64_t start = now_us();
+    for (unsigned i = 0; i < repeat; i++) {
+        if (!run_script(script)) break;
+    }
+    print_stats(now_us() - start);
+
+    close(sock);
+    fclose(script);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "Usage: %s [-b byte_us] [-n repeat] socket script\n",
+        argv[0]);
+    return EXIT_FAILURE;
+}
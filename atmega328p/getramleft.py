@@ -1,6 +1,6 @@
 #!/usr/bin/env python3
 # Get the amount of RAM left in the program
-STACK_SIZE = 0x200  # Same as defined in source/main.c
+STACK_SIZE = 0x180  # Same as defined in source/main.c
 RAM_SIZE = 0x800  # 2KB
 
 import subprocess
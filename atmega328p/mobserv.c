@@ -0,0 +1,493 @@
+// Stand-in for the servers games reach through the adapter
+// Serves DNS, HTTP, POP3 and SMTP on the loopback interface, with
+//   configurable response sizes and delays, so a whole session can be
+//   measured without leaving the machine.
+// Every connection is logged when it closes, along with its throughput.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define PORT_DNS 5353
+#define PORT_HTTP 8080
+#define PORT_POP3 8110
+#define PORT_SMTP 8025
+
+#define MAX_CLIENTS 16
+#define LINE_MAX 0x200
+
+// Defaults for the sizes of what's served
+#define HTTP_SIZE 0x1000
+#define MAIL_COUNT 3
+#define MAIL_SIZE 0x800
+
+enum service {
+    SERVICE_HTTP,
+    SERVICE_POP3,
+    SERVICE_SMTP,
+    SERVICE_COUNT
+};
+
+static const char *service_names[SERVICE_COUNT] = {"http", "pop3", "smtp"};
+static const unsigned short service_ports[SERVICE_COUNT] = {
+    PORT_HTTP, PORT_POP3, PORT_SMTP
+};
+
+struct client {
+    int fd;
+    enum service service;
+    uint64_t start_us;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+
+    // Input isn't looked at while a body is being sent, so replies to
+    //   pipelined commands come out in order
+    char in[LINE_MAX];
+    unsigned in_size;
+
+    // Replies wait here until the delay has passed
+    char *out;
+    size_t out_size;
+    size_t out_pos;
+    uint64_t out_time;
+
+    // Generated content still to be sent after the buffered output
+    unsigned long body_left;
+    const char *body_end;
+
+    unsigned long request_size;
+    bool requested;
+    bool authorized;
+    bool in_data;
+    bool closing;
+};
+
+static struct client clients[MAX_CLIENTS];
+static int listen_fds[SERVICE_COUNT];
+static int dns_fd = -1;
+
+static unsigned delay_ms;
+static unsigned long http_size = HTTP_SIZE;
+static unsigned mail_count = MAIL_COUNT;
+static unsigned long mail_size = MAIL_SIZE;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int listen_on(int type, unsigned short port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Could not bind port %u: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(fd, MAX_CLIENTS) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void client_reply(struct client *client, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void client_reply(struct client *client, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    char buf[LINE_MAX];
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(buf)) len = sizeof(buf) - 1;
+
+    char *out = realloc(client->out, client->out_size + len);
+    if (!out) return;
+    memcpy(out + client->out_size, buf, len);
+    client->out = out;
+    client->out_size += len;
+    client->out_time = now_us() + delay_ms * 1000;
+}
+
+// Content that's generated as it's sent, followed by a fixed ending
+static void client_body(struct client *client, unsigned long size,
+    const char *end)
+{
+    client->body_left = size;
+    client->body_end = end;
+}
+
+static void client_close(struct client *client)
+{
+    uint64_t took = now_us() - client->start_us;
+    double secs = took / 1e6;
+    printf("%s: %lu bytes in, %lu bytes out, %.3f s, %.1f B/s\n",
+        service_names[client->service], client->bytes_in, client->bytes_out,
+        secs, secs > 0 ? (client->bytes_in + client->bytes_out) / secs : 0);
+    fflush(stdout);
+
+    close(client->fd);
+    free(client->out);
+    *client = (struct client){.fd = -1};
+}
+
+static void http_line(struct client *client, const char *line)
+{
+    // Only the request line matters, "GET /<size>" asking for a size
+    // The request ends at an empty line.
+    if (!client->requested) {
+        client->request_size = http_size;
+        const char *path = strchr(line, '/');
+        if (path && path[1] >= '0' && path[1] <= '9') {
+            client->request_size = strtoul(path + 1, NULL, 0);
+        }
+        client->requested = true;
+        return;
+    }
+    if (*line) return;
+
+    unsigned long size = client->request_size;
+    client_reply(client, "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %lu\r\n\r\n", size);
+    client_body(client, size, "");
+    client->closing = true;
+}
+
+static void pop3_line(struct client *client, const char *line)
+{
+    if (strncasecmp(line, "USER", 4) == 0) {
+        client_reply(client, "+OK\r\n");
+    } else if (strncasecmp(line, "PASS", 4) == 0) {
+        client->authorized = true;
+        client_reply(client, "+OK %u messages\r\n", mail_count);
+    } else if (strncasecmp(line, "STAT", 4) == 0) {
+        client_reply(client, "+OK %u %lu\r\n", mail_count,
+            mail_count * mail_size);
+    } else if (strncasecmp(line, "LIST", 4) == 0) {
+        client_reply(client, "+OK\r\n");
+        for (unsigned i = 0; i < mail_count; i++) {
+            client_reply(client, "%u %lu\r\n", i + 1, mail_size);
+        }
+        client_reply(client, ".\r\n");
+    } else if (strncasecmp(line, "RETR", 4) == 0 ||
+            strncasecmp(line, "TOP", 3) == 0) {
+        unsigned num = strtoul(line + 4, NULL, 10);
+        if (!client->authorized || num < 1 || num > mail_count) {
+            client_reply(client, "-ERR no such message\r\n");
+            return;
+        }
+        client_reply(client, "+OK %lu octets\r\n", mail_size);
+        client_body(client, mail_size, "\r\n.\r\n");
+    } else if (strncasecmp(line, "DELE", 4) == 0 ||
+            strncasecmp(line, "NOOP", 4) == 0 ||
+            strncasecmp(line, "RSET", 4) == 0) {
+        client_reply(client, "+OK\r\n");
+    } else if (strncasecmp(line, "QUIT", 4) == 0) {
+        client_reply(client, "+OK bye\r\n");
+        client->closing = true;
+    } else {
+        client_reply(client, "-ERR unknown command\r\n");
+    }
+}
+
+static void smtp_line(struct client *client, const char *line)
+{
+    if (client->in_data) {
+        if (strcmp(line, ".") != 0) return;
+        client->in_data = false;
+        client_reply(client, "250 OK\r\n");
+    } else if (strncasecmp(line, "HELO", 4) == 0 ||
+            strncasecmp(line, "EHLO", 4) == 0) {
+        client_reply(client, "250 localhost\r\n");
+    } else if (strncasecmp(line, "MAIL", 4) == 0 ||
+            strncasecmp(line, "RCPT", 4) == 0 ||
+            strncasecmp(line, "RSET", 4) == 0 ||
+            strncasecmp(line, "NOOP", 4) == 0) {
+        client_reply(client, "250 OK\r\n");
+    } else if (strncasecmp(line, "DATA", 4) == 0) {
+        client->in_data = true;
+        client_reply(client, "354 End data with <CR><LF>.<CR><LF>\r\n");
+    } else if (strncasecmp(line, "QUIT", 4) == 0) {
+        client_reply(client, "221 bye\r\n");
+        client->closing = true;
+    } else {
+        client_reply(client, "500 unknown command\r\n");
+    }
+}
+
+static void client_line(struct client *client, const char *line)
+{
+    switch (client->service) {
+    case SERVICE_HTTP: http_line(client, line); break;
+    case SERVICE_POP3: pop3_line(client, line); break;
+    case SERVICE_SMTP: smtp_line(client, line); break;
+    default: break;
+    }
+}
+
+static bool client_sending_body(struct client *client)
+{
+    return client->body_left || (client->body_end && *client->body_end);
+}
+
+static void client_process(struct client *client)
+{
+    while (!client_sending_body(client) && !client->closing) {
+        char *end = memchr(client->in, '\n', client->in_size);
+        if (!end) {
+            // Lines too long to fit are cut short
+            if (client->in_size < sizeof(client->in)) return;
+            end = client->in + client->in_size - 1;
+        }
+
+        *end = '\0';
+        if (end > client->in && end[-1] == '\r') end[-1] = '\0';
+        client_line(client, client->in);
+
+        unsigned used = end + 1 - client->in;
+        memmove(client->in, end + 1, client->in_size - used);
+        client->in_size -= used;
+    }
+}
+
+static void client_accept(enum service service)
+{
+    int fd = accept4(listen_fds[service], NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) return;
+
+    struct client *client = NULL;
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1) {
+            client = &clients[i];
+            break;
+        }
+    }
+    if (!client) {
+        close(fd);
+        return;
+    }
+
+    *client = (struct client){
+        .fd = fd,
+        .service = service,
+        .start_us = now_us()
+    };
+    if (service == SERVICE_POP3) client_reply(client, "+OK POP3 ready\r\n");
+    if (service == SERVICE_SMTP) client_reply(client, "220 localhost\r\n");
+}
+
+static void client_read(struct client *client)
+{
+    // Leave the data in the socket until there's space for it
+    size_t space = sizeof(client->in) - client->in_size;
+    if (!space) return;
+
+    ssize_t len = recv(client->fd, client->in + client->in_size, space, 0);
+    if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+        client_close(client);
+        return;
+    }
+    if (len == -1) return;
+    client->bytes_in += len;
+    client->in_size += len;
+    client_process(client);
+}
+
+static bool client_wants_write(struct client *client)
+{
+    if (client->out_pos < client->out_size) {
+        return now_us() >= client->out_time;
+    }
+    return client_sending_body(client);
+}
+
+static void client_write(struct client *client)
+{
+    char buf[0x400];
+    const char *data;
+    size_t size;
+
+    // Buffered replies first, then the generated body and its ending
+    if (client->out_pos < client->out_size) {
+        data = client->out + client->out_pos;
+        size = client->out_size - client->out_pos;
+    } else if (client->body_left) {
+        size = client->body_left < sizeof(buf) ? client->body_left : sizeof(buf);
+        for (size_t i = 0; i < size; i++) {
+            buf[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+        }
+        data = buf;
+    } else {
+        data = client->body_end;
+        size = strlen(client->body_end);
+    }
+
+    ssize_t len = send(client->fd, data, size, MSG_NOSIGNAL);
+    if (len == -1) {
+        if (errno != EAGAIN && errno != EINTR) client_close(client);
+        return;
+    }
+    client->bytes_out += len;
+
+    if (client->out_pos < client->out_size) {
+        client->out_pos += len;
+        if (client->out_pos == client->out_size) {
+            client->out_pos = client->out_size = 0;
+        }
+    } else if (client->body_left) {
+        client->body_left -= len;
+    } else {
+        client->body_end += len;
+    }
+    client_process(client);
+}
+
+// Every query is answered with the loopback address
+static void dns_answer(void)
+{
+    unsigned char buf[0x200];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t len = recvfrom(dns_fd, buf, sizeof(buf) - 16, 0,
+        (struct sockaddr *)&from, &fromlen);
+    if (len < 12) return;
+
+    // Skip over the question, only answering the first one
+    size_t pos = 12;
+    while (pos < (size_t)len && buf[pos]) pos += buf[pos] + 1;
+    pos += 5;
+    if (pos > (size_t)len) return;
+
+    if (delay_ms) usleep(delay_ms * 1000);
+
+    buf[2] = 0x81;  // Response, recursion desired
+    buf[3] = 0x80;  // Recursion available, no error
+    buf[4] = 0; buf[5] = 1;  // One question
+    buf[6] = 0; buf[7] = 1;  // One answer
+    buf[8] = buf[9] = buf[10] = buf[11] = 0;
+    static const unsigned char answer[] = {
+        0xC0, 0x0C,  // Name, pointing at the question
+        0x00, 0x01, 0x00, 0x01,  // Type A, class IN
+        0x00, 0x00, 0x00, 0x3C,  // TTL
+        0x00, 0x04, 127, 0, 0, 1
+    };
+    memcpy(buf + pos, answer, sizeof(answer));
+    sendto(dns_fd, buf, pos + sizeof(answer), 0, (struct sockaddr *)&from,
+        fromlen);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:m:M:")) != -1) {
+        switch (opt) {
+        case 'd': delay_ms = strtoul(optarg, NULL, 0); break;
+        case 's': http_size = strtoul(optarg, NULL, 0); break;
+        case 'm': mail_count = strtoul(optarg, NULL, 0); break;
+        case 'M': mail_size = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d delay_ms] [-s http_size] "
+                "[-m mail_count] [-M mail_size]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+    for (unsigned i = 0; i < SERVICE_COUNT; i++) {
+        listen_fds[i] = listen_on(SOCK_STREAM, service_ports[i]);
+        if (listen_fds[i] == -1) return EXIT_FAILURE;
+    }
+    dns_fd = listen_on(SOCK_DGRAM, PORT_DNS);
+    if (dns_fd == -1) return EXIT_FAILURE;
+
+    printf("DNS on udp %u, HTTP on %u, POP3 on %u, SMTP on %u\n",
+        PORT_DNS, PORT_HTTP, PORT_POP3, PORT_SMTP);
+    fflush(stdout);
+
+    for (;;) {
+        struct pollfd pfds[SERVICE_COUNT + 1 + MAX_CLIENTS];
+        struct client *pclients[MAX_CLIENTS];
+        nfds_t count = 0;
+        for (unsigned i = 0; i < SERVICE_COUNT; i++) {
+            pfds[count++] = (struct pollfd){.fd = listen_fds[i], .events = POLLIN};
+        }
+        pfds[count++] = (struct pollfd){.fd = dns_fd, .events = POLLIN};
+
+        // Wake up in time for the next delayed reply
+        int timeout = -1;
+        unsigned nclients = 0;
+        uint64_t now = now_us();
+        for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+            struct client *client = &clients[i];
+            if (client->fd == -1) continue;
+
+            short events = POLLIN;
+            if (client_wants_write(client)) {
+                events |= POLLOUT;
+            } else if (client->out_pos < client->out_size) {
+                int wait = (client->out_time - now + 999) / 1000;
+                if (timeout == -1 || wait < timeout) timeout = wait;
+            }
+            pclients[nclients++] = client;
+            pfds[count++] = (struct pollfd){.fd = client->fd, .events = events};
+        }
+
+        if (poll(pfds, count, timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned i = 0; i < SERVICE_COUNT; i++) {
+            if (pfds[i].revents & POLLIN) client_accept(i);
+        }
+        if (pfds[SERVICE_COUNT].revents & POLLIN) dns_answer();
+
+        for (unsigned i = 0; i < nclients; i++) {
+            struct client *client = pclients[i];
+            short revents = pfds[SERVICE_COUNT + 1 + i].revents;
+            if (revents & POLLOUT) client_write(client);
+            if (client->fd != -1 && revents & (POLLIN | POLLHUP | POLLERR)) {
+                client_read(client);
+            }
+
+            // Close once everything that was asked for has been sent
+            if (client->fd != -1 && client->closing &&
+                    !client_wants_write(client) &&
+                    client->out_pos == client->out_size) {
+                client_close(client);
+            }
+        }
+    }
+}
@@ -5,13 +5,38 @@
 #include <util/delay.h>
 
 #include "gbridge_cmd.h"
+#include "gbridge_codec.h"
 #include "serial.h"
 #include "timer.h"
 
+// Capabilities supported by this implementation
+#ifdef SERIAL_RTS
+#define CAPS_RTSCTS GBRIDGE_CAP_RTSCTS
+#else
+#define CAPS_RTSCTS 0
+#endif
+#define GBRIDGE_CAPS (GBRIDGE_CAP_WINDOW | GBRIDGE_CAP_COBS | \
+    GBRIDGE_CAP_BAUD | GBRIDGE_CAP_CREDIT | CAPS_RTSCTS | GBRIDGE_CAP_PUSH | \
+    GBRIDGE_CAP_EVENTS | GBRIDGE_CAP_EXT | GBRIDGE_CAP_INLINE)
+
+// Biggest data packet that is copied for retransmission
+// Bigger packets, as well as streams, wait until they're acknowledged instead.
+#define SEND_COPY_SIZE 0x18
+
+// Time it takes for the last bytes to leave the UART at the slowest rate
+#define BAUD_DRAIN_US (2 * 10 * 1000000 / GBRIDGE_BAUD)
+
+// Bytes taken out of the receive buffer before the bridge is told about it
+#define CREDIT_STEP 0x10
+
 static bool connected;
+static unsigned caps;
 
 static const unsigned char handshake[] PROGMEM = GBRIDGE_HANDSHAKE;
+static const unsigned char handshake_ext[] PROGMEM = GBRIDGE_HANDSHAKE_EXT;
 static unsigned char handshake_progress;
+static bool handshake_caps;
+static bool handshake_caps_ext;
 
 static enum gbridge_cmd processing_cmd;
 static unsigned char processing_cmd_state;
@@ -20,26 +45,147 @@ static uint32_t processing_cmd_time;
 static enum gbridge_cmd waiting_cmd;
 static uint32_t waiting_cmd_time;
 
-static unsigned char data_buf[GBRIDGE_MAX_DATA_SIZE];
-static struct gbridge_data data;
+// Received data packets, queued up until they're processed
+static unsigned char data_queue_buf[GBRIDGE_WINDOW_SIZE][GBRIDGE_MAX_DATA_SIZE_PC];
+static struct gbridge_data data_queue[GBRIDGE_WINDOW_SIZE];
+static unsigned char data_queue_seq[GBRIDGE_WINDOW_SIZE];
+static unsigned char data_first;
+static unsigned char data_count;
 static unsigned char data_len;
 static unsigned char data_cur;
-static bool data_ready;
 
-static struct gbridge_data stream_recv;
+static unsigned char *stream_buffer;
+static unsigned stream_size;
 static unsigned stream_max_size;
 static unsigned stream_cur;
-static unsigned stream_checksum;
+static uint16_t stream_checksum;  // Of streams that are only checked
+static bool stream_early;  // The stream arrived before its buffer was set
+static bool stream_missed;  // A stream has been thrown away for that reason
+
+// Frames that haven't been acknowledged yet, kept for retransmission
+struct send_frame {
+    enum gbridge_cmd cmd;
+    unsigned size;
+    const unsigned char *buffer;
+};
+static struct send_frame send_queue[GBRIDGE_WINDOW_SIZE];
+static unsigned char send_queue_buf[GBRIDGE_WINDOW_SIZE][SEND_COPY_SIZE];
+
+// Windowed mode sequence numbers
+static unsigned char send_seq;  // Next frame to be sent
+static unsigned char send_acked;  // Oldest frame that hasn't been acknowledged
+static unsigned char send_window;  // First frame the receiver can't take
+static unsigned char send_kept_seq;  // Last frame the caller keeps around
+static uint32_t send_time;
+static unsigned char send_retries;
+static bool send_timing;  // Measuring the round-trip time of a frame
+static unsigned char send_timing_seq;
+static uint32_t send_timing_time;
+
+static unsigned char recv_seq;  // Next frame to be received
+static unsigned char recv_frame_seq;
+static unsigned char recv_acked;  // Last acknowledgement sent
+static unsigned char recv_acked_window;
+static bool recv_nak_sent;
+static unsigned char recv_window_probes;
+static uint32_t recv_window_time;
+static enum gbridge_cmd recv_resync_cmd;
+static uint32_t recv_resync_time;
+
+// Round-trip time estimation, in microseconds
+static bool rtt_measured;
+static uint32_t rtt_avg;
+static uint32_t rtt_var;
+static uint32_t rto;
+
+// COBS decoder, with a few bytes of lookahead for the frame parsers
+static struct gbridge_cobs cobs_state;
+static unsigned char cobs_buf[4];
+static unsigned char cobs_first;
+static unsigned char cobs_len;
+
+// Baud rate switching
+static const unsigned char baud_pattern[] PROGMEM = GBRIDGE_BAUD_PATTERN;
+static unsigned long baud = GBRIDGE_BAUD;
+static unsigned long baud_prev;
+static bool baud_pending;  // Waiting for the test pattern at the new rate
+static uint32_t baud_time;
+static bool baud_test_ok;
+static unsigned char baud_test_cur;
+
+// Receive buffer credits, counting bytes modulo 0x100
+static unsigned char credit_epoch;
+static unsigned char credit_base;  // Consumed bytes when counting restarted
+static unsigned char credit_limit;  // Last limit sent to the bridge
+static unsigned char credit_overruns;  // Last overrun count sent
+static bool credit_update;
+
+static void baud_set(unsigned long bauds)
+{
+    serial_drain();
+    _delay_us(BAUD_DRAIN_US);
+    serial_set_bauds(bauds);
+    baud = bauds;
+}
+
+// Switch baud rates, discarding whatever is being received
+static void baud_switch(unsigned long bauds)
+{
+    baud_set(bauds);
+    processing_cmd = GBRIDGE_CMD_NONE;
+    cobs_state = (struct gbridge_cobs){.skip = true};
+    cobs_len = 0;
+}
 
 void gbridge_init(void)
 {
     connected = false;
+    caps = 0;
     handshake_progress = 0;
+    handshake_caps = false;
+    handshake_caps_ext = false;
     waiting_cmd = GBRIDGE_CMD_NONE;
     processing_cmd = GBRIDGE_CMD_NONE;
-    data_ready = false;
-    data = (struct gbridge_data){.buffer = data_buf};
+    for (unsigned char i = 0; i < GBRIDGE_WINDOW_SIZE; i++) {
+        data_queue[i] = (struct gbridge_data){.buffer = data_queue_buf[i]};
+    }
+    data_first = 0;
+    data_count = 0;
     stream_max_size = 0;
+    stream_missed = false;
+    send_seq = 0;
+    send_acked = 0;
+    send_window = GBRIDGE_WINDOW_SIZE;
+    send_kept_seq = -1;
+    send_retries = 0;
+    send_timing = false;
+    recv_seq = 0;
+    recv_acked = -1;
+    recv_acked_window = GBRIDGE_WINDOW_SIZE;
+    recv_nak_sent = false;
+    recv_window_probes = 0;
+    recv_resync_cmd = GBRIDGE_CMD_NONE;
+    rtt_measured = false;
+    rto = GBRIDGE_RTO_MAX_US;
+    cobs_state = (struct gbridge_cobs){0};
+    cobs_len = 0;
+    baud_pending = false;
+    if (baud != GBRIDGE_BAUD) baud_set(GBRIDGE_BAUD);
+}
+
+static void handshake_reply(const unsigned char *magic)
+{
+    for (unsigned char i = 0; i < sizeof(handshake); i++) {
+        serial_putchar(pgm_read_byte(magic + i));
+    }
+}
+
+// Start counting received bytes from the current position
+static void credit_restart(unsigned char epoch)
+{
+    credit_epoch = epoch;
+    credit_base = serial_rx_consumed();
+    credit_update = true;
 }
 
 static bool do_handshake(void)
@@ -47,6 +193,39 @@ static bool do_handshake(void)
     if (!serial_available()) return false;
 
     unsigned char c = serial_getchar();
+
+    // The extended handshake is followed by the bridge's capabilities
+    if (handshake_caps) {
+        handshake_caps = false;
+        caps = c & GBRIDGE_CAPS;
+        handshake_reply(handshake_ext);
+        serial_putchar(caps);
+
+        // Another byte of them follows if both sides know about it
+        if (caps & GBRIDGE_CAP_EXT) {
+            handshake_caps_ext = true;
+            return false;
+        }
+        credit_restart(0);
+        return true;
+    }
+    if (handshake_caps_ext) {
+        handshake_caps_ext = false;
+        unsigned char ext = c & (GBRIDGE_CAPS >> 8);
+        caps |= ext << 8;
+        serial_putchar(ext);
+        credit_restart(0);
+        return true;
+    }
+
+    // Both handshakes only differ in their last byte
+    if (handshake_progress == sizeof(handshake) - 1 &&
+            pgm_read_byte(handshake_ext + handshake_progress) == c) {
+        handshake_progress = 0;
+        handshake_caps = true;
+        return false;
+    }
+
     if (pgm_read_byte(handshake + handshake_progress) != c) {
         handshake_progress = c == pgm_read_byte(handshake + 0);
         return false;
@@ -56,22 +235,256 @@ static bool do_handshake(void)
     handshake_progress = 0;
 
     // Reply handshake
-    for (unsigned char i = 0; i < sizeof(handshake); i++) {
-        serial_putchar(pgm_read_byte(handshake + i));
-    }
+    handshake_reply(handshake);
     return true;
 }
 
-static void checksum_add(uint16_t *checksum, const unsigned char *data, unsigned char size)
+static inline bool windowed(void)
+{
+    return caps & GBRIDGE_CAP_WINDOW;
+}
+
+static inline bool cobs(void)
+{
+    return (caps & GBRIDGE_CAP_COBS) && windowed();
+}
+
+static inline bool baud_switching(void)
+{
+    return (caps & GBRIDGE_CAP_BAUD) && cobs();
+}
+
+static inline bool credits(void)
+{
+    return (caps & GBRIDGE_CAP_CREDIT) && cobs();
+}
+
+static void frame_put(void *user, unsigned char c)
+{
+    (void)user;
+    serial_putchar(c);
+}
+
+// Send a frame, encoding it if necessary
+static void frame_write(const struct gbridge_frame_part *parts, unsigned char count)
+{
+    gbridge_frame_encode(parts, count, cobs(), frame_put, NULL);
+}
+
+static void frame_write_bytes(const unsigned char *buffer, unsigned size)
+{
+    frame_write(&(struct gbridge_frame_part){buffer, size}, 1);
+}
+
+static void cobs_decode(unsigned char c)
+{
+    int res = gbridge_cobs_decode(&cobs_state, c);
+    if (res < 0) return;
+    cobs_buf[(cobs_first + cobs_len++) % sizeof(cobs_buf)] = res;
+}
+
+// Amount of bytes of the current frame that can be read
+static unsigned recv_available(void)
 {
-    for (unsigned char i = 0; i < size; i++) *checksum += data[i];
+    if (!cobs()) return serial_available();
+
+    while (!cobs_state.end && cobs_len < sizeof(cobs_buf) && serial_available()) {
+        cobs_decode(serial_getchar());
+    }
+    return cobs_len;
+}
+
+static unsigned char recv_getchar(void)
+{
+    if (!cobs()) return serial_getchar();
+
+    unsigned char c = cobs_buf[cobs_first];
+    cobs_first = (cobs_first + 1) % sizeof(cobs_buf);
+    cobs_len--;
+    return c;
+}
+
+// Skip whatever is left of the current frame
+static void recv_frame_done(void)
+{
+    if (!cobs()) return;
+
+    cobs_len = 0;
+    if (cobs_state.end) {
+        cobs_state.end = false;
+    } else {
+        cobs_state.skip = true;
+    }
+}
+
+static void checksum_add(uint16_t *checksum, const unsigned char *data, unsigned size)
+{
+    // The original protocol only checksums the first (size % 0x100) bytes,
+    //   which is kept for compatibility.
+    if (!windowed()) size = (unsigned char)size;
+    *checksum += gbridge_checksum(data, size);
+}
+
+// Update the round-trip time estimate, and the resulting timeout (RFC 6298)
+static void rtt_sample(uint32_t rtt)
+{
+    if (!rtt_measured) {
+        rtt_measured = true;
+        rtt_avg = rtt;
+        rtt_var = rtt / 2;
+    } else {
+        uint32_t delta = rtt > rtt_avg ? rtt - rtt_avg : rtt_avg - rtt;
+        rtt_var = (3 * rtt_var + delta) / 4;
+        rtt_avg = (7 * rtt_avg + rtt) / 8;
+    }
+    rto = rtt_avg + 4 * rtt_var;
+    if (rto < GBRIDGE_RTO_MIN_US) rto = GBRIDGE_RTO_MIN_US;
+    if (rto > GBRIDGE_RTO_MAX_US) rto = GBRIDGE_RTO_MAX_US;
+}
+
+// Acknowledge every frame that has been received, and let the bridge know
+//   how many more data packets can be queued up.
+static void send_ack_window(void)
+{
+    unsigned char ack = recv_seq - 1;
+    unsigned char window = GBRIDGE_WINDOW_SIZE - data_count;
+    if (ack == recv_acked && window == recv_acked_window) return;
+
+    // If the bridge was waiting for the window to open, this acknowledgement
+    //   may need to be repeated in case it gets lost.
+    if (!recv_acked_window && window) {
+        recv_window_probes = GBRIDGE_RETRIES;
+        recv_window_time = timer_get();
+    }
+
+    frame_write_bytes((unsigned char []){GBRIDGE_CMD_ACK, ack, window}, 3);
+    recv_acked = ack;
+    recv_acked_window = window;
+}
+
+// Let the bridge know how far it can send, once enough bytes have been taken
+//   out of the receive buffer, or more of them have been lost
+static void send_credit(void)
+{
+    unsigned char limit = serial_rx_consumed() - credit_base +
+        SERIAL_BUFFER_SIZE - 1;
+    unsigned char overruns = serial_rx_overruns();
+    if (!credit_update && overruns == credit_overruns &&
+            (unsigned char)(limit - credit_limit) < CREDIT_STEP) {
+        return;
+    }
+
+    frame_write_bytes((unsigned char []){
+        GBRIDGE_CMD_CREDIT, credit_epoch, limit, overruns,
+        ~(credit_epoch + limit + overruns)}, 5);
+    credit_limit = limit;
+    credit_overruns = overruns;
+    credit_update = false;
+}
+
+// Ask the bridge to retransmit everything from the expected frame onwards
+static void send_nak(enum gbridge_cmd cmd)
+{
+    frame_write_bytes((unsigned char []){
+        (cmd + 1) | GBRIDGE_CMD_REPLY_F, recv_seq}, 2);
+    recv_nak_sent = true;
+}
+
+// Discard the rest of a broken frame, and request it again
+// This only works in windowed mode, otherwise the link has to be reset.
+static char recv_fail(enum gbridge_cmd cmd)
+{
+    if (!windowed()) return -1;
+
+    // With COBS framing, the next frame is easily found
+    if (cobs()) {
+        send_nak(cmd);
+        return 1;
+    }
+
+    recv_resync_cmd = cmd;
+    recv_resync_time = timer_get();
+    return 1;
 }
 
-static uint16_t checksum_data(struct gbridge_data data)
+// Check the sequence number of a received frame
+// Returns false if the frame has to be discarded
+static bool recv_frame_check_seq(enum gbridge_cmd cmd)
 {
+    if (!windowed()) return true;
+    if (recv_frame_seq == recv_seq) {
+        recv_seq++;
+        recv_nak_sent = false;
+        recv_window_probes = 0;
+        return true;
+    }
+
+    // Frames we've already received have lost their acknowledgement, but
+    //   frames from further ahead mean something went missing.
+    if ((unsigned char)(recv_frame_seq - recv_seq) >= 0x80) {
+        // Forget the last acknowledgement, so it's sent again
+        recv_acked = recv_seq;
+    } else if (!recv_nak_sent) {
+        send_nak(cmd);
+    }
+    return false;
+}
+
+static void send_frame(const struct send_frame *frame, unsigned char seq)
+{
+    unsigned char header[4];
+    unsigned char header_size = 0;
     uint16_t checksum = 0;
-    for (unsigned char i = 0; i < data.size; i++) checksum += data.buffer[i];
-    return checksum;
+
+    header[header_size++] = frame->cmd;
+    if (windowed()) {
+        header[header_size++] = seq;
+        checksum += seq;
+    }
+    if (frame->cmd == GBRIDGE_CMD_STREAM) {
+        header[header_size++] = frame->size >> 8;
+    }
+    header[header_size++] = frame->size >> 0;
+    checksum_add(&checksum, frame->buffer, frame->size);
+
+    frame_write((struct gbridge_frame_part []){
+        {header, header_size},
+        {frame->buffer, frame->size},
+        {(unsigned char []){checksum >> 8, checksum >> 0}, 2}
+    }, 3);
+}
+
+// Send every frame that hasn't been acknowledged again
+static void send_retransmit(void)
+{
+    for (unsigned char seq = send_acked; seq != send_seq; seq++) {
+        send_frame(&send_queue[seq % GBRIDGE_WINDOW_SIZE], seq);
+    }
+    send_time = timer_get();
+    send_timing = false;
+}
+
+static void recv_ack(unsigned char ack, unsigned char window)
+{
+    // Ignore acknowledgements for frames that haven't been sent
+    if ((unsigned char)(ack + 1 - send_acked) >
+            (unsigned char)(send_seq - send_acked)) {
+        return;
+    }
+    if (window > GBRIDGE_WINDOW_SIZE) return;
+
+    if ((unsigned char)(ack + 1) != send_acked) {
+        if (send_timing &&
+                (unsigned char)(ack - send_timing_seq) <
+                (unsigned char)(send_seq - send_timing_seq)) {
+            rtt_sample(timer_get() - send_timing_time);
+            send_timing = false;
+        }
+        send_acked = ack + 1;
+        send_time = timer_get();
+        send_retries = 0;
+    }
+    send_window = ack + 1 + window;
 }
 
 static char recv_cmd_reset(void)
@@ -81,44 +494,166 @@ static char recv_cmd_reset(void)
     return 1;
 }
 
+static char recv_cmd_ack_pc(void)
+{
+    if (!windowed()) return -1;
+    if (recv_available() < 2) return 0;
+
+    unsigned char ack = recv_getchar();
+    unsigned char window = recv_getchar();
+    recv_ack(ack, window);
+    return 1;
+}
+
+static char recv_cmd_fail_pc(void)
+{
+    if (!windowed()) return 1;
+    if (!recv_available()) return 0;
+
+    // Everything before the requested frame has been received
+    unsigned char seq = recv_getchar();
+    if ((unsigned char)(seq - send_acked) >
+            (unsigned char)(send_seq - send_acked)) {
+        return 1;
+    }
+    if (seq != send_acked) send_retries = 0;
+    send_acked = seq;
+    send_retransmit();
+    return 1;
+}
+
+static char recv_cmd_baud_pc(void)
+{
+    if (!baud_switching()) return 1;
+    if (recv_available() < 4) return 0;
+
+    unsigned long bauds = 0;
+    for (unsigned char i = 0; i < 4; i++) bauds = bauds << 8 | recv_getchar();
+
+    // Only rates that can be generated exactly are supported
+    if (bauds < GBRIDGE_BAUD || (F_CPU / 8) % bauds) bauds = 0;
+    serial_putchar(0);
+    frame_write_bytes((unsigned char []){
+        GBRIDGE_CMD_BAUD_PC | GBRIDGE_CMD_REPLY_F,
+        bauds >> 24, bauds >> 16, bauds >> 8, bauds >> 0
+    }, 5);
+    if (!bauds) return 1;
+
+    if (!baud_pending) baud_prev = baud;
+    baud_switch(bauds);
+    baud_pending = true;
+    baud_time = timer_get();
+    return 1;
+}
+
+static char recv_cmd_baud_test_pc(void)
+{
+    if (!baud_switching()) return 1;
+    if (!processing_cmd_state) {
+        baud_test_ok = true;
+        baud_test_cur = 0;
+        processing_cmd_state = 1;
+    }
+
+    while (baud_test_cur < sizeof(baud_pattern) * GBRIDGE_BAUD_PATTERN_REPEAT &&
+            recv_available()) {
+        unsigned char c = recv_getchar();
+        unsigned char pos = baud_test_cur++ % sizeof(baud_pattern);
+        if (c != pgm_read_byte(baud_pattern + pos)) {
+            baud_test_ok = false;
+        }
+    }
+    if (baud_test_cur < sizeof(baud_pattern) * GBRIDGE_BAUD_PATTERN_REPEAT) {
+        return 0;
+    }
+    if (!baud_pending) return 1;
+    baud_pending = false;
+
+    if (!baud_test_ok) {
+        baud_switch(baud_prev);
+        return 1;
+    }
+
+    // Let the bridge test the other direction
+    unsigned char pattern[sizeof(baud_pattern)];
+    for (unsigned char i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = pgm_read_byte(baud_pattern + i);
+    }
+    struct gbridge_frame_part parts[1 + GBRIDGE_BAUD_PATTERN_REPEAT];
+    parts[0] = (struct gbridge_frame_part){
+        (unsigned char []){GBRIDGE_CMD_BAUD_TEST_PC | GBRIDGE_CMD_REPLY_F}, 1};
+    for (unsigned char i = 1; i < sizeof(parts) / sizeof(*parts); i++) {
+        parts[i] = (struct gbridge_frame_part){pattern, sizeof(pattern)};
+    }
+    serial_putchar(0);
+    frame_write(parts, sizeof(parts) / sizeof(*parts));
+    return 1;
+}
+
+static char recv_cmd_credit_pc(void)
+{
+    if (!credits()) return 1;
+
+    // The bridge counts from right after this frame
+    if (recv_available() < 2 || !cobs_state.end) return 0;
+    unsigned char epoch = recv_getchar();
+    if ((unsigned char)~epoch != recv_getchar()) {
+        return recv_fail(GBRIDGE_CMD_DATA_PC);
+    }
+    credit_restart(epoch);
+    return 1;
+}
+
 static char recv_cmd_data_pc(void)
 {
-    if (data_ready) return -1;
+    if (data_count >= GBRIDGE_WINDOW_SIZE) {
+        return recv_fail(GBRIDGE_CMD_DATA_PC);
+    }
 
+    unsigned char slot = (data_first + data_count) % GBRIDGE_WINDOW_SIZE;
+    struct gbridge_data *data = &data_queue[slot];
     uint16_t checksum;
 
     switch (processing_cmd_state) {
     case 0:
-        if (!serial_available()) break;
-        data_len = serial_getchar();
-        if (data_len > GBRIDGE_MAX_DATA_SIZE) return -1;
+        if (recv_available() < 1u + windowed()) break;
+        if (windowed()) recv_frame_seq = recv_getchar();
+        data_len = recv_getchar();
+        if (data_len > GBRIDGE_MAX_DATA_SIZE_PC) {
+            return recv_fail(GBRIDGE_CMD_DATA_PC);
+        }
 
         data_cur = 0;
         processing_cmd_state = 1;
         // fallthrough
     case 1:
-        while (serial_available()) {
-            data.buffer[data_cur++] = serial_getchar();
-            if (data_cur >= data_len) {
-                data.size = data_len;
-                processing_cmd_state = 2;
-                break;
-            }
+        while (data_cur < data_len && recv_available()) {
+            data->buffer[data_cur++] = recv_getchar();
         }
-        if (processing_cmd_state == 1) break;
+        if (data_cur < data_len) break;
+        data->size = data_len;
+        processing_cmd_state = 2;
         // fallthrough
     case 2:
-        if (serial_available() < 2) break;
+        if (recv_available() < 2) break;
 
-        checksum = serial_getchar() << 8;
-        checksum |= serial_getchar() << 0;
+        checksum = recv_getchar() << 8;
+        checksum |= recv_getchar() << 0;
+        if (windowed()) checksum -= recv_frame_seq;
 
-        if (checksum != checksum_data(data)) {
-            // TODO: Implement retrying?
-            return -1;
+        uint16_t data_checksum = 0;
+        checksum_add(&data_checksum, data->buffer, data->size);
+        if (checksum != data_checksum) {
+            return recv_fail(GBRIDGE_CMD_DATA_PC);
+        }
+        if (!recv_frame_check_seq(GBRIDGE_CMD_DATA_PC)) return 1;
+        data_queue_seq[slot] = recv_frame_seq;
+        data_count++;
+        if (windowed()) {
+            send_ack_window();
+        } else {
+            serial_putchar(GBRIDGE_CMD_DATA_PC | GBRIDGE_CMD_REPLY_F);
         }
-        serial_putchar(GBRIDGE_CMD_DATA_PC | GBRIDGE_CMD_REPLY_F);
-        data_ready = true;
         return 1;
     }
     return 0;
@@ -126,51 +661,132 @@ static char recv_cmd_data_pc(void)
 
 static char recv_cmd_stream_pc(void)
 {
-    if (!stream_max_size) return -1;
-
     uint16_t checksum;
 
     switch (processing_cmd_state) {
     case 0:
-        if (serial_available() < 2) break;
-        stream_recv.size = serial_getchar() << 8;
-        stream_recv.size |= serial_getchar() << 0;
-        if (stream_recv.size > stream_max_size) return -1;
+        // In windowed mode, the stream may arrive before the buffer is ready.
+        //   Rather than holding up the line until then, it's only checked,
+        //   and requested again once the buffer is set.
+        if (!stream_max_size && !windowed()) return -1;
+        if (recv_available() < 2u + windowed()) break;
+        if (windowed()) recv_frame_seq = recv_getchar();
+        stream_size = recv_getchar() << 8;
+        stream_size |= recv_getchar() << 0;
+        stream_early = !stream_max_size;
+        if (!stream_early && stream_size > stream_max_size) {
+            return recv_fail(GBRIDGE_CMD_STREAM_PC);
+        }
 
         stream_cur = 0;
+        stream_checksum = 0;
         processing_cmd_state = 1;
         // fallthrough
     case 1:
-        while (serial_available()) {
-            stream_recv.buffer[stream_cur++] = serial_getchar();
-            if (stream_cur >= stream_recv.size) {
-                processing_cmd_state = 2;
-                break;
+        while (stream_cur < stream_size && recv_available()) {
+            unsigned char c = recv_getchar();
+            if (stream_buffer && !stream_early) {
+                stream_buffer[stream_cur] = c;
+            } else if (windowed() || stream_cur < (unsigned char)stream_size) {
+                stream_checksum += c;
             }
+            stream_cur++;
         }
-        if (processing_cmd_state == 1) break;
+        if (stream_cur < stream_size) break;
+        processing_cmd_state = 2;
         // fallthrough
     case 2:
-        if (serial_available() < 2) break;
+        if (recv_available() < 2) break;
 
-        checksum = serial_getchar() << 8;
-        checksum |= serial_getchar() << 0;
+        checksum = recv_getchar() << 8;
+        checksum |= recv_getchar() << 0;
+        if (windowed()) checksum -= recv_frame_seq;
 
-        if (checksum != checksum_data(stream_recv)) {
-            // TODO: Implement retrying?
-            return -1;
+        if (stream_buffer && !stream_early) {
+            stream_checksum = 0;
+            checksum_add(&stream_checksum, stream_buffer, stream_size);
         }
-        serial_putchar(GBRIDGE_CMD_STREAM_PC | GBRIDGE_CMD_REPLY_F);
+        if (checksum != stream_checksum) {
+            return recv_fail(GBRIDGE_CMD_STREAM_PC);
+        }
+
+        // Only the expected stream is thrown away, as the ones that were
+        //   already received still have to be acknowledged
+        if (stream_early && recv_frame_seq == recv_seq) {
+            stream_missed = !stream_max_size;
+            if (stream_max_size) send_nak(GBRIDGE_CMD_STREAM_PC);
+            return 1;
+        }
+        if (!recv_frame_check_seq(GBRIDGE_CMD_STREAM_PC)) return 1;
         stream_max_size = 0;
+        if (windowed()) {
+            send_ack_window();
+        } else {
+            serial_putchar(GBRIDGE_CMD_STREAM_PC | GBRIDGE_CMD_REPLY_F);
+        }
         return 1;
     }
     return 0;
 }
 
-void gbridge_loop(void)
+// Handle everything that's time-dependent in windowed mode
+// Returns false if the link has been reset
+static bool loop_windowed(void)
 {
-    // TODO: Decouple receiving from sending
+    // Drop everything until the line goes quiet, then request a retransmission
+    if (recv_resync_cmd != GBRIDGE_CMD_NONE) {
+        while (serial_available()) {
+            serial_getchar();
+            recv_resync_time = timer_get();
+        }
+        if (timer_get() - recv_resync_time < GBRIDGE_RESYNC_US) return true;
+        send_nak(recv_resync_cmd);
+        recv_resync_cmd = GBRIDGE_CMD_NONE;
+    }
 
+    // Go back to the previous baud rate if the new one doesn't work
+    if (baud_pending && timer_get() - baud_time > GBRIDGE_BAUD_TIMEOUT_US) {
+        baud_pending = false;
+        baud_switch(baud_prev);
+    }
+
+    // Abort frames that stopped arriving halfway
+    if (processing_cmd != GBRIDGE_CMD_NONE &&
+            timer_get() - processing_cmd_time > rto) {
+        if (processing_cmd == GBRIDGE_CMD_STREAM_PC) {
+            recv_fail(GBRIDGE_CMD_STREAM_PC);
+        } else {
+            recv_fail(GBRIDGE_CMD_DATA_PC);
+        }
+        recv_frame_done();
+        processing_cmd = GBRIDGE_CMD_NONE;
+        return true;
+    }
+
+    // Retransmit frames that haven't been acknowledged in time
+    if (send_seq != send_acked && !baud_pending &&
+            timer_get() - send_time > rto) {
+        if (++send_retries > GBRIDGE_RETRIES) {
+            gbridge_init();
+            return false;
+        }
+        rto *= 2;
+        if (rto > GBRIDGE_RTO_MAX_US) rto = GBRIDGE_RTO_MAX_US;
+        send_retransmit();
+    }
+
+    if (recv_window_probes && timer_get() - recv_window_time > rto) {
+        recv_window_probes--;
+        recv_window_time = timer_get();
+        recv_acked = recv_seq;
+    }
+    send_ack_window();
+    if (credits()) send_credit();
+    return true;
+}
+
+void gbridge_loop(void)
+{
     // Make sure we've passed the handshake first
     if (!connected) {
         if (!do_handshake()) return;
@@ -178,7 +794,10 @@ void gbridge_loop(void)
     }
 
     // Handle timeout
-    if (processing_cmd != GBRIDGE_CMD_NONE &&
+    if (windowed()) {
+        if (!loop_windowed()) return;
+        if (recv_resync_cmd != GBRIDGE_CMD_NONE) return;
+    } else if (processing_cmd != GBRIDGE_CMD_NONE &&
             timer_get() - processing_cmd_time > GBRIDGE_TIMEOUT_US) {
         gbridge_init();
         return;
@@ -191,11 +810,19 @@ void gbridge_loop(void)
 
     // Wait until we receive a command
     if (processing_cmd == GBRIDGE_CMD_NONE) {
-        if (!serial_available()) return;
-        enum gbridge_cmd cmd = serial_getchar();
+        if (!recv_available()) {
+            // Skip empty frames
+            if (cobs_state.end) recv_frame_done();
+            return;
+        }
+        enum gbridge_cmd cmd = recv_getchar();
         if (cmd == GBRIDGE_CMD_NONE) return;
 
         // If wait_cmd() has been called, process that
+        // Only the original protocol waits for replies, with a single frame
+        //   in flight at a time, so nothing else arrives meanwhile. In
+        //   windowed mode, frames are received while others are still
+        //   being sent.
         if (waiting_cmd != GBRIDGE_CMD_NONE) {
             if (cmd == (waiting_cmd | GBRIDGE_CMD_REPLY_F)) {
                 waiting_cmd = GBRIDGE_CMD_NONE;
@@ -208,11 +835,29 @@ void gbridge_loop(void)
         processing_cmd_time = timer_get();
     }
 
+    unsigned available = serial_available();
+
     char rc;
-    switch (processing_cmd) {
+    switch ((unsigned char)processing_cmd) {
     case GBRIDGE_CMD_RESET:
         rc = recv_cmd_reset();
         break;
+    case GBRIDGE_CMD_ACK_PC:
+        rc = recv_cmd_ack_pc();
+        break;
+    case GBRIDGE_CMD_DATA_FAIL | GBRIDGE_CMD_REPLY_F:
+    case GBRIDGE_CMD_STREAM_FAIL | GBRIDGE_CMD_REPLY_F:
+        rc = recv_cmd_fail_pc();
+        break;
+    case GBRIDGE_CMD_BAUD_PC:
+        rc = recv_cmd_baud_pc();
+        break;
+    case GBRIDGE_CMD_BAUD_TEST_PC:
+        rc = recv_cmd_baud_test_pc();
+        break;
+    case GBRIDGE_CMD_CREDIT_PC:
+        rc = recv_cmd_credit_pc();
+        break;
     case GBRIDGE_CMD_DATA_PC:
         rc = recv_cmd_data_pc();
         break;
@@ -223,8 +868,24 @@ void gbridge_loop(void)
         rc = 1;
         break;
     }
-    if (rc == 1) processing_cmd = GBRIDGE_CMD_NONE;
+
+    // Frames that end too early are broken
+    if (rc == 0 && cobs_state.end) {
+        if (processing_cmd == GBRIDGE_CMD_STREAM_PC) {
+            rc = recv_fail(GBRIDGE_CMD_STREAM_PC);
+        } else {
+            rc = recv_fail(GBRIDGE_CMD_DATA_PC);
+        }
+    }
+
+    if (rc == 1) {
+        recv_frame_done();
+        processing_cmd = GBRIDGE_CMD_NONE;
+    }
     if (rc == -1) gbridge_init();
+
+    // Frames only time out when nothing arrives for a while
+    if (serial_available() != available) processing_cmd_time = timer_get();
 }
 
 bool gbridge_connected(void)
@@ -232,10 +893,17 @@ bool gbridge_connected(void)
     return connected;
 }
 
+// Capabilities that are in use on the current link
+unsigned gbridge_caps(void)
+{
+    if (!windowed()) return 0;
+    return caps;
+}
+
 const struct gbridge_data *gbridge_recv_data(void)
 {
-    if (!data_ready) return NULL;
-    return &data;
+    if (!data_count) return NULL;
+    return &data_queue[data_first];
 }
 
 const struct gbridge_data *gbridge_recv_data_wait(void)
@@ -250,17 +918,27 @@ const struct gbridge_data *gbridge_recv_data_wait(void)
 
 void gbridge_recv_data_done(void)
 {
-    data_ready = false;
+    if (!data_count) return;
+    data_first = (data_first + 1) % GBRIDGE_WINDOW_SIZE;
+    data_count--;
 }
 
 // Initialize stream receive buffer when it's expected
+// Without a buffer, the stream is received and thrown away, while a size of
+//   zero means no stream is expected anymore.
 void gbridge_recv_stream(void *buffer, unsigned max_size)
 {
-    stream_recv.buffer = buffer;
-    stream_recv.size = 0;
+    // A stream that's being thrown away is left alone until it's over
+    stream_buffer = buffer;
     stream_max_size = max_size;
-    stream_cur = 0;
-    stream_checksum = 0;
+
+    // Ask for a stream that arrived too early right away, rather than waiting
+    //   for the bridge to time out
+    if (max_size && stream_missed &&
+            !(processing_cmd == GBRIDGE_CMD_STREAM_PC && stream_early)) {
+        stream_missed = false;
+        send_nak(GBRIDGE_CMD_STREAM_PC);
+    }
 }
 
 // Check if the stream has been fully received
@@ -295,6 +973,65 @@ static void wait_cmd(unsigned char cmd)
     while (waiting_cmd == cmd) gbridge_loop();
 }
 
+static bool window_full(void)
+{
+    return (unsigned char)(send_seq - send_acked) >= GBRIDGE_WINDOW_SIZE ||
+        (unsigned char)(send_window - send_seq - 1) >= GBRIDGE_WINDOW_SIZE;
+}
+
+// Wait until the bridge is able to take another frame
+static void wait_window(void)
+{
+    while (connected && window_full()) gbridge_loop();
+}
+
+// Check if a frame can be sent without waiting for the bridge
+// Without windowed mode, every frame waits for its reply regardless.
+bool gbridge_cmd_ready(void)
+{
+    if (!connected) return false;
+    if (!windowed()) return true;
+    return !window_full();
+}
+
+// Send a frame, keeping it around until it's been acknowledged
+// If the buffer isn't copied, this waits for the acknowledgement instead,
+//   unless the caller keeps the buffer around itself.
+static void send_frame_queue(enum gbridge_cmd cmd, const void *buffer, unsigned size, bool wait)
+{
+    struct send_frame frame = {.cmd = cmd, .size = size, .buffer = buffer};
+    if (!windowed()) {
+        send_frame(&frame, 0);
+        wait_cmd(cmd);
+        return;
+    }
+
+    wait_window();
+    if (!connected) return;
+
+    unsigned char slot = send_seq % GBRIDGE_WINDOW_SIZE;
+    bool copy = cmd == GBRIDGE_CMD_DATA && size <= SEND_COPY_SIZE;
+    if (copy) {
+        memcpy(send_queue_buf[slot], buffer, size);
+        frame.buffer = send_queue_buf[slot];
+    }
+    send_queue[slot] = frame;
+
+    send_ack_window();
+    send_frame(&frame, send_seq);
+    if (send_seq == send_acked) send_time = timer_get();
+    if (!send_timing) {
+        send_timing = true;
+        send_timing_seq = send_seq;
+        send_timing_time = timer_get();
+    }
+    if (!copy) send_kept_seq = send_seq;
+    send_seq++;
+
+    if (copy || !wait) return;
+    while (connected && send_acked != send_seq) gbridge_loop();
+}
+
 // Send a debug message
 void gbridge_cmd_debug_line(const char *line)
 {
@@ -303,10 +1040,13 @@ void gbridge_cmd_debug_line(const char *line)
     size_t length = strlen(line);
     if (length > 0xff) return;
 
-    serial_putchar(GBRIDGE_CMD_DEBUG_LINE);
-    serial_putchar(length);
-    for (unsigned char i = 0; i < length; i++) serial_putchar(line[i]);
-    wait_cmd(GBRIDGE_CMD_DEBUG_LINE);
+    frame_write((struct gbridge_frame_part []){
+        {(unsigned char []){GBRIDGE_CMD_DEBUG_LINE, length}, 2},
+        {(const unsigned char *)line, length}
+    }, 2);
+
+    // Debug lines aren't acknowledged in windowed mode
+    if (!windowed()) wait_cmd(GBRIDGE_CMD_DEBUG_LINE);
 }
 
 // Send a data packet
@@ -315,46 +1055,40 @@ void gbridge_cmd_data(struct gbridge_data data)
     if (!connected) return;
     if (data.size > GBRIDGE_MAX_DATA_SIZE) return;
 
-    uint16_t checksum = 0;
-
-    serial_putchar(GBRIDGE_CMD_DATA);
-    serial_putchar(data.size);
-    for (unsigned char i = 0; i < data.size; i++) {
-        serial_putchar(data.buffer[i]);
-    }
-    checksum_add(&checksum, data.buffer, data.size);
-    serial_putchar(checksum >> 8);
-    serial_putchar(checksum >> 0);
-    wait_cmd(GBRIDGE_CMD_DATA);
+    send_frame_queue(GBRIDGE_CMD_DATA, data.buffer, data.size, true);
 }
 
-// Start a stream packet, allowing sending a big chunked message
-void gbridge_cmd_stream_start(unsigned length)
+// Send a data packet without waiting for the bridge to receive it
+// The buffer has to be left alone until gbridge_cmd_sent() is true.
+void gbridge_cmd_data_start(struct gbridge_data data)
 {
     if (!connected) return;
+    if (data.size > GBRIDGE_MAX_DATA_SIZE) return;
 
-    serial_putchar(GBRIDGE_CMD_STREAM);
-    serial_putchar(length >> 8);
-    serial_putchar(length >> 0);
-    stream_checksum = 0;
+    send_frame_queue(GBRIDGE_CMD_DATA, data.buffer, data.size, false);
 }
 
-// Send data within the stream packet
-void gbridge_cmd_stream_data(const void *data, unsigned length)
+// Send a stream packet, allowing sending a big message, and wait for the
+//   bridge to confirm the reception of the packet.
+void gbridge_cmd_stream(const void *buffer, unsigned size)
 {
     if (!connected) return;
 
-    checksum_add(&stream_checksum, data, length);
-    for (const char *c = data; length--; c++) serial_putchar(*c);
+    send_frame_queue(GBRIDGE_CMD_STREAM, buffer, size, true);
 }
 
-// Close off the stream packet, and wait for the bridge to confirm the
-//   reception of the packet.
-void gbridge_cmd_stream_finish(void)
+// Send a stream packet without waiting for the bridge to receive it
+// The buffer has to be left alone until gbridge_cmd_sent() is true.
+void gbridge_cmd_stream_start(const void *buffer, unsigned size)
 {
     if (!connected) return;
 
-    serial_putchar(stream_checksum >> 8);
-    serial_putchar(stream_checksum >> 0);
-    wait_cmd(GBRIDGE_CMD_STREAM);
+    send_frame_queue(GBRIDGE_CMD_STREAM, buffer, size, false);
+}
+
+// Check if the last packet sent without waiting has been received by the bridge
+bool gbridge_cmd_sent(void)
+{
+    return (unsigned char)(send_kept_seq - send_acked) >=
+        (unsigned char)(send_seq - send_acked);
 }
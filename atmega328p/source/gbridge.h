@@ -10,14 +10,17 @@ struct gbridge_data {
 void gbridge_init(void);
 void gbridge_loop(void);
 bool gbridge_connected(void);
+unsigned gbridge_caps(void);
 const struct gbridge_data *gbridge_recv_data(void);
 const struct gbridge_data *gbridge_recv_data_wait(void);
 void gbridge_recv_data_done(void);
 void gbridge_recv_stream(void *buffer, unsigned max_size);
 bool gbridge_recv_stream_done(void);
 bool gbridge_recv_stream_wait(void *buffer, unsigned max_size);
+bool gbridge_cmd_ready(void);
 void gbridge_cmd_debug_line(const char *line);
 void gbridge_cmd_data(struct gbridge_data data);
-void gbridge_cmd_stream_start(unsigned length);
-void gbridge_cmd_stream_data(const void *data, unsigned length);
-void gbridge_cmd_stream_finish(void);
+void gbridge_cmd_data_start(struct gbridge_data data);
+void gbridge_cmd_stream(const void *buffer, unsigned size);
+void gbridge_cmd_stream_start(const void *buffer, unsigned size);
+bool gbridge_cmd_sent(void);
@@ -2,11 +2,98 @@
 
 #define GBRIDGE_HANDSHAKE {0x99, 0x66, 'G', 'B'}
 
+// Extended handshake, followed by a byte of capability flags
+// The adapter replies with the same sequence, followed by the flags that
+//   both sides support. Adapters that don't know it simply don't reply.
+// If both sides support EXT, the bridge then sends a second byte of flags,
+//   and the adapter replies with the ones both sides support, like with the
+//   first one. Its top bit is kept for a third byte, should it be needed.
+#define GBRIDGE_HANDSHAKE_EXT {0x99, 0x66, 'G', 'X'}
+
+// Capabilities negotiated through the extended handshake
+#define GBRIDGE_CAP_WINDOW 0x01  // Sequence numbers and cumulative acks
+#define GBRIDGE_CAP_COBS 0x02  // COBS framing, only used in windowed mode
+#define GBRIDGE_CAP_BAUD 0x04  // Baud rate switching, only used with COBS
+#define GBRIDGE_CAP_CREDIT 0x08  // Receive buffer credits, only used with COBS
+#define GBRIDGE_CAP_RTSCTS 0x10  // The adapter drives the CTS line
+#define GBRIDGE_CAP_PUSH 0x20  // Socket data is pushed, only used in windowed mode
+#define GBRIDGE_CAP_EVENTS 0x40  // Socket states are pushed, only used with PUSH
+#define GBRIDGE_CAP_EXT 0x80  // Another byte of flags follows
+
+// Capabilities in the second byte of flags
+#define GBRIDGE_CAP_INLINE 0x0100  // Socket data within requests, only used in windowed mode
+
+// In windowed mode, DATA and STREAM frames carry a sequence number right after
+//   the command byte, which is included in the checksum. Instead of replying
+//   to every frame, the receiver sends an ACK with the sequence number of the
+//   last frame it has received, followed by the amount of data packets it's
+//   able to queue up after it.
+// Frames that fail their checksum or arrive out of order are answered with
+//   the FAIL command of the frame, with the reply flag set, followed by the
+//   sequence number the receiver expects. The sender then retransmits every
+//   frame from that one onwards, as it also does when an ACK doesn't arrive
+//   in time.
+
+// With COBS framing, every frame is encoded using Consistent Overhead Byte
+//   Stuffing, and followed by a zero byte. A receiver that loses track of a
+//   frame skips to the next zero byte, and asks for a retransmission right
+//   away, instead of waiting for the line to go quiet.
+
+// The bridge may ask the adapter to switch to a faster baud rate, with a BAUD
+//   command followed by the rate as a 32-bit big endian number. The adapter
+//   replies with the same rate, or zero if it's not supported, and switches
+//   to it. Both sides then send a BAUD_TEST frame, the bridge first, with
+//   the test pattern repeated a few times, to make sure it works. BAUD and
+//   BAUD_TEST frames are preceded by an extra zero byte, to skip over
+//   anything that got garbled while switching. If the adapter doesn't
+//   receive the test pattern in time, it switches back to the previous rate,
+//   and it doesn't retransmit anything while it's waiting for it.
+// Every link starts out at GBRIDGE_BAUD, and goes back to it when it's reset.
+
+// With credits, the bridge never sends more bytes than the adapter has room
+//   for in its receive buffer. Both sides count the bytes sent to the adapter
+//   modulo 0x100, and the adapter sends a CREDIT frame with the count up to
+//   which it's able to receive, followed by the amount of bytes it has lost
+//   so far. The bridge may start counting anew by sending a CREDIT frame
+//   itself, right after which both counts are zero, and which the adapter
+//   answers with a CREDIT frame. It does so whenever bytes might have gone
+//   missing. Every CREDIT frame starts with a number that is changed with
+//   every restart, to discard those from before it, and ends with the
+//   inverted sum of its bytes. Until the first CREDIT frame arrives, the
+//   bridge doesn't send anything.
+#define GBRIDGE_BAUD 500000
+#define GBRIDGE_BAUD_PATTERN \
+    {0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x01, 0x80, \
+     0x7F, 0xFE, 0x33, 0xCC, 0x00, 0x00, 0xFF, 0xFF}
+#define GBRIDGE_BAUD_PATTERN_REPEAT 4
+#define GBRIDGE_BAUD_TIMEOUT_US 100000
+
 #define GBRIDGE_TIMEOUT_US 1000000
 #define GBRIDGE_TIMEOUT_MS (GBRIDGE_TIMEOUT_US / 1000)
 
+// In windowed mode, the retransmission timeout is derived from the measured
+//   round-trip time, bounded by these values. The link is only reset after
+//   a frame has been retransmitted too many times.
+#define GBRIDGE_RTO_MIN_US 10000
+#define GBRIDGE_RTO_MAX_US GBRIDGE_TIMEOUT_US
+#define GBRIDGE_RETRIES 5
+
+// Time the line needs to be quiet after receiving a broken frame, before
+//   asking for it to be retransmitted.
+#define GBRIDGE_RESYNC_US 2000
+#define GBRIDGE_RESYNC_MS (GBRIDGE_RESYNC_US / 1000)
+
 #define GBRIDGE_MAX_DATA_SIZE 0x80
 
+// Biggest data packet sent by the bridge
+// This only limits the data that's sent along with replies, and keeps the
+//   adapter's receive queue small.
+#define GBRIDGE_MAX_DATA_SIZE_PC 0x40
+
+// Amount of frames that may be unacknowledged at once in windowed mode
+// This is also the amount of data packets each side is able to queue up.
+#define GBRIDGE_WINDOW_SIZE 2
+
 // Flag set when replying to a message
 #define GBRIDGE_CMD_REPLY_F 0x80
 
@@ -17,17 +104,23 @@ enum gbridge_cmd {
     GBRIDGE_CMD_PING = 0x01,
     GBRIDGE_CMD_DEBUG_LINE = 0x02,
     GBRIDGE_CMD_DEBUG_CHAR = 0x03,
+    GBRIDGE_CMD_CREDIT = 0x04,  // Receive buffer space
     GBRIDGE_CMD_DATA = 0x0A,
     GBRIDGE_CMD_DATA_FAIL = 0x0B,  // Checksum failure, retry
     GBRIDGE_CMD_STREAM = 0x0C,
     GBRIDGE_CMD_STREAM_FAIL = 0x0D,  // Checksum failure, retry
+    GBRIDGE_CMD_ACK = 0x0E,  // Windowed mode acknowledgement
 
     // from PC
     GBRIDGE_CMD_PROG_STOP = 0x41,
     GBRIDGE_CMD_PROG_START = 0x42,
+    GBRIDGE_CMD_BAUD_PC = 0x43,  // Switch baud rate
+    GBRIDGE_CMD_BAUD_TEST_PC = 0x44,  // Test pattern at the new baud rate
+    GBRIDGE_CMD_CREDIT_PC = 0x45,  // Restart counting bytes
     GBRIDGE_CMD_DATA_PC = 0x4A,
     GBRIDGE_CMD_DATA_FAIL_PC = 0x4B,  // Checksum failure, retry
     GBRIDGE_CMD_STREAM_PC = 0x4C,
     GBRIDGE_CMD_STREAM_FAIL_PC = 0x4D,  // Checksum failure, retry
+    GBRIDGE_CMD_ACK_PC = 0x4E,  // Windowed mode acknowledgement
     GBRIDGE_CMD_RESET = 0x4F,
 };
@@ -0,0 +1,138 @@
+#include "gbridge_codec.h"
+
+#include <string.h>
+
+// Sum of the bytes, as used to check every frame
+uint16_t gbridge_checksum(const unsigned char *data, unsigned size)
+{
+    uint16_t checksum = 0;
+    for (unsigned i = 0; i < size; i++) checksum += data[i];
+    return checksum;
+}
+
+static unsigned char frame_byte(const struct gbridge_frame_part *parts, unsigned pos)
+{
+    while (pos >= parts->size) pos -= parts++->size;
+    return parts->buffer[pos];
+}
+
+// Pass a frame to put() a byte at a time, COBS-encoded if asked to
+void gbridge_frame_encode(const struct gbridge_frame_part *parts, unsigned count, bool cobs, void (*put)(void *user, unsigned char c), void *user)
+{
+    unsigned size = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (!cobs) {
+            for (unsigned x = 0; x < parts[i].size; x++) {
+                put(user, parts[i].buffer[x]);
+            }
+        }
+        size += parts[i].size;
+    }
+    if (!cobs) return;
+
+    // Every block starts with the amount of bytes until the next zero, which
+    //   is left out. Blocks of 0xFE bytes are followed by another block
+    //   without skipping anything.
+    unsigned pos = 0;
+    for (;;) {
+        unsigned char len = 0;
+        while (pos + len < size && len < 0xFE && frame_byte(parts, pos + len)) {
+            len++;
+        }
+        put(user, len + 1);
+        for (unsigned char i = 0; i < len; i++) {
+            put(user, frame_byte(parts, pos + i));
+        }
+        pos += len;
+        if (pos == size) break;
+        if (len != 0xFE) pos++;
+    }
+    put(user, 0);
+}
+
+// Decode a byte of a COBS-encoded frame
+// Returns the decoded byte, or -1 if there's none, either because the byte
+//   only starts a block, or because the frame is being skipped or has ended.
+int gbridge_cobs_decode(struct gbridge_cobs *cobs, unsigned char c)
+{
+    if (!c) {
+        cobs->left = 0;
+        cobs->zero = false;
+        if (cobs->skip) {
+            cobs->skip = false;
+        } else {
+            cobs->end = true;
+        }
+        return -1;
+    }
+
+    if (!cobs->left) {
+        // Every block except the last one is followed by a zero, which is
+        //   only known once the next block starts.
+        bool zero = cobs->zero;
+        cobs->left = c - 1;
+        cobs->zero = c != 0xFF;
+        if (!zero) return -1;
+        c = 0;
+    } else {
+        cobs->left--;
+    }
+
+    if (cobs->skip) return -1;
+    return c;
+}
+
+unsigned gbridge_address_write(const struct mobile_addr *addr, unsigned char *buffer)
+{
+    if (!addr) {
+        buffer[0] = MOBILE_ADDRTYPE_NONE;
+        return 1;
+    } else if (addr->type == MOBILE_ADDRTYPE_IPV4) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        buffer[0] = MOBILE_ADDRTYPE_IPV4;
+        buffer[1] = (addr4->port >> 8) & 0xFF;
+        buffer[2] = (addr4->port >> 0) & 0xFF;
+        memcpy(buffer + 3, addr4->host, MOBILE_HOSTLEN_IPV4);
+        return 3 + MOBILE_HOSTLEN_IPV4;
+    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        buffer[0] = MOBILE_ADDRTYPE_IPV6;
+        buffer[1] = (addr6->port >> 8) & 0xFF;
+        buffer[2] = (addr6->port >> 0) & 0xFF;
+        memcpy(buffer + 3, addr6->host, MOBILE_HOSTLEN_IPV6);
+        return 3 + MOBILE_HOSTLEN_IPV6;
+    } else {
+        buffer[0] = MOBILE_ADDRTYPE_NONE;
+        return 1;
+    }
+}
+
+unsigned gbridge_address_read(struct mobile_addr *addr, const unsigned char *buffer, unsigned size)
+{
+    if (size < 1) return 0;
+    if (buffer[0] == MOBILE_ADDRTYPE_NONE) {
+        if (addr) {
+            addr->type = MOBILE_ADDRTYPE_NONE;
+        }
+        return 1;
+    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV4) {
+        if (size < 3 + MOBILE_HOSTLEN_IPV4) return 0;
+        if (addr) {
+            addr->type = MOBILE_ADDRTYPE_IPV4;
+            struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+            addr4->port = buffer[1] << 8 | buffer[2];
+            memcpy(addr4->host, buffer + 3, MOBILE_HOSTLEN_IPV4);
+        }
+        return 3 + MOBILE_HOSTLEN_IPV4;
+    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV6) {
+        if (size < 3 + MOBILE_HOSTLEN_IPV6) return 0;
+        if (addr) {
+            addr->type = MOBILE_ADDRTYPE_IPV6;
+            struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+            addr6->port = buffer[1] << 8 | buffer[2];
+            memcpy(addr6->host, buffer + 3, MOBILE_HOSTLEN_IPV6);
+        }
+        return 3 + MOBILE_HOSTLEN_IPV6;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mobile.h"
+
+// Encoding and decoding of what goes over the link, shared by the adapter
+//   and the bridge. Nothing in here does any I/O, the frames are passed
+//   through whatever the caller hands them to.
+
+// Part of an outgoing frame, to avoid copying the buffers around
+struct gbridge_frame_part {
+    const unsigned char *buffer;
+    unsigned size;
+};
+
+// State of the COBS decoder, in between bytes
+struct gbridge_cobs {
+    unsigned char left;  // Bytes left in the current block
+    bool zero;  // The current block is followed by a zero
+    bool skip;  // Discarding the rest of a frame
+    bool end;  // The end of the frame has been reached
+};
+
+#define GBRIDGE_ADDRESS_MAXLEN (3 + MOBILE_HOSTLEN_IPV6)
+
+uint16_t gbridge_checksum(const unsigned char *data, unsigned size);
+void gbridge_frame_encode(const struct gbridge_frame_part *parts, unsigned count, bool cobs, void (*put)(void *user, unsigned char c), void *user);
+int gbridge_cobs_decode(struct gbridge_cobs *cobs, unsigned char c);
+unsigned gbridge_address_write(const struct mobile_addr *addr, unsigned char *buffer);
+unsigned gbridge_address_read(struct mobile_addr *addr, const unsigned char *buffer, unsigned size);
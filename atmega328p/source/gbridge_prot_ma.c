@@ -1,92 +1,470 @@
 #include "gbridge_prot_ma.h"
 
+#include <stdint.h>
 #include <string.h>
 
 #include <mobile.h>
 
 #include "gbridge.h"
 #include "gbridge_cmd.h"
+#include "gbridge_codec.h"
 #include "gbridge_prot_ma_cmd.h"
 
-static unsigned char data_buf[GBRIDGE_MAX_DATA_SIZE];
+// The callbacks below don't wait for the bridge to reply. Instead, requests
+//   are sent right away, and their replies are collected as they arrive.
+// Data is reported as sent as soon as it's on its way, since the bridge
+//   only replies to SEND once it's taken all of it. A reply that falls short
+//   of it fails the connection, as the rest is gone by then.
+// Callbacks that libmobile keeps calling until they're done report that
+//   they're still in progress, while the rest report their errors on the
+//   next call for the same connection.
+// Received data is kept in a buffer for every connection, which the bridge
+//   fills by itself if it's able to, and which is otherwise filled by asking
+//   for data whenever it's empty.
+
+// Biggest amount of data that's sent without waiting for the bridge
+// This is about half of what the Game Boy transfers in a single packet, as
+//   there's no room for more. Bigger packets are rare.
+#define SEND_SIZE 0x80
+
+// Size of the receive buffer of every connection
+#define RX_SIZE 0x80
+
+// Room that has to be made in a receive buffer before the bridge is told
+#define RX_WINDOW_STEP (RX_SIZE / 4)
+
+// Amount of requests that may be waiting for a reply at once
+#define REQUESTS_MAX 6
+
+// Connection of requests whose reply isn't of any use anymore
+#define CONN_NONE 0xFF
+
+static unsigned char data_buf[0x18];
 static struct gbridge_data data;
+static bool connected;
+
+// Requests sent to the bridge, in the order their replies arrive
+struct request {
+    enum gbma_prot_cmd cmd;
+    unsigned char conn;
+    unsigned size;  // Data sent along with SEND
+};
+static struct request requests[REQUESTS_MAX];
+static unsigned char requests_first;
+static unsigned char requests_count;
+
+struct sock {
+    bool open;  // The bridge has opened the socket, or is about to
+    bool failed;  // An earlier request failed
+    bool udp;
+    bool receiving;  // The socket is open, and data may arrive for it
+    bool watched;  // The bridge sends an event once it's connected
+    unsigned char events;  // Events that have been received
+
+    // Request that libmobile keeps calling for
+    bool busy;  // Waiting for the reply
+    bool done;  // The reply has arrived
+    enum gbma_prot_cmd cmd;
+    int result;
+
+    // Received data, in between rx_start and rx_end, followed by the room
+    //   that is set aside for data that's still arriving
+    unsigned char rx_buf[RX_SIZE];
+    unsigned char rx_start;
+    unsigned char rx_end;
+    unsigned char rx_incoming;
+    unsigned char rx_consumed;  // Bytes taken out, modulo 0x100
+    unsigned char rx_limit;  // Last limit sent to the bridge
+    bool rx_update;  // The limit has to be sent
+    signed char rx_error;  // Reported once the data runs out
+};
+static struct sock socks[MOBILE_MAX_CONNECTIONS];
+
+// Data is received by a single stream at a time
+static bool streaming;
+static unsigned char stream_conn;
+
+// Data that's being sent
+static unsigned char send_buf[SEND_SIZE];
+static bool sending;
 
 void gbridge_prot_ma_init(void)
 {
     data.buffer = data_buf;
     data.size = 0;
+    connected = false;
+    requests_count = 0;
+    streaming = false;
+    sending = false;
 }
 
-void gbridge_prot_ma_loop(void)
+static bool pushing(void)
 {
-    const struct gbridge_data *recv_data = gbridge_recv_data();
-    if (!recv_data) return;
+    return gbridge_caps() & GBRIDGE_CAP_PUSH;
+}
 
-    // Nothing to do with this yet...
+static bool events(void)
+{
+    return pushing() && (gbridge_caps() & GBRIDGE_CAP_EVENTS);
+}
 
-    gbridge_recv_data_done();
-    return;
+// Forget about every request when the link is reset
+static void link_check(void)
+{
+    if (gbridge_connected()) {
+        connected = true;
+        return;
+    }
+    if (!connected) return;
+
+    gbridge_prot_ma_init();
+
+    // The bridge's sockets are gone as well
+    for (unsigned char i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        socks[i] = (struct sock){.failed = true};
+    }
 }
 
-#define ADDRESS_MAXLEN (3 + MOBILE_HOSTLEN_IPV6)
-static unsigned address_write(const struct mobile_addr *addr, unsigned char *buffer)
-{
-    if (!addr) {
-        buffer[0] = MOBILE_ADDRTYPE_NONE;
-        return 1;
-    } else if (addr->type == MOBILE_ADDRTYPE_IPV4) {
-        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-        buffer[0] = MOBILE_ADDRTYPE_IPV4;
-        buffer[1] = (addr4->port >> 8) & 0xFF;
-        buffer[2] = (addr4->port >> 0) & 0xFF;
-        memcpy(buffer + 3, addr4->host, MOBILE_HOSTLEN_IPV4);
-        return 3 + MOBILE_HOSTLEN_IPV4;
-    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
-        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-        buffer[0] = MOBILE_ADDRTYPE_IPV6;
-        buffer[1] = (addr6->port >> 8) & 0xFF;
-        buffer[2] = (addr6->port >> 0) & 0xFF;
-        memcpy(buffer + 3, addr6->host, MOBILE_HOSTLEN_IPV6);
-        return 3 + MOBILE_HOSTLEN_IPV6;
-    } else {
-        buffer[0] = MOBILE_ADDRTYPE_NONE;
-        return 1;
+// Size of the header in front of received data
+static unsigned char rx_header(const struct sock *sock, unsigned addrlen)
+{
+    if (!sock->udp) return 0;
+    return 1 + addrlen;
+}
+
+// Room left in a receive buffer, counting what has been taken out already
+static unsigned char rx_room(const struct sock *sock)
+{
+    return RX_SIZE - (sock->rx_end - sock->rx_start) - sock->rx_incoming;
+}
+
+// Store data in a receive buffer, or set aside room for it and start
+//   receiving it in a stream if it isn't there yet
+static bool rx_store(unsigned char conn, unsigned size, const unsigned char *addr, unsigned addrlen, const unsigned char *rx_data)
+{
+    // Data for connections that have been closed is still received, and
+    //   thrown away.
+    if (conn == CONN_NONE || !socks[conn].receiving) {
+        if (rx_data) return true;
+        gbridge_recv_stream(NULL, size);
+        stream_conn = CONN_NONE;
+        streaming = true;
+        return true;
+    }
+
+    struct sock *sock = &socks[conn];
+    unsigned char header = rx_header(sock, addrlen);
+    if (header + size > rx_room(sock)) return false;
+
+    // Move the data to the start of the buffer to make room
+    if (sock->rx_start) {
+        memmove(sock->rx_buf, sock->rx_buf + sock->rx_start,
+            sock->rx_end - sock->rx_start);
+        sock->rx_end -= sock->rx_start;
+        sock->rx_start = 0;
+    }
+
+    unsigned char *buffer = sock->rx_buf + sock->rx_end;
+    if (header) {
+        buffer[0] = size;
+        memcpy(buffer + 1, addr, addrlen);
+    }
+    if (rx_data) {
+        memcpy(buffer + header, rx_data, size);
+        sock->rx_end += header + size;
+        return true;
+    }
+    gbridge_recv_stream(buffer + header, size);
+    sock->rx_incoming = header + size;
+    stream_conn = conn;
+    streaming = true;
+    return true;
+}
+
+// Take data out of a receive buffer
+static void rx_take(struct sock *sock, unsigned char size)
+{
+    sock->rx_start += size;
+    sock->rx_consumed += size;
+    if (sock->rx_start == sock->rx_end && !sock->rx_incoming) {
+        sock->rx_start = 0;
+        sock->rx_end = 0;
+    }
+
+    unsigned char limit = sock->rx_consumed + RX_SIZE;
+    if ((unsigned char)(limit - sock->rx_limit) >= RX_WINDOW_STEP ||
+            sock->rx_start == sock->rx_end) {
+        sock->rx_update = sock->rx_update || limit != sock->rx_limit;
+    }
+}
+
+// Handle the reply to RECV, and PUSH requests, which look the same
+// Returns false if it's broken.
+static bool recv_data_reply(const struct gbridge_data *recv_data, unsigned char conn, int *result)
+{
+    if (recv_data->size < 3) return false;
+    int res = (int16_t)(recv_data->buffer[1] << 8 | recv_data->buffer[2]);
+
+    unsigned recv_addrlen = gbridge_address_read(NULL, recv_data->buffer + 3,
+        recv_data->size - 3);
+    if (!recv_addrlen) return false;
+
+    // The data may follow right away
+    const unsigned char *rx_data = NULL;
+    unsigned rx_size = recv_data->size - 3 - recv_addrlen;
+    if (rx_size) {
+        if (!(gbridge_caps() & GBRIDGE_CAP_INLINE)) return false;
+        if (res != (int)rx_size) return false;
+        rx_data = recv_data->buffer + 3 + recv_addrlen;
     }
+
+    *result = res;
+    if (res <= 0) return true;
+    if (streaming) return false;
+    return rx_store(conn, res, recv_data->buffer + 3, recv_addrlen, rx_data);
 }
 
-static unsigned address_read(struct mobile_addr *addr, const unsigned char *buffer, unsigned size)
+static void recv_push(const struct gbridge_data *recv_data)
 {
-    if (size < 1) return 0;
-    if (buffer[0] == MOBILE_ADDRTYPE_NONE) {
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_NONE;
+    // Look past the connection number, to handle it like a reply to RECV
+    if (recv_data->size < 2) return;
+    unsigned char conn = recv_data->buffer[1];
+    if (conn >= MOBILE_MAX_CONNECTIONS) return;
+    struct gbridge_data push_data = {
+        .size = recv_data->size - 1,
+        .buffer = recv_data->buffer + 1
+    };
+
+    struct sock *sock = &socks[conn];
+    int res;
+    if (!recv_data_reply(&push_data, sock->receiving ? conn : CONN_NONE, &res)) {
+        if (!sock->receiving) return;
+        sock->failed = true;
+        return;
+    }
+    if (res < 0 && sock->receiving) sock->rx_error = res;
+}
+
+static void recv_events(const struct gbridge_data *recv_data)
+{
+    if (recv_data->size != 1 + MOBILE_MAX_CONNECTIONS) return;
+    for (unsigned char i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        // Events for connections that have been closed are stale
+        struct sock *sock = &socks[i];
+        if (!sock->receiving) continue;
+        sock->events |= recv_data->buffer[1 + i];
+        if ((sock->events & GBRIDGE_PROT_MA_EVENT_CLOSED) && !sock->rx_error) {
+            sock->rx_error = -2;
         }
-        return 1;
-    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV4) {
-        if (size < 3 + MOBILE_HOSTLEN_IPV4) return 0;
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_IPV4;
-            struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-            addr4->port = buffer[1] << 8 | buffer[2];
-            memcpy(addr4->host, buffer + 3, MOBILE_HOSTLEN_IPV4);
+    }
+}
+
+static void recv_reply(const struct gbridge_data *recv_data)
+{
+    if (!requests_count) return;
+    struct request req = requests[requests_first];
+    requests_first = (requests_first + 1) % REQUESTS_MAX;
+    requests_count--;
+
+    struct sock *sock = NULL;
+    if (req.conn != CONN_NONE) sock = &socks[req.conn];
+    int res = 0;
+
+    if (recv_data->size < 1) goto error;
+    if (recv_data->buffer[0] != req.cmd) goto error;
+
+    switch (req.cmd) {
+    case GBRIDGE_PROT_MA_CMD_OPEN:
+        if (recv_data->size != 2) goto error;
+        if (!recv_data->buffer[1]) {
+            // There's nothing for the bridge to close
+            if (sock) sock->open = false;
+            goto error;
         }
-        return 3 + MOBILE_HOSTLEN_IPV4;
-    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV6) {
-        if (size < 3 + MOBILE_HOSTLEN_IPV6) return 0;
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_IPV6;
-            struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-            addr6->port = buffer[1] << 8 | buffer[2];
-            memcpy(addr6->host, buffer + 3, MOBILE_HOSTLEN_IPV6);
+        if (!sock) return;
+
+        // The bridge starts counting received data from here on
+        sock->receiving = true;
+        sock->rx_limit = 0;
+        sock->rx_update = true;
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_LISTEN:
+        if (recv_data->size != 2) goto error;
+        if (!recv_data->buffer[1]) goto error;
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_CONNECT:
+    case GBRIDGE_PROT_MA_CMD_ACCEPT:
+        if (recv_data->size != 2) goto error;
+        res = (signed char)recv_data->buffer[1];
+        break;
+
+    case GBRIDGE_PROT_MA_CMD_SEND:
+    case GBRIDGE_PROT_MA_CMD_SEND_INLINE:
+        if (recv_data->size != 3) goto error;
+        res = (int16_t)(recv_data->buffer[1] << 8 | recv_data->buffer[2]);
+        if (res != (int)req.size) goto error;
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_RECV:
+        if (!recv_data_reply(recv_data, sock ? req.conn : CONN_NONE, &res)) {
+            goto error;
+        }
+
+        // The request is done once the data has arrived
+        if (res > 0) {
+            if (sock && !streaming) sock->busy = false;
+            return;
         }
-        return 3 + MOBILE_HOSTLEN_IPV6;
+        break;
+
+    default:
+        return;
     }
-    return 0;
+
+    if (!sock) return;
+    sock->done = true;
+    sock->result = res;
+    return;
+
+error:
+    if (!sock) return;
+    sock->failed = true;
+    sock->done = true;
+    sock->result = -1;
+}
+
+void gbridge_prot_ma_loop(void)
+{
+    link_check();
+    if (!connected) return;
+
+    if (sending && gbridge_cmd_sent()) sending = false;
+    if (streaming && gbridge_recv_stream_done()) {
+        streaming = false;
+        if (stream_conn != CONN_NONE) {
+            struct sock *sock = &socks[stream_conn];
+            sock->rx_end += sock->rx_incoming;
+            sock->rx_incoming = 0;
+            if (sock->busy && sock->cmd == GBRIDGE_PROT_MA_CMD_RECV) {
+                sock->busy = false;
+            }
+        }
+    }
+
+    // Tell the bridge about the room in the receive buffers
+    for (unsigned char i = 0; pushing() && i < MOBILE_MAX_CONNECTIONS; i++) {
+        struct sock *sock = &socks[i];
+        if (!sock->rx_update) continue;
+        if (!gbridge_cmd_ready()) break;
+        sock->rx_limit = sock->rx_consumed + RX_SIZE;
+        sock->rx_update = false;
+
+        data.buffer[0] = GBRIDGE_PROT_MA_CMD_RECV_WINDOW;
+        data.buffer[1] = i;
+        data.buffer[2] = sock->rx_limit;
+        data.size = 3;
+        gbridge_cmd_data(data);
+    }
+
+    const struct gbridge_data *recv_data = gbridge_recv_data();
+    if (!recv_data) return;
+    if (recv_data->size >= 1 &&
+            recv_data->buffer[0] == GBRIDGE_PROT_MA_CMD_PUSH) {
+        // The data that follows is only received later on
+        if (streaming) return;
+        recv_push(recv_data);
+    } else if (recv_data->size >= 1 &&
+            recv_data->buffer[0] == GBRIDGE_PROT_MA_CMD_EVENT) {
+        recv_events(recv_data);
+    } else {
+        recv_reply(recv_data);
+    }
+    gbridge_recv_data_done();
+}
+
+// Check if a request can be sent without waiting
+static bool request_ready(void)
+{
+    return requests_count < REQUESTS_MAX && gbridge_cmd_ready();
+}
+
+// Send a request, keeping track of its reply
+// If too many requests are waiting for a reply, this waits for one of them.
+// Requests in the send buffer are sent without waiting for the bridge to
+//   receive them, as the buffer is kept around.
+static bool request_send_data(unsigned char conn, struct gbridge_data req)
+{
+    while (gbridge_connected() && requests_count >= REQUESTS_MAX) {
+        gbridge_loop();
+        gbridge_prot_ma_loop();
+    }
+    if (!gbridge_connected()) return false;
+
+    if (req.buffer == send_buf) {
+        gbridge_cmd_data_start(req);
+    } else {
+        gbridge_cmd_data(req);
+    }
+    if (!gbridge_connected()) return false;
+
+    requests[(requests_first + requests_count++) % REQUESTS_MAX] =
+        (struct request){.cmd = req.buffer[0], .conn = conn};
+    return true;
+}
+
+// Send the request in the data buffer
+static bool request_send(unsigned char conn)
+{
+    return request_send_data(conn, data);
+}
+
+// Note the size of the data sent along with the last request
+static void request_size(unsigned size)
+{
+    requests[(requests_first + requests_count - 1) % REQUESTS_MAX].size = size;
+}
+
+// Send a request that libmobile will keep calling for
+static void sock_request(struct sock *sock, unsigned char conn)
+{
+    sock->cmd = data.buffer[0];
+    sock->done = false;
+    sock->busy = request_send(conn);
+}
+
+// Collect the reply of a request that libmobile keeps calling for
+// Returns false if it hasn't arrived yet, otherwise a new request may be sent
+//   if the result is zero.
+static bool sock_reply(struct sock *sock, enum gbma_prot_cmd cmd, int *result)
+{
+    *result = 0;
+    if (!sock->busy) return true;
+    if (sock->cmd != cmd || !sock->done) return false;
+    sock->busy = false;
+    *result = sock->result;
+    return true;
+}
+
+// Forget about a connection and everything that's still on its way
+static void sock_reset(unsigned char conn)
+{
+    for (unsigned char i = 0; i < requests_count; i++) {
+        struct request *req = &requests[(requests_first + i) % REQUESTS_MAX];
+        if (req->conn == conn) req->conn = CONN_NONE;
+    }
+    if (streaming && stream_conn == conn) stream_conn = CONN_NONE;
+    socks[conn] = (struct sock){0};
 }
 
 bool mobile_impl_sock_open(void *user, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
 {
     (void)user;
+    link_check();
+    sock_reset(conn);
+    socks[conn].udp = type == MOBILE_SOCKTYPE_UDP;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_OPEN;
     data.buffer[1] = conn;
     data.buffer[2] = type;
@@ -94,156 +472,166 @@ bool mobile_impl_sock_open(void *user, unsigned conn, enum mobile_socktype type,
     data.buffer[4] = (bindport >> 8) & 0xFF;
     data.buffer[5] = (bindport >> 0) & 0xFF;
     data.size = 6;
-    gbridge_cmd_data(data);
-
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 2) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_OPEN) goto error;
-    bool res = recv_data->buffer[1] != 0;
-    gbridge_recv_data_done();
-    return res;
-
-error:
-    gbridge_recv_data_done();
-    return false;
+    socks[conn].open = request_send(conn);
+    return socks[conn].open;
 }
 
 void mobile_impl_sock_close(void *user, unsigned conn)
 {
     (void)user;
+    link_check();
+
+    // Replies to earlier requests aren't of any use anymore
+    bool open = socks[conn].open;
+    sock_reset(conn);
+    if (!open) return;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_CLOSE;
     data.buffer[1] = conn;
     data.size = 2;
-    gbridge_cmd_data(data);
-
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 1) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_CLOSE) goto error;
-
-error:
-    gbridge_recv_data_done();
+    request_send(CONN_NONE);
 }
-
 int mobile_impl_sock_connect(void *user, unsigned conn, const struct mobile_addr *addr)
 {
     (void)user;
+    link_check();
+    struct sock *sock = &socks[conn];
+    if (!connected || sock->failed) return -1;
+    if (sock->events & GBRIDGE_PROT_MA_EVENT_CONNECTED) return 1;
+    if (sock->events & GBRIDGE_PROT_MA_EVENT_CONNECT_FAILED) return -1;
+
+    int res;
+    if (!sock_reply(sock, GBRIDGE_PROT_MA_CMD_CONNECT, &res)) return 0;
+    if (res) return res;
+    if (sock->watched || !request_ready()) return 0;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_CONNECT;
     data.buffer[1] = conn;
-    unsigned addrlen = address_write(addr, data.buffer + 2);
+    unsigned addrlen = gbridge_address_write(addr, data.buffer + 2);
     data.size = 2 + addrlen;
-    gbridge_cmd_data(data);
-
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 2) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_CONNECT) goto error;
-    int res = (char)recv_data->buffer[1];
-    gbridge_recv_data_done();
-    return res;
-
-error:
-    gbridge_recv_data_done();
-    return -1;
+    sock_request(sock, conn);
+    sock->watched = events();
+    return 0;
 }
 
 bool mobile_impl_sock_listen(void *user, unsigned conn)
 {
     (void)user;
+    link_check();
+    if (socks[conn].failed) return false;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_LISTEN;
     data.buffer[1] = conn;
     data.size = 2;
-    gbridge_cmd_data(data);
-
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 2) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_LISTEN) goto error;
-    bool res = recv_data->buffer[1];
-    gbridge_recv_data_done();
-    return res;
-
-error:
-    gbridge_recv_data_done();
-    return false;
+    return request_send(conn);
 }
 
 bool mobile_impl_sock_accept(void *user, unsigned conn)
 {
     (void)user;
+    link_check();
+    struct sock *sock = &socks[conn];
+    if (!connected || sock->failed) return false;
+
+    // The bridge tells when a connection comes in, since the socket started
+    //   listening
+    if (events()) return sock->events & GBRIDGE_PROT_MA_EVENT_ACCEPTED;
+
+    int res;
+    if (!sock_reply(sock, GBRIDGE_PROT_MA_CMD_ACCEPT, &res)) return false;
+    if (res) return true;
+    if (!request_ready()) return false;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_ACCEPT;
     data.buffer[1] = conn;
     data.size = 2;
-    gbridge_cmd_data(data);
-
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 2) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_ACCEPT) goto error;
-    bool res = recv_data->buffer[1];
-    gbridge_recv_data_done();
-    return res;
-
-error:
-    gbridge_recv_data_done();
+    sock_request(sock, conn);
     return false;
 }
 
 int mobile_impl_sock_send(void *user, unsigned conn, const void *buffer, unsigned size, const struct mobile_addr *addr)
 {
     (void)user;
+    link_check();
+    struct sock *sock = &socks[conn];
+    if (!connected || sock->failed) return -1;
+
     data.buffer[0] = GBRIDGE_PROT_MA_CMD_SEND;
     data.buffer[1] = conn;
-    unsigned addrlen = address_write(addr, data.buffer + 2);
+    unsigned addrlen = gbridge_address_write(addr, data.buffer + 2);
     data.size = addrlen + 2;
-    gbridge_cmd_data(data);
-    if (!gbridge_connected()) goto error;
 
-    gbridge_cmd_stream_start(size);
-    gbridge_cmd_stream_data(buffer, size);
-    gbridge_cmd_stream_finish();
+    // Small amounts of data are sent along with the request
+    if ((gbridge_caps() & GBRIDGE_CAP_INLINE) && !sending && size &&
+            data.size + size <= GBRIDGE_MAX_DATA_SIZE) {
+        memcpy(send_buf, data.buffer, data.size);
+        send_buf[0] = GBRIDGE_PROT_MA_CMD_SEND_INLINE;
+        memcpy(send_buf + data.size, buffer, size);
+        struct gbridge_data req = {.size = data.size + size, .buffer = send_buf};
+        if (!request_send_data(conn, req)) return -1;
+        request_size(size);
+        sending = true;
+        return size;
+    }
 
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size != 3) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_SEND) goto error;
-    int res = (int16_t)(recv_data->buffer[1] << 8 | recv_data->buffer[2]);
-    gbridge_recv_data_done();
-    return res;
+    if (!request_send(conn)) return -1;
+    request_size(size);
 
-error:
-    gbridge_recv_data_done();
-    return -1;
+    // The data is copied if possible, otherwise this waits until the bridge
+    //   has received it.
+    if (!sending && size <= sizeof(send_buf)) {
+        memcpy(send_buf, buffer, size);
+        sending = true;
+        gbridge_cmd_stream_start(send_buf, size);
+    } else {
+        gbridge_cmd_stream(buffer, size);
+    }
+    if (!gbridge_connected()) return -1;
+    return size;
 }
 
 int mobile_impl_sock_recv(void *user, unsigned conn, void *buffer, unsigned size, struct mobile_addr *addr)
 {
     (void)user;
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_RECV;
-    data.buffer[1] = conn;
-    data.buffer[2] = size >> 8;
-    data.buffer[3] = size >> 0;
-    data.size = 4;
-    gbridge_cmd_data(data);
+    link_check();
+    struct sock *sock = &socks[conn];
+    if (!connected || sock->failed) return -1;
+
+    // Hand over the data that has been received
+    if (sock->rx_start != sock->rx_end) {
+        if (!buffer) return 0;
+        unsigned char *rx = sock->rx_buf + sock->rx_start;
+        unsigned char avail = sock->rx_end - sock->rx_start;
+        unsigned char header = 0;
+        if (sock->udp) {
+            header = rx_header(sock, gbridge_address_read(addr, rx + 1, avail - 1));
+            avail = rx[0];
+        }
+        unsigned res = avail;
+        if (res > size) res = size;
+        memcpy(buffer, rx + header, res);
 
-    const struct gbridge_data *recv_data = gbridge_recv_data_wait();
-    if (!recv_data) goto error;
-    if (recv_data->size < 2) goto error;
-    if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_RECV) goto error;
-    int res = (int16_t)(recv_data->buffer[1] << 8 | recv_data->buffer[2]);
+        // Whatever doesn't fit of a datagram is dropped
+        rx_take(sock, header + (sock->udp ? avail : res));
+        return res;
+    }
+    if (sock->rx_error) return sock->rx_error;
+    if (pushing()) return 0;
 
-    unsigned recv_addrlen = address_read(addr, recv_data->buffer + 3,
-        recv_data->size - 3);
-    if (!recv_addrlen) goto error;
-    if (recv_data->size != recv_addrlen + 3) goto error;
-    gbridge_recv_data_done();
+    int res;
+    if (!sock_reply(sock, GBRIDGE_PROT_MA_CMD_RECV, &res)) return 0;
+    if (res) return res;
+    if (streaming || !request_ready()) return 0;
 
-    if (res <= 0) return res;
-    if (!gbridge_recv_stream_wait(buffer, size)) return -1;
-    return res;
+    // Ask for as much as the buffer is able to take
+    unsigned char room = rx_room(sock) - rx_header(sock, GBRIDGE_ADDRESS_MAXLEN);
+    if (!buffer) room = 0;
 
-error:
-    gbridge_recv_data_done();
-    return -1;
+    data.buffer[0] = GBRIDGE_PROT_MA_CMD_RECV;
+    data.buffer[1] = conn;
+    data.buffer[2] = 0;
+    data.buffer[3] = room;
+    data.size = 4;
+    sock_request(sock, conn);
+    return 0;
 }
@@ -1,5 +1,38 @@
 #pragma once
 
+// In windowed mode, SEND is only replied to once the bridge has taken all of
+//   the data, so the adapter doesn't have to wait for the reply before
+//   telling libmobile it's been sent. The reply is either the full size or
+//   an error. Until then, other requests are held in the link's window,
+//   apart from RECV_WINDOW.
+
+// With the PUSH capability, the adapter doesn't ask for received data.
+//   Instead, it sends a RECV_WINDOW request whenever it makes room in the
+//   buffer of a connection, followed by the count up to which it's able to
+//   receive, and the bridge sends PUSH requests as data arrives. Both sides
+//   count the bytes stored in the buffer modulo 0x100, starting at zero when
+//   the connection is opened. Neither request is replied to.
+// A PUSH request looks like the reply to RECV, and is followed by a stream
+//   with the data if there's any. In the buffer, UDP datagrams are preceded
+//   by a byte with their size and the address as sent, while TCP data isn't.
+
+// With the EVENTS capability, the bridge keeps an eye on connections that are
+//   being made, and listening sockets. After replying 0 to CONNECT, or 1 to
+//   LISTEN, it sends an EVENT request once that changes, followed by a byte
+//   with the flags below for every connection, instead of being asked over
+//   and over. The end of a TCP connection is sent this way as well, instead
+//   of being pushed as an error.
+#define GBRIDGE_PROT_MA_EVENT_CONNECTED 0x01
+#define GBRIDGE_PROT_MA_EVENT_CONNECT_FAILED 0x02
+#define GBRIDGE_PROT_MA_EVENT_ACCEPTED 0x04
+#define GBRIDGE_PROT_MA_EVENT_CLOSED 0x08
+
+// With the INLINE capability, data that fits in a single data packet isn't
+//   sent in a stream. The adapter sends SEND_INLINE requests, with the data
+//   right after the address, which are replied to like SEND. Likewise, the
+//   reply to RECV and PUSH requests are followed by the data, instead of by
+//   a stream, when it fits.
+
 enum gbma_prot_cmd {
     GBRIDGE_PROT_MA_CMD_OPEN,
     GBRIDGE_PROT_MA_CMD_CLOSE,
@@ -7,5 +40,9 @@ enum gbma_prot_cmd {
     GBRIDGE_PROT_MA_CMD_LISTEN,
     GBRIDGE_PROT_MA_CMD_ACCEPT,
     GBRIDGE_PROT_MA_CMD_SEND,
-    GBRIDGE_PROT_MA_CMD_RECV
+    GBRIDGE_PROT_MA_CMD_RECV,
+    GBRIDGE_PROT_MA_CMD_RECV_WINDOW,
+    GBRIDGE_PROT_MA_CMD_PUSH,
+    GBRIDGE_PROT_MA_CMD_EVENT,
+    GBRIDGE_PROT_MA_CMD_SEND_INLINE
 };
@@ -0,0 +1,10 @@
+#pragma once
+
+// Program memory is just memory on the host
+
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#define printf_P printf
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <time.h>
+
+static inline void _delay_us(double us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (long)(us * 1000) % 1000000000
+    };
+    nanosleep(&ts, NULL);
+}
+
+static inline void _delay_ms(double ms)
+{
+    _delay_us(ms * 1000);
+}
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE  // posix_openpt(), accept4()
+#include "serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The UART is a pseudo-terminal or a socket, chosen through HOST_SERIAL:
+//   unset for a pty, which the bridge can open as a serial port,
+//   "unix:path" or "tcp:port" for a socket the bridge connects to.
+// Bytes are moved through buffers of the same size as on the adapter, but
+//   without the timing of the baud rate, so the protocol can be measured on
+//   its own.
+
+struct serial_buffer {
+    unsigned char buffer[SERIAL_BUFFER_SIZE];
+    unsigned char head;
+    unsigned char tail;
+};
+
+static struct serial_buffer serial_rx;
+static struct serial_buffer serial_tx;
+
+static unsigned char serial_rx_read;
+static unsigned char serial_rx_dropped;
+static unsigned char serial_rx_overrun;
+
+static int serial_fd = -1;
+
+static int serial_buffer_isempty(struct serial_buffer *buffer)
+{
+    return buffer->head == buffer->tail;
+}
+
+static int serial_buffer_isfull(struct serial_buffer *buffer)
+{
+    return ((unsigned char)(buffer->head + 1) % SERIAL_BUFFER_SIZE) == buffer->tail;
+}
+
+static unsigned char serial_buffer_size(struct serial_buffer *buffer)
+{
+    return (unsigned char)(SERIAL_BUFFER_SIZE + buffer->head - buffer->tail) % SERIAL_BUFFER_SIZE;
+}
+
+static void serial_buffer_put(struct serial_buffer *buffer, unsigned char c)
+{
+    buffer->buffer[buffer->head] = c;
+    buffer->head = (unsigned char)(buffer->head + 1) % SERIAL_BUFFER_SIZE;
+}
+
+static unsigned char serial_buffer_get(struct serial_buffer *buffer)
+{
+    unsigned char c = buffer->buffer[buffer->tail];
+    buffer->tail = (unsigned char)(buffer->tail + 1) % SERIAL_BUFFER_SIZE;
+    return c;
+}
+
+static void serial_wait(short events)
+{
+    struct pollfd pfd = {.fd = serial_fd, .events = events};
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+}
+
+static void serial_transmit(void)
+{
+    unsigned char buf[SERIAL_BUFFER_SIZE];
+    size_t size = 0;
+    while (!serial_buffer_isempty(&serial_tx)) {
+        buf[size++] = serial_buffer_get(&serial_tx);
+    }
+
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t len = write(serial_fd, buf + pos, size - pos);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                serial_wait(POLLOUT);
+                continue;
+            }
+            perror("serial: write");
+            exit(EXIT_FAILURE);
+        }
+        pos += len;
+    }
+}
+
+static void serial_receive(void)
+{
+    // Whatever doesn't fit in the buffer is lost, like it would be on the
+    //   adapter, unless the host is told to stop sending beforehand.
+    unsigned char buf[0x100];
+    size_t max = sizeof(buf);
+#ifdef SERIAL_RTS
+    max = SERIAL_BUFFER_SIZE - 1 - serial_buffer_size(&serial_rx);
+    if (!max) return;
+#endif
+
+    ssize_t len = read(serial_fd, buf, max);
+    if (len == 0) {
+        fprintf(stderr, "serial: connection closed\n");
+        exit(EXIT_SUCCESS);
+    }
+    if (len == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        perror("serial: read");
+        exit(EXIT_FAILURE);
+    }
+
+    for (ssize_t i = 0; i < len; i++) {
+        if (serial_buffer_isfull(&serial_rx)) {
+            serial_rx_overrun++;
+            serial_rx_dropped++;
+            continue;
+        }
+        serial_buffer_put(&serial_rx, buf[i]);
+    }
+}
+
+// There are no interrupts to move the data, so it's done whenever the
+//   firmware looks at the buffers
+static void serial_poll(void)
+{
+    if (!serial_buffer_isempty(&serial_tx)) serial_transmit();
+    serial_receive();
+}
+
+void serial_putchar_inline(unsigned char c)
+{
+    if (serial_buffer_isfull(&serial_tx)) serial_transmit();
+    serial_buffer_put(&serial_tx, c);
+}
+
+void serial_putchar(unsigned char c) { serial_putchar_inline(c); }
+
+unsigned char serial_getchar_inline(void)
+{
+    serial_poll();
+    while (serial_buffer_isempty(&serial_rx)) {
+        serial_wait(POLLIN);
+        serial_receive();
+    }
+
+    unsigned char c = serial_buffer_get(&serial_rx);
+    serial_rx_read++;
+    return c;
+}
+
+unsigned char serial_getchar(void) { return serial_getchar_inline(); }
+
+unsigned serial_available(void)
+{
+    serial_poll();
+    return serial_buffer_size(&serial_rx);
+}
+
+unsigned char serial_rx_consumed(void)
+{
+    return serial_rx_read + serial_rx_dropped;
+}
+
+unsigned char serial_rx_overruns(void)
+{
+    return serial_rx_overrun;
+}
+
+void serial_drain(void)
+{
+    if (!serial_buffer_isempty(&serial_tx)) serial_transmit();
+}
+
+// Bytes take no time to send, whatever the baud rate
+void serial_set_bauds(unsigned long bauds)
+{
+    (void)bauds;
+}
+
+static int serial_open_pty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+        perror("serial: posix_openpt");
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    // Keep the pty alive while the bridge hasn't opened it yet
+    int peer = open(ptsname(fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (peer != -1 && tcgetattr(peer, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(peer, TCSANOW, &tio);
+    }
+
+    fprintf(stderr, "serial: %s\n", ptsname(fd));
+    return fd;
+}
+
+static int serial_open_socket(const char *address)
+{
+    int sock;
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "serial: socket path too long: %s\n", address);
+            return -1;
+        }
+        strcpy(addr.sun_path, address + 5);
+        unlink(addr.sun_path);
+
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1 ||
+                bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("serial: bind");
+            return -1;
+        }
+    } else if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(atoi(address + 4)),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+        };
+
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1) {
+            perror("serial: socket");
+            return -1;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("serial: bind");
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "serial: invalid address: %s\n", address);
+        return -1;
+    }
+
+    if (listen(sock, 1) == -1) {
+        perror("serial: listen");
+        return -1;
+    }
+    fprintf(stderr, "serial: waiting on %s\n", address);
+    int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) perror("serial: accept");
+    close(sock);
+    return fd;
+}
+
+void serial_init_config(unsigned long bauds, uint8_t config)
+{
+    (void)config;
+    serial_set_bauds(bauds);
+
+    const char *address = getenv("HOST_SERIAL");
+    if (address) {
+        serial_fd = serial_open_socket(address);
+    } else {
+        serial_fd = serial_open_pty();
+    }
+    if (serial_fd == -1) exit(EXIT_FAILURE);
+    fcntl(serial_fd, F_SETFL, fcntl(serial_fd, F_GETFL) | O_NONBLOCK);
+}
+
+void serial_init(unsigned long bauds) { serial_init_config(bauds, 0); }
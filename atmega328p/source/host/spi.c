@@ -0,0 +1,114 @@
+#define _GNU_SOURCE  // F_SETSIG, accept4()
+#include "spi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The link port is a UNIX socket, named by HOST_SPI, that a Game Boy
+//   emulator connects to.
+// Every byte it sends is one transfer, answered with the byte that was
+//   shifted out at the same time, as on the real link port.
+// The transfers are handled in a SIGIO handler, which interrupts the main
+//   loop the same way the SPI interrupt does on the adapter.
+
+static int spi_listen_fd = -1;
+static int spi_fd = -1;
+static volatile sig_atomic_t spi_enabled;
+static volatile unsigned char spi_data;
+
+static void spi_async(int fd)
+{
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETSIG, SIGIO);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC | O_NONBLOCK);
+}
+
+static void spi_accept(void)
+{
+    int fd = accept4(spi_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) return;
+    if (spi_fd != -1) close(spi_fd);
+    spi_fd = fd;
+    spi_async(spi_fd);
+}
+
+static void spi_isr(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+
+    if (spi_listen_fd != -1) spi_accept();
+
+    unsigned char buf[0x40];
+    ssize_t len;
+    while (spi_fd != -1 && (len = read(spi_fd, buf, sizeof(buf))) != 0) {
+        if (len == -1) break;
+
+        // With SPI disabled, nothing drives the line
+        for (ssize_t i = 0; i < len; i++) {
+            unsigned char c = buf[i];
+            if (!spi_enabled) {
+                buf[i] = 0xFF;
+                continue;
+            }
+            buf[i] = spi_data;
+            spi_data = spi_transfer(c);
+        }
+        if (write(spi_fd, buf, len) == -1) break;
+    }
+    if (len == 0) {
+        close(spi_fd);
+        spi_fd = -1;
+    }
+
+    errno = saved_errno;
+}
+
+void spi_init(void)
+{
+    const char *path = getenv("HOST_SPI");
+    if (!path) {
+        fprintf(stderr, "spi: HOST_SPI not set, no Game Boy will connect\n");
+        return;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "spi: socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(addr.sun_path);
+
+    spi_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (spi_listen_fd == -1 ||
+            bind(spi_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(spi_listen_fd, 1) == -1) {
+        perror("spi: bind");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa = {.sa_handler = spi_isr, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGIO, &sa, NULL);
+    spi_async(spi_listen_fd);
+    fprintf(stderr, "spi: %s\n", path);
+}
+
+void spi_enable(unsigned char first)
+{
+    spi_data = first;
+    spi_enabled = 1;
+}
+
+void spi_disable(void)
+{
+    spi_enabled = 0;
+}
@@ -0,0 +1,51 @@
+#include "storage.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The EEPROM is kept in a file, named by HOST_EEPROM
+// A new file starts out erased, like the EEPROM of a new chip.
+
+#define STORAGE_DEFAULT "mobile.eeprom"
+#define STORAGE_SIZE 0x400
+
+static int storage_fd = -1;
+
+static int storage_open(void)
+{
+    if (storage_fd != -1) return storage_fd;
+
+    const char *path = getenv("HOST_EEPROM");
+    if (!path) path = STORAGE_DEFAULT;
+    storage_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (storage_fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    if (lseek(storage_fd, 0, SEEK_END) == 0) {
+        unsigned char erased[STORAGE_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        if (write(storage_fd, erased, sizeof(erased)) == -1) perror(path);
+    }
+    return storage_fd;
+}
+
+void storage_read(void *dest, uintptr_t offset, size_t size)
+{
+    memset(dest, 0xFF, size);
+
+    int fd = storage_open();
+    if (fd == -1) return;
+    if (pread(fd, dest, size, offset) == -1) perror("pread");
+}
+
+void storage_write(const void *src, uintptr_t offset, size_t size)
+{
+    int fd = storage_open();
+    if (fd == -1) return;
+    if (pwrite(fd, src, size, offset) != (ssize_t)size) perror("pwrite");
+}
@@ -0,0 +1,26 @@
+#include "timer.h"
+
+#include <time.h>
+
+// Microseconds since timer_init(), wrapping around like on the adapter
+
+static uint64_t start;
+
+static uint64_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void timer_init(void)
+{
+    start = now();
+}
+
+uint32_t timer_get(void)
+{
+    return now() - start;
+}
+
+void timer_isr(void) {}
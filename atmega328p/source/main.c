@@ -1,27 +1,34 @@
 #include <stdint.h>
 #include <stdio.h>
-#include <avr/interrupt.h>
-#include <avr/eeprom.h>
 #include <avr/pgmspace.h>
-#include <util/atomic.h>
+#if defined(__AVR__)
+#include <avr/interrupt.h>
 #include <util/delay.h>
+#endif
 
 #include <mobile.h>
 #include <mobile_data.h>
 
+#if defined(__AVR__)
 #include "utils.h"
 #include "pins.h"
+#endif
 #include "timer.h"
 #include "serial.h"
+#include "spi.h"
+#include "storage.h"
 
 #include "gbridge.h"
+#include "gbridge_cmd.h"
 #include "gbridge_prot_ma.h"
 
+#if defined(__AVR__)
 // A stack canary is a value that will be checked periodically
 // This allows making sure the stack doesn't overflow into used data
 #define STACK_SIZE 0x180
 #define STACK_CANARY *(uint32_t *)(RAMEND - STACK_SIZE - 1)
 #define STACK_CANARY_VAL 0xAAAAAAAA
+#endif
 
 // Define this to print every byte sent and received
 //#define DEBUG_SPI
@@ -80,30 +87,27 @@ void mobile_impl_debug_log(void *user, const char *line)
 void mobile_impl_serial_disable(void *user)
 {
     (void)user;
-    SPCR = SPSR = 0;
+    spi_disable();
 }
 
 void mobile_impl_serial_enable(void *user, bool mode_32bit)
 {
     (void)user;
     (void)mode_32bit;
-    pinmode(PIN_SPI_MISO, OUTPUT);
-    SPCR = _BV(SPE) | _BV(SPIE) | _BV(CPOL) | _BV(CPHA);
-    SPSR = 0;
-    SPDR = MOBILE_SERIAL_IDLE_BYTE;
+    spi_enable(MOBILE_SERIAL_IDLE_BYTE);
 }
 
 bool mobile_impl_config_read(void *user, void *dest, uintptr_t offset, size_t size)
 {
     (void)user;
-    eeprom_read_block(dest, (void *)offset, size);
+    storage_read(dest, offset, size);
     return true;
 }
 
 bool mobile_impl_config_write(void *user, const void *src, uintptr_t offset, size_t size)
 {
     (void)user;
-    eeprom_write_block(src, (void *)offset, size);
+    storage_write(src, offset, size);
     return true;
 }
 
@@ -121,18 +125,21 @@ bool mobile_impl_time_check_ms(void *user, unsigned timer, unsigned ms)
 
 int main(void)
 {
+#if defined(__AVR__)
     // Install stack canary
     STACK_CANARY = STACK_CANARY_VAL;
+#endif
 
     // Initialize
     timer_init();
-    serial_init(500000);
+    serial_init(GBRIDGE_BAUD);
+    spi_init();
     mobile_init(&adapter, NULL);
 
     // Reset configs
     /*
-    eeprom_write_block(&(char []){0}, (void *)0x000, 1);
-    eeprom_write_block(&(char []){0}, (void *)0x100, 1);
+    storage_write(&(char []){0}, 0x000, 1);
+    storage_write(&(char []){0}, 0x100, 1);
     */
 
     // Write config
@@ -161,13 +168,9 @@ int main(void)
     gbridge_prot_ma_init();
 #endif
 
-    // Set up timer 0
-    TCNT0 = 0;
-    TCCR0A = 0;
-    TCCR0B = _BV(CS01) | _BV(CS00);  // Prescale by 1/64
-    TIMSK0 = _BV(TOIE0);  // Enable the interrupt
-
+#if defined(__AVR__)
     sei();
+#endif
 
 #if defined(DEBUG_SPI) || defined(DEBUG_CMD)
     printf_P(PSTR("----\r\n"));
@@ -192,17 +195,18 @@ int main(void)
     }
 }
 
-ISR (SPI_STC_vect)
+unsigned char spi_transfer(unsigned char c)
 {
 #ifdef DEBUG_SPI
-    if (!buffer_isfull()) buffer_put(SPDR);
+    if (!buffer_isfull()) buffer_put(c);
     if (!buffer_isfull()) buffer_put(last_SPDR);
-    SPDR = last_SPDR = mobile_transfer(&adapter, SPDR);
+    return last_SPDR = mobile_transfer(&adapter, c);
 #else
-    SPDR = mobile_transfer(&adapter, SPDR);
+    return mobile_transfer(&adapter, c);
 #endif
 }
 
+#if defined(__AVR__)
 ISR (TIMER0_OVF_vect)
 {
     // Hang if the stack canary has been tripped
@@ -220,3 +224,4 @@ ISR (TIMER0_OVF_vect)
 
     timer_isr();
 }
+#endif
@@ -6,3 +6,5 @@
 #define PIN_SPI_SCK B, 5
 
 #define PIN_LED B, 5
+
+#define PIN_SERIAL_RTS D, 2
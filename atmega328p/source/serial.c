@@ -1,5 +1,6 @@
 #include "serial.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -7,8 +8,12 @@
 #include <avr/interrupt.h>
 
 #include "utils.h"
+#include "pins.h"
 
-#define SERIAL_BUFFER_SIZE 0x40
+// Receive buffer levels at which the host is told to stop and resume sending
+// The USB-serial chip may take a few more bytes before it stops.
+#define SERIAL_RTS_STOP (SERIAL_BUFFER_SIZE - 0x10)
+#define SERIAL_RTS_START 0x10
 
 struct serial_buffer {
     volatile unsigned char buffer[SERIAL_BUFFER_SIZE];
@@ -19,6 +24,12 @@ struct serial_buffer {
 static volatile struct serial_buffer serial_rx;
 static volatile struct serial_buffer serial_tx;
 
+// Bytes that have been taken out of the receive buffer, and bytes that never
+//   made it in, counted separately since only the latter happens in the ISR.
+static unsigned char serial_rx_read;
+static volatile unsigned char serial_rx_dropped;
+static volatile unsigned char serial_rx_overrun;
+
 __attribute__((always_inline))
 static inline int serial_buffer_isempty(volatile struct serial_buffer *buffer)
 {
@@ -31,6 +42,12 @@ static inline int serial_buffer_isfull(volatile struct serial_buffer *buffer)
     return ((unsigned char)(buffer->head + 1) % SERIAL_BUFFER_SIZE) == buffer->tail;
 }
 
+__attribute__((always_inline))
+static inline unsigned char serial_buffer_size(volatile struct serial_buffer *buffer)
+{
+    return (unsigned char)(SERIAL_BUFFER_SIZE + buffer->head - buffer->tail) % SERIAL_BUFFER_SIZE;
+}
+
 __attribute__((always_inline))
 static inline void serial_buffer_put(volatile struct serial_buffer *buffer, unsigned char c)
 {
@@ -60,17 +77,32 @@ static void serial_receive(void)
 {
     // Called when UDR0 contains new data
 
+    // If the ISR couldn't keep up, at least one byte has been lost
+    if (bit_is_set(UCSR0A, DOR0)) {
+        serial_rx_dropped++;
+        serial_rx_overrun++;
+    }
+
     // Discard the byte if a parity error has occurred or the buffer is full
-    if (bit_is_set(UCSR0A, UPE0) || bit_is_set(UCSR0A, FE0) ||
-            serial_buffer_isfull(&serial_rx)) {
+    bool full = serial_buffer_isfull(&serial_rx);
+    if (bit_is_set(UCSR0A, UPE0) || bit_is_set(UCSR0A, FE0) || full) {
+        if (full) serial_rx_overrun++;
+        serial_rx_dropped++;
         UDR0;
         return;
     }
 
     // There's not much we can do with a full buffer, unfortunately.
-    // Delaying the read will only cause it to be replaced with further data.
+    // Delaying the read will only cause it to be replaced with further data,
+    //   which is why the host is expected to keep track of the free space.
 
     serial_buffer_put(&serial_rx, UDR0);
+
+#ifdef SERIAL_RTS
+    if (serial_buffer_size(&serial_rx) >= SERIAL_RTS_STOP) {
+        writepin(PIN_SERIAL_RTS, HIGH);
+    }
+#endif
 }
 
 ISR(USART_UDRE_vect) { serial_transmit(); }
@@ -102,7 +134,15 @@ inline unsigned char serial_getchar_inline(void)
     while (serial_buffer_isempty(&serial_rx));
 
     // Read the next character
-    return serial_buffer_get(&serial_rx);
+    unsigned char c = serial_buffer_get(&serial_rx);
+    serial_rx_read++;
+
+#ifdef SERIAL_RTS
+    if (serial_buffer_size(&serial_rx) <= SERIAL_RTS_START) {
+        writepin(PIN_SERIAL_RTS, LOW);
+    }
+#endif
+    return c;
 }
 
 unsigned char serial_getchar(void) { return serial_getchar_inline(); }
@@ -115,7 +155,21 @@ static FILE serial = FDEV_SETUP_STREAM(stdio_serial_putchar, stdio_serial_getcha
 
 unsigned serial_available(void)
 {
-    return ((unsigned)(SERIAL_BUFFER_SIZE + serial_rx.head - serial_rx.tail)) % SERIAL_BUFFER_SIZE;
+    return serial_buffer_size(&serial_rx);
+}
+
+// Amount of received bytes that no longer take up space in the buffer,
+//   wrapping around
+unsigned char serial_rx_consumed(void)
+{
+    return serial_rx_read + serial_rx_dropped;
+}
+
+// Amount of received bytes lost because they couldn't be stored in time,
+//   wrapping around
+unsigned char serial_rx_overruns(void)
+{
+    return serial_rx_overrun;
 }
 
 void serial_drain(void)
@@ -123,18 +177,29 @@ void serial_drain(void)
     while (bit_is_set(UCSR0B, UDRIE0) || bit_is_set(UCSR0A, RXC0));
 }
 
-void serial_init_config(unsigned long bauds, uint8_t config)
+void serial_set_bauds(unsigned long bauds)
 {
     // Calculate UBRRn value as per the datasheet
     uint16_t ubrr = F_CPU / 4 / 2 / bauds - 1;
     UBRR0H = (ubrr >> 8) & 0xFF;
     UBRR0L = ubrr & 0xFF;
+}
+
+void serial_init_config(unsigned long bauds, uint8_t config)
+{
+    serial_set_bauds(bauds);
 
     // Configure the serial
     UCSR0A = _BV(U2X0);  // Double speed
     UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);  // Enable it and the receive interrupt
     UCSR0C = config;
 
+#ifdef SERIAL_RTS
+    // Ready to receive
+    pinmode(PIN_SERIAL_RTS, OUTPUT);
+    writepin(PIN_SERIAL_RTS, LOW);
+#endif
+
     // Setup stdio streams
     stdout = stderr = stdin = &serial;
 }
@@ -2,6 +2,13 @@
 
 #include <stdint.h>
 
+// Define this to have the adapter tell the host to stop sending, through
+//   PIN_SERIAL_RTS, when the receive buffer is getting full.
+// This pin has to be connected to the CTS input of the USB-serial chip.
+//#define SERIAL_RTS
+
+#define SERIAL_BUFFER_SIZE 0x40
+
 #define SERIAL_5N1 0
 #define SERIAL_6N1 _BV(UCSZ00)
 #define SERIAL_7N1 _BV(UCSZ01)
@@ -32,6 +39,9 @@ void serial_putchar(unsigned char c);
 unsigned char serial_getchar_inline(void);
 unsigned char serial_getchar(void);
 unsigned serial_available(void);
+unsigned char serial_rx_consumed(void);
+unsigned char serial_rx_overruns(void);
 void serial_drain(void);
+void serial_set_bauds(unsigned long bauds);
 void serial_init_config(unsigned long bauds, uint8_t config);
 void serial_init(unsigned long bauds);
@@ -0,0 +1,31 @@
+#include "spi.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "utils.h"
+#include "pins.h"
+
+void spi_init(void)
+{
+    pinmode(PIN_SPI_MISO, OUTPUT);
+}
+
+// Start listening to the Game Boy, sending the first byte in the first
+//   transfer
+void spi_enable(unsigned char first)
+{
+    SPCR = _BV(SPE) | _BV(SPIE) | _BV(CPOL) | _BV(CPHA);
+    SPSR = 0;
+    SPDR = first;
+}
+
+void spi_disable(void)
+{
+    SPCR = SPSR = 0;
+}
+
+ISR (SPI_STC_vect)
+{
+    SPDR = spi_transfer(SPDR);
+}
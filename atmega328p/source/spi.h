@@ -0,0 +1,10 @@
+#pragma once
+
+void spi_init(void);
+void spi_enable(unsigned char first);
+void spi_disable(void);
+
+// Called for every byte received from the Game Boy, from within the
+//   interrupt, returning the byte to send back in the next transfer.
+// Has to be implemented by the user.
+unsigned char spi_transfer(unsigned char c);
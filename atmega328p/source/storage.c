@@ -0,0 +1,13 @@
+#include "storage.h"
+
+#include <avr/eeprom.h>
+
+void storage_read(void *dest, uintptr_t offset, size_t size)
+{
+    eeprom_read_block(dest, (void *)offset, size);
+}
+
+void storage_write(const void *src, uintptr_t offset, size_t size)
+{
+    eeprom_write_block(src, (void *)offset, size);
+}
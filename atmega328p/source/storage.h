@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Non-volatile storage for the adapter configuration
+
+void storage_read(void *dest, uintptr_t offset, size_t size);
+void storage_write(const void *src, uintptr_t offset, size_t size);
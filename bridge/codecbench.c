@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Microbenchmark of the frame codec shared by the adapter and the bridge
+// Every part of it is run over and over on the same frame for a while, and
+//   the time it takes is reported per call and per byte, so that changes to
+//   gbridge_codec.c can be compared against each other.
+// The data is made up of random bytes, with every so many of them zero, as
+//   that's what the COBS encoding depends on.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "source/gbridge_codec.h"
+
+// Biggest frame that's benchmarked, as the bridge's output buffer
+#define FRAME_MAX 0x1000
+
+// Bytes a COBS-encoded frame takes at most
+#define ENCODED_MAX (FRAME_MAX + FRAME_MAX / 0xFE + 2)
+
+static unsigned frame_size = 0xFE;
+static unsigned zero_every = 64;  // Average bytes per zero, 0 for none
+static double run_secs = 0.5;
+
+static unsigned char frame[FRAME_MAX];
+static unsigned char encoded[ENCODED_MAX];  // The frame, COBS-encoded
+static unsigned encoded_size;
+static unsigned char output[ENCODED_MAX];
+static unsigned char decoded[FRAME_MAX + 6];
+
+// Keeps the compiler from leaving out work that doesn't seem to be used
+static volatile unsigned sink;
+
+struct output {
+    unsigned char *buf;
+    unsigned size;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void output_put(void *user, unsigned char c)
+{
+    struct output *out = user;
+    out->buf[out->size++] = c;
+}
+
+static void bench_checksum(void)
+{
+    sink += gbridge_checksum(frame, frame_size);
+}
+
+static unsigned encode(unsigned char *buf, bool cobs)
+{
+    // Split up the way the bridge sends a frame: header, data and checksum
+    unsigned char header[4] = {0};
+    unsigned char checksum[2] = {0};
+    struct output out = {buf, 0};
+    gbridge_frame_encode((struct gbridge_frame_part []){
+        {header, sizeof(header)},
+        {frame, frame_size},
+        {checksum, sizeof(checksum)}
+    }, 3, cobs, output_put, &out);
+    return out.size;
+}
+
+static void bench_encode(void)
+{
+    sink += encode(output, false);
+}
+
+static void bench_encode_cobs(void)
+{
+    sink += encode(output, true);
+}
+
+// Decode a whole frame, and check it, like a frame parser would
+static void bench_parse(void)
+{
+    struct gbridge_cobs cobs = {0};
+    unsigned size = 0;
+    for (unsigned i = 0; i < encoded_size && !cobs.end; i++) {
+        int c = gbridge_cobs_decode(&cobs, encoded[i]);
+        if (c >= 0) decoded[size++] = c;
+    }
+    sink += gbridge_checksum(decoded, size);
+}
+
+static void bench_address_write(void)
+{
+    struct mobile_addr4 addr4 = {
+        .type = MOBILE_ADDRTYPE_IPV4,
+        .port = 80,
+        .host = {127, 0, 0, 1},
+    };
+    struct mobile_addr6 addr6 = {
+        .type = MOBILE_ADDRTYPE_IPV6,
+        .port = 443,
+        .host = {[15] = 1},
+    };
+    unsigned char buffer[GBRIDGE_ADDRESS_MAXLEN];
+    sink += gbridge_address_write((struct mobile_addr *)&addr4, buffer);
+    sink += gbridge_address_write((struct mobile_addr *)&addr6, buffer);
+}
+
+static void bench_address_read(void)
+{
+    static const unsigned char addr4[] = {MOBILE_ADDRTYPE_IPV4, 0, 80,
+        127, 0, 0, 1};
+    static const unsigned char addr6[] = {MOBILE_ADDRTYPE_IPV6, 1, 187,
+        [18] = 1};
+    struct mobile_addr addr;
+    sink += gbridge_address_read(&addr, addr4, sizeof(addr4));
+    sink += gbridge_address_read(&addr, addr6, sizeof(addr6));
+}
+
+// Run a benchmark for a while, and report how long a call takes
+// The bytes it goes through per call are used to report its throughput.
+static void run(const char *name, void (*bench)(void), unsigned bytes)
+{
+    uint64_t start = now_ns();
+    uint64_t end = start + run_secs * 1e9;
+    unsigned long calls = 0;
+    uint64_t time;
+    do {
+        for (unsigned i = 0; i < 0x100; i++) bench();
+        calls += 0x100;
+        time = now_ns();
+    } while (time < end);
+
+    double ns = (double)(time - start) / calls;
+    printf("%-16s %10.1f ns/call", name, ns);
+    if (bytes) printf(" %10.2f ns/byte %10.1f MB/s", ns / bytes, bytes / ns * 1e3);
+    putchar('\n');
+}
+
+// Make sure a frame comes out of the decoder like it went into the encoder
+static bool check(void)
+{
+    bench_parse();
+    if (memcmp(decoded + 4, frame, frame_size)) {
+        fprintf(stderr, "The decoded frame doesn't match\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:z:t:")) != -1) {
+        switch (opt) {
+        case 's': frame_size = strtoul(optarg, NULL, 0); break;
+        case 'z': zero_every = strtoul(optarg, NULL, 0); break;
+        case 't': run_secs = strtod(optarg, NULL); break;
+        default: goto usage;
+        }
+    }
+    if (optind != argc) goto usage;
+    if (!frame_size || frame_size > FRAME_MAX - 6 || run_secs <= 0) goto usage;
+
+    srand(1);
+    for (unsigned i = 0; i < frame_size; i++) {
+        frame[i] = rand() % 0xFF + 1;
+        if (zero_every && rand() % zero_every == 0) frame[i] = 0;
+    }
+    encoded_size = encode(encoded, true);
+    if (!check()) return EXIT_FAILURE;
+
+    printf("Frames of %u bytes", frame_size);
+    if (zero_every) printf(", one zero every %u bytes", zero_every);
+    putchar('\n');
+    run("checksum", bench_checksum, frame_size);
+    run("encode", bench_encode, frame_size + 6);
+    run("encode cobs", bench_encode_cobs, frame_size + 6);
+    run("parse cobs", bench_parse, encoded_size);
+    run("address_write", bench_address_write, 0);
+    run("address_read", bench_address_read, 0);
+    return EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "Usage: %s [-s size] [-z zero_every] [-t seconds]\n", argv[0]);
+    return EXIT_FAILURE;
+}
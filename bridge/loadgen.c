@@ -0,0 +1,1425 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Load generator for the bridge, standing in for any amount of adapters
+// Every adapter is a pseudo-terminal, which a bridge opens as its serial
+//   port. Behind it, a synthetic adapter does the handshake, and then keeps
+//   making requests the way gbridge_prot_ma.c on the adapter does: OPEN and
+//   CONNECT, SEND and RECV for as long as the test lasts, and CLOSE. The data
+//   goes to an echo server of its own, unless another one is given, and
+//   comes back through RECV.
+// The time every request takes to be replied to is reported in percentiles,
+//   along with the amount of frames that went through, to find out how many
+//   adapters a bridge is able to keep up with.
+// The bridges it starts may be traced, to count the system calls they make
+//   for every byte that goes through them.
+// The adapters may ask for PUSH and EVENTS as well, to have the data pushed
+//   to them, and be told when the connection is made, the way the adapter
+//   does with a bridge that supports them.
+// In bulk mode, the data isn't echoed. The adapters keep sending without
+//   waiting for it, to fill up the bridge's send queue, and the server checks
+//   that none of what the bridge said it sent went missing.
+
+#define _GNU_SOURCE  // posix_openpt(), ptsname()
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "source/gbridge_cmd.h"
+#include "source/gbridge_prot_ma_cmd.h"
+
+#define ADAPTERS_MAX 64
+
+// Capabilities offered in the extended handshake
+// Others would require timing or a baud rate, which a pty doesn't have.
+#define CAPS (GBRIDGE_CAP_WINDOW | GBRIDGE_CAP_COBS | GBRIDGE_CAP_EXT | \
+    GBRIDGE_CAP_INLINE)
+
+// Capabilities offered on top of those when asked to
+#define CAPS_PUSH (GBRIDGE_CAP_PUSH | GBRIDGE_CAP_EVENTS)
+
+// Biggest amount of data sent at once, as much as the bridge takes
+#define SEND_MAX 0x200
+
+// Amount of data asked for at once, like the adapter's receive buffer
+#define RECV_SIZE 0x80
+
+// Time before frames that haven't been acknowledged are sent again
+#define RTO_US 200000
+
+// Bulk data repeats with a period that doesn't divide any size it's sent in,
+//   so a missing piece shows up as a gap
+#define BULK_PERIOD 251
+
+// Time given to the adapters to close their connection once the test is over
+#define GRACE_US 2000000
+
+#define FRAME_MAX (8 + SEND_MAX)
+#define QUEUE_MAX 4
+
+// From mobile.h, as used by the bridge
+#define SOCKTYPE_TCP 0
+#define ADDRTYPE_NONE 0
+#define ADDRTYPE_IPV4 1
+#define ADDRTYPE_IPV6 2
+
+// Connection used by every adapter
+#define CONN 0
+
+enum state {
+    STATE_HANDSHAKE,
+    STATE_OPEN,
+    STATE_CONNECT,
+    STATE_IDLE,  // Waiting to send again
+    STATE_SEND,
+    STATE_RECV,
+    STATE_CLOSE,
+    STATE_DONE,
+};
+
+// Latency of requests, kept whole to find the percentiles
+enum req_stat {
+    STAT_OPEN,
+    STAT_CONNECT,
+    STAT_SEND,
+    STAT_RECV,
+    STAT_CLOSE,
+    STAT_ECHO,  // From SEND until all of the data has come back
+    STAT_COUNT
+};
+static const char *stat_names[STAT_COUNT] = {
+    "open", "connect", "send", "recv", "close", "echo"
+};
+
+struct samples {
+    uint32_t *us;
+    size_t count;
+    size_t alloc;
+};
+
+// Frame waiting to be sent, or to be acknowledged
+struct pending {
+    unsigned char cmd;
+    unsigned size;
+    unsigned char data[SEND_MAX];
+};
+
+struct adapter {
+    int fd;
+    int peer;  // Keeps the pty open until the bridge opens it
+    char name[0x40];
+
+    bool connected;
+    bool was_connected;
+    unsigned caps;
+    unsigned char handshake_progress;
+    bool handshake_caps;  // The next byte is the bridge's capabilities
+    bool handshake_caps_ext;  // The next byte is the second byte of them
+
+    // Input, either a COBS-decoded frame or raw bytes
+    unsigned char in[FRAME_MAX * 2];
+    unsigned in_size;
+    unsigned char cobs_left;
+    bool cobs_zero;
+    bool cobs_skip;
+
+    unsigned char out[0x1000];
+    unsigned out_size;
+
+    struct pending queue[QUEUE_MAX];
+    unsigned queue_first;
+    unsigned queue_count;
+
+    // Windowed mode, see gbridge_cmd.h
+    struct pending unacked[GBRIDGE_WINDOW_SIZE];
+    unsigned char send_seq;
+    unsigned char send_acked;
+    unsigned char send_window;
+    uint64_t send_time;
+    unsigned char recv_seq;
+
+    // Without it, every frame waits for its reply
+    unsigned char waiting_cmd;
+
+    // Request waiting for its reply
+    enum state state;
+    unsigned char req_cmd;
+    uint64_t req_time;
+    bool req_stream;  // The data follows in a stream
+
+    // Pushed data, counted as in gbridge_prot_ma_cmd.h
+    unsigned char rx_consumed;
+    unsigned char rx_limit;  // Last limit sent to the bridge
+    bool push_stream;  // The data follows in a stream
+
+    unsigned char payload[SEND_MAX];
+    unsigned payload_seed;
+    unsigned char bulk_next;  // Next byte of bulk data
+    unsigned echo_left;
+    uint64_t echo_start;
+    uint64_t next_send;
+};
+
+struct echo_client {
+    int fd;
+    unsigned char bulk_next;  // Byte of bulk data expected next
+    unsigned size;
+    unsigned char buf[0x1000];
+};
+
+static struct adapter adapters[ADAPTERS_MAX];
+static unsigned adapter_count = 1;
+static pid_t bridges[ADAPTERS_MAX];
+static int bridge_counts[ADAPTERS_MAX];  // Pipe the system calls come from
+
+static int echo_listen = -1;
+static struct echo_client echo_clients[ADAPTERS_MAX];
+static unsigned char server_host[4] = {127, 0, 0, 1};
+static unsigned server_port;
+
+static bool legacy;
+static bool push;
+static bool bulk;
+static bool count_syscalls;
+static unsigned send_size = 0xFE;
+static unsigned rate;  // Echoes per second and adapter, 0 for no limit
+static unsigned run_secs = 10;
+
+static uint64_t now;
+static bool started;
+static uint64_t stop_time;
+static bool aborted;
+
+static struct samples stats[STAT_COUNT];
+static unsigned long frames_sent;
+static unsigned long frames_received;
+static unsigned long bytes_echoed;
+static unsigned long bytes_sent;
+static unsigned long bytes_arrived;
+static unsigned long short_sends;
+static unsigned long retransmissions;
+static unsigned long link_resets;
+static unsigned long mismatches;
+static unsigned long failures;
+static unsigned long syscalls;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stat_add(enum req_stat stat, uint64_t us)
+{
+    struct samples *samples = &stats[stat];
+    if (samples->count == samples->alloc) {
+        samples->alloc = samples->alloc ? samples->alloc * 2 : 0x400;
+        samples->us = realloc(samples->us, samples->alloc * sizeof(*samples->us));
+        if (!samples->us) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples->us[samples->count++] = us;
+}
+
+static bool windowed(const struct adapter *ad)
+{
+    return ad->caps & GBRIDGE_CAP_WINDOW;
+}
+
+static bool cobs(const struct adapter *ad)
+{
+    return (ad->caps & GBRIDGE_CAP_COBS) && windowed(ad);
+}
+
+static bool pushing(const struct adapter *ad)
+{
+    return (ad->caps & GBRIDGE_CAP_PUSH) && windowed(ad);
+}
+
+static bool events(const struct adapter *ad)
+{
+    return pushing(ad) && (ad->caps & GBRIDGE_CAP_EVENTS);
+}
+
+static void out_put(struct adapter *ad, unsigned char c)
+{
+    // Every adapter only has a few frames in flight, which always fit
+    if (ad->out_size == sizeof(ad->out)) {
+        fprintf(stderr, "%s: output buffer full\n", ad->name);
+        exit(EXIT_FAILURE);
+    }
+    ad->out[ad->out_size++] = c;
+}
+
+static void out_flush(struct adapter *ad)
+{
+    if (!ad->out_size) return;
+    ssize_t len = write(ad->fd, ad->out, ad->out_size);
+    if (len <= 0) return;
+    memmove(ad->out, ad->out + len, ad->out_size - len);
+    ad->out_size -= len;
+}
+
+// Write a frame, encoding it with COBS if it's in use
+static void frame_write(struct adapter *ad, const unsigned char *buf, unsigned size)
+{
+    frames_sent++;
+    if (!cobs(ad)) {
+        for (unsigned i = 0; i < size; i++) out_put(ad, buf[i]);
+        return;
+    }
+
+    unsigned pos = 0;
+    for (;;) {
+        unsigned len = 0;
+        while (pos + len < size && len < 0xFE && buf[pos + len]) len++;
+        out_put(ad, len + 1);
+        for (unsigned i = 0; i < len; i++) out_put(ad, buf[pos + i]);
+        pos += len;
+        if (pos == size) break;
+        if (len != 0xFE) pos++;
+    }
+    out_put(ad, 0);
+}
+
+static void frame_send(struct adapter *ad, const struct pending *frame, unsigned char seq)
+{
+    unsigned char buf[FRAME_MAX];
+    unsigned size = 0;
+    uint16_t checksum = 0;
+
+    buf[size++] = frame->cmd;
+    if (windowed(ad)) {
+        buf[size++] = seq;
+        checksum += seq;
+    }
+    if (frame->cmd == GBRIDGE_CMD_STREAM) buf[size++] = frame->size >> 8;
+    buf[size++] = frame->size;
+
+    // The original protocol only checksums the first (size % 0x100) bytes
+    unsigned sum_size = windowed(ad) ? frame->size : (unsigned char)frame->size;
+    for (unsigned i = 0; i < sum_size; i++) checksum += frame->data[i];
+
+    memcpy(buf + size, frame->data, frame->size);
+    size += frame->size;
+    buf[size++] = checksum >> 8;
+    buf[size++] = checksum >> 0;
+    frame_write(ad, buf, size);
+}
+
+// Send queued frames, as far as the bridge is able to take them
+static void send_pump(struct adapter *ad)
+{
+    while (ad->queue_count) {
+        struct pending *frame = &ad->queue[ad->queue_first];
+        if (windowed(ad)) {
+            if ((unsigned char)(ad->send_seq - ad->send_acked) >= GBRIDGE_WINDOW_SIZE ||
+                    (unsigned char)(ad->send_window - ad->send_seq - 1) >= GBRIDGE_WINDOW_SIZE) {
+                return;
+            }
+            if (ad->send_seq == ad->send_acked) ad->send_time = now;
+            ad->unacked[ad->send_seq % GBRIDGE_WINDOW_SIZE] = *frame;
+            frame_send(ad, frame, ad->send_seq++);
+        } else {
+            if (ad->waiting_cmd) return;
+            ad->waiting_cmd = frame->cmd;
+            frame_send(ad, frame, 0);
+        }
+        ad->queue_first = (ad->queue_first + 1) % QUEUE_MAX;
+        ad->queue_count--;
+    }
+}
+
+static void send_queue(struct adapter *ad, unsigned char cmd, const void *data, unsigned size)
+{
+    if (ad->queue_count == QUEUE_MAX) {
+        fprintf(stderr, "%s: send queue full\n", ad->name);
+        exit(EXIT_FAILURE);
+    }
+    struct pending *frame = &ad->queue[(ad->queue_first + ad->queue_count++) % QUEUE_MAX];
+    frame->cmd = cmd;
+    frame->size = size;
+    memcpy(frame->data, data, size);
+    send_pump(ad);
+}
+
+static void send_retransmit(struct adapter *ad)
+{
+    for (unsigned char seq = ad->send_acked; seq != ad->send_seq; seq++) {
+        frame_send(ad, &ad->unacked[seq % GBRIDGE_WINDOW_SIZE], seq);
+        retransmissions++;
+    }
+    ad->send_time = now;
+}
+
+static void send_ack(struct adapter *ad)
+{
+    // Data is handled as it arrives, so the window is always open
+    frame_write(ad, (unsigned char []){
+        GBRIDGE_CMD_ACK, ad->recv_seq - 1, GBRIDGE_WINDOW_SIZE}, 3);
+}
+
+static void fail(struct adapter *ad, const char *reason)
+{
+    fprintf(stderr, "%s: %s\n", ad->name, reason);
+    failures++;
+    ad->state = STATE_DONE;
+}
+
+static void request(struct adapter *ad, const unsigned char *data, unsigned size, enum state state)
+{
+    ad->state = state;
+    ad->req_cmd = data[0];
+    ad->req_time = now;
+    ad->req_stream = false;
+    send_queue(ad, GBRIDGE_CMD_DATA, data, size);
+}
+
+static void ma_open(struct adapter *ad)
+{
+    request(ad, (unsigned char []){
+        GBRIDGE_PROT_MA_CMD_OPEN, CONN, SOCKTYPE_TCP, ADDRTYPE_IPV4, 0, 0
+    }, 6, STATE_OPEN);
+}
+
+static void ma_connect(struct adapter *ad)
+{
+    request(ad, (unsigned char []){
+        GBRIDGE_PROT_MA_CMD_CONNECT, CONN, ADDRTYPE_IPV4,
+        server_port >> 8, server_port >> 0,
+        server_host[0], server_host[1], server_host[2], server_host[3]
+    }, 9, STATE_CONNECT);
+}
+
+static void ma_recv(struct adapter *ad)
+{
+    request(ad, (unsigned char []){
+        GBRIDGE_PROT_MA_CMD_RECV, CONN, RECV_SIZE >> 8, RECV_SIZE & 0xFF
+    }, 4, STATE_RECV);
+}
+
+// Tell the bridge how much pushed data there's room for
+// This isn't replied to, so it doesn't wait for anything.
+static void ma_recv_window(struct adapter *ad)
+{
+    ad->rx_limit = ad->rx_consumed + RECV_SIZE;
+    send_queue(ad, GBRIDGE_CMD_DATA, (unsigned char []){
+        GBRIDGE_PROT_MA_CMD_RECV_WINDOW, CONN, ad->rx_limit
+    }, 3);
+}
+
+static void ma_close(struct adapter *ad)
+{
+    request(ad, (unsigned char []){GBRIDGE_PROT_MA_CMD_CLOSE, CONN}, 2,
+        STATE_CLOSE);
+}
+
+// Send a new batch of data, small ones along with the request
+static void ma_send(struct adapter *ad)
+{
+    ad->payload_seed++;
+    for (unsigned i = 0; i < send_size; i++) {
+        ad->payload[i] = ad->payload_seed + i;
+        if (bulk) {
+            ad->payload[i] = ad->bulk_next;
+            ad->bulk_next = (ad->bulk_next + 1) % BULK_PERIOD;
+        }
+    }
+    ad->echo_left = send_size;
+    ad->echo_start = now;
+
+    unsigned char data[GBRIDGE_MAX_DATA_SIZE];
+    data[1] = CONN;
+    data[2] = ADDRTYPE_NONE;
+    if ((ad->caps & GBRIDGE_CAP_INLINE) && 3 + send_size <= GBRIDGE_MAX_DATA_SIZE) {
+        data[0] = GBRIDGE_PROT_MA_CMD_SEND_INLINE;
+        memcpy(data + 3, ad->payload, send_size);
+        request(ad, data, 3 + send_size, STATE_SEND);
+        return;
+    }
+    data[0] = GBRIDGE_PROT_MA_CMD_SEND;
+    request(ad, data, 3, STATE_SEND);
+    send_queue(ad, GBRIDGE_CMD_STREAM, ad->payload, send_size);
+}
+
+static unsigned address_size(const unsigned char *buf, unsigned size)
+{
+    if (size < 1) return 0;
+    switch (buf[0]) {
+    case ADDRTYPE_NONE: return 1;
+    case ADDRTYPE_IPV4: return size >= 7 ? 7 : 0;
+    case ADDRTYPE_IPV6: return size >= 19 ? 19 : 0;
+    default: return 0;
+    }
+}
+
+// Check the data that came back against what was sent
+static void echo_data(struct adapter *ad, const unsigned char *data, unsigned size)
+{
+    if (size > ad->echo_left) {
+        mismatches++;
+        size = ad->echo_left;
+    }
+    if (memcmp(data, ad->payload + send_size - ad->echo_left, size)) {
+        mismatches++;
+    }
+    bytes_echoed += size;
+    ad->echo_left -= size;
+    if (!pushing(ad)) stat_add(STAT_RECV, now - ad->req_time);
+
+    // Pushed data keeps coming by itself, possibly before SEND is replied to
+    if (ad->echo_left) {
+        if (!pushing(ad)) ma_recv(ad);
+        return;
+    }
+    stat_add(STAT_ECHO, now - ad->echo_start);
+    if (ad->state == STATE_RECV) ad->state = STATE_IDLE;
+}
+
+// Take in pushed data, and make room for more like the adapter does
+static void push_data(struct adapter *ad, const unsigned char *data, unsigned size)
+{
+    echo_data(ad, data, size);
+    if (ad->state == STATE_DONE) return;
+
+    // The data is taken out right away, which always empties the buffer
+    ad->rx_consumed += size;
+    if ((unsigned char)(ad->rx_consumed + RECV_SIZE) != ad->rx_limit) {
+        ma_recv_window(ad);
+    }
+}
+
+// Handle data pushed by the bridge, which looks like the reply to RECV
+static void ma_push(struct adapter *ad, const unsigned char *data, unsigned size)
+{
+    if (size < 4 || data[1] != CONN) {
+        fail(ad, "unexpected push");
+        return;
+    }
+    int res = (int16_t)(data[2] << 8 | data[3]);
+    unsigned addrlen = address_size(data + 4, size - 4);
+    if (res < 0 || !addrlen) {
+        fail(ad, "connection lost");
+        return;
+    }
+    if (res == 0) return;
+
+    unsigned data_size = size - 4 - addrlen;
+    if (data_size) {
+        push_data(ad, data + 4 + addrlen, data_size);
+    } else {
+        ad->push_stream = true;
+    }
+}
+
+// Handle the events of the connection, instead of asking about it
+static void ma_event(struct adapter *ad, const unsigned char *data, unsigned size)
+{
+    if (size < 2 + CONN) return;
+    unsigned char flags = data[1 + CONN];
+    if (flags & GBRIDGE_PROT_MA_EVENT_CONNECT_FAILED) {
+        fail(ad, "CONNECT failed");
+        return;
+    }
+    if (flags & GBRIDGE_PROT_MA_EVENT_CLOSED) {
+        fail(ad, "connection lost");
+        return;
+    }
+    if ((flags & GBRIDGE_PROT_MA_EVENT_CONNECTED) && ad->state == STATE_CONNECT) {
+        ad->state = STATE_IDLE;
+        ad->next_send = now;
+    }
+}
+
+// Handle a data packet or stream from the bridge
+static void ma_packet(struct adapter *ad, bool stream, const unsigned char *data, unsigned size)
+{
+    if (stream) {
+        if (ad->push_stream) {
+            ad->push_stream = false;
+            push_data(ad, data, size);
+            return;
+        }
+        if (!ad->req_stream) return;
+        ad->req_stream = false;
+        echo_data(ad, data, size);
+        return;
+    }
+
+    // Anything that isn't pushed is a reply
+    if (size && data[0] == GBRIDGE_PROT_MA_CMD_PUSH && pushing(ad)) {
+        ma_push(ad, data, size);
+        return;
+    }
+    if (size && data[0] == GBRIDGE_PROT_MA_CMD_EVENT && events(ad)) {
+        ma_event(ad, data, size);
+        return;
+    }
+    if (!size || data[0] != ad->req_cmd || ad->req_stream) {
+        fail(ad, "unexpected reply");
+        return;
+    }
+
+    int res;
+    switch (data[0]) {
+    case GBRIDGE_PROT_MA_CMD_OPEN:
+        stat_add(STAT_OPEN, now - ad->req_time);
+        if (size != 2 || !data[1]) {
+            fail(ad, "OPEN failed");
+            return;
+        }
+        if (pushing(ad)) {
+            ad->rx_consumed = 0;
+            ma_recv_window(ad);
+        }
+        ma_connect(ad);
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_CONNECT:
+        stat_add(STAT_CONNECT, now - ad->req_time);
+        if (size != 2) {
+            fail(ad, "CONNECT failed");
+            return;
+        }
+
+        // Keep asking until the connection is made, like libmobile does,
+        //   unless the bridge tells when it is
+        res = (signed char)data[1];
+        if (res < 0) {
+            fail(ad, "CONNECT failed");
+        } else if (res == 0) {
+            if (!events(ad)) ma_connect(ad);
+        } else {
+            ad->state = STATE_IDLE;
+            ad->next_send = now;
+        }
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_SEND:
+    case GBRIDGE_PROT_MA_CMD_SEND_INLINE:
+        stat_add(STAT_SEND, now - ad->req_time);
+        if (size != 3 || (int16_t)(data[1] << 8 | data[2]) < 0) {
+            fail(ad, "SEND failed");
+            return;
+        }
+
+        // Whatever falls short is lost, as the adapter doesn't keep it
+        res = (int16_t)(data[1] << 8 | data[2]);
+        if (res != (int)send_size) short_sends++;
+        if (bulk) {
+            bytes_sent += res;
+            ad->state = STATE_IDLE;
+            return;
+        }
+        if (pushing(ad)) {
+            ad->req_cmd = 0;
+            ad->state = ad->echo_left ? STATE_RECV : STATE_IDLE;
+            return;
+        }
+        ma_recv(ad);
+        return;
+
+    case GBRIDGE_PROT_MA_CMD_RECV: {
+        if (size < 3) {
+            fail(ad, "RECV failed");
+            return;
+        }
+        res = (int16_t)(data[1] << 8 | data[2]);
+        unsigned addrlen = address_size(data + 3, size - 3);
+        if (res < 0 || !addrlen) {
+            fail(ad, "connection lost");
+            return;
+        }
+        if (res == 0) {
+            stat_add(STAT_RECV, now - ad->req_time);
+            ma_recv(ad);
+            return;
+        }
+
+        // The data follows right away if it's small enough
+        unsigned data_size = size - 3 - addrlen;
+        if (data_size) {
+            echo_data(ad, data + 3 + addrlen, data_size);
+        } else {
+            ad->req_stream = true;
+        }
+        return;
+    }
+
+    case GBRIDGE_PROT_MA_CMD_CLOSE:
+        stat_add(STAT_CLOSE, now - ad->req_time);
+        ad->state = STATE_DONE;
+        return;
+    }
+}
+
+// Handle a data packet or stream frame, acknowledging it
+static void recv_packet(struct adapter *ad, const unsigned char *buf, unsigned size)
+{
+    bool stream = buf[0] == GBRIDGE_CMD_STREAM_PC;
+    unsigned pos = 1;
+    unsigned char seq = 0;
+    if (windowed(ad)) {
+        if (size < pos + 1) goto error;
+        seq = buf[pos++];
+    }
+
+    unsigned len;
+    if (stream) {
+        if (size < pos + 2) goto error;
+        len = buf[pos] << 8 | buf[pos + 1];
+        pos += 2;
+    } else {
+        if (size < pos + 1) goto error;
+        len = buf[pos++];
+    }
+    if (size != pos + len + 2) goto error;
+
+    uint16_t checksum = seq;
+    unsigned sum_size = windowed(ad) ? len : (unsigned char)len;
+    for (unsigned i = 0; i < sum_size; i++) checksum += buf[pos + i];
+    if (checksum != (buf[pos + len] << 8 | buf[pos + len + 1])) goto error;
+
+    if (!windowed(ad)) {
+        out_put(ad, buf[0] | GBRIDGE_CMD_REPLY_F);
+        ma_packet(ad, stream, buf + pos, len);
+        return;
+    }
+
+    // Frames that have already been received lost their acknowledgement
+    if (seq != ad->recv_seq) {
+        if ((unsigned char)(seq - ad->recv_seq) < 0x80) goto error;
+        send_ack(ad);
+        return;
+    }
+    ad->recv_seq++;
+    send_ack(ad);
+    ma_packet(ad, stream, buf + pos, len);
+    return;
+
+error:
+    // Without windowed mode, the bridge times out and starts over
+    if (!windowed(ad)) return;
+    frame_write(ad, (unsigned char []){
+        (unsigned char)((stream ? GBRIDGE_CMD_STREAM_PC : GBRIDGE_CMD_DATA_PC) + 1) |
+            GBRIDGE_CMD_REPLY_F,
+        ad->recv_seq}, 2);
+}
+
+static void recv_ack(struct adapter *ad, unsigned char ack, unsigned char window)
+{
+    if ((unsigned char)(ack + 1 - ad->send_acked) >
+            (unsigned char)(ad->send_seq - ad->send_acked)) {
+        return;
+    }
+    if (window > GBRIDGE_WINDOW_SIZE) return;
+    if ((unsigned char)(ack + 1) != ad->send_acked) {
+        ad->send_acked = ack + 1;
+        ad->send_time = now;
+    }
+    ad->send_window = ack + 1 + window;
+}
+
+static void recv_frame(struct adapter *ad, const unsigned char *buf, unsigned size)
+{
+    if (!size) return;
+    frames_received++;
+
+    unsigned char cmd = buf[0];
+    switch (cmd) {
+    case GBRIDGE_CMD_ACK_PC:
+        if (size == 3) recv_ack(ad, buf[1], buf[2]);
+        break;
+    case GBRIDGE_CMD_DATA_FAIL | GBRIDGE_CMD_REPLY_F:
+    case GBRIDGE_CMD_STREAM_FAIL | GBRIDGE_CMD_REPLY_F:
+        if (size != 2) break;
+        if ((unsigned char)(buf[1] - ad->send_acked) >
+                (unsigned char)(ad->send_seq - ad->send_acked)) {
+            break;
+        }
+        ad->send_acked = buf[1];
+        send_retransmit(ad);
+        break;
+    case GBRIDGE_CMD_DATA_PC:
+    case GBRIDGE_CMD_STREAM_PC:
+        recv_packet(ad, buf, size);
+        break;
+    case GBRIDGE_CMD_DATA | GBRIDGE_CMD_REPLY_F:
+    case GBRIDGE_CMD_STREAM | GBRIDGE_CMD_REPLY_F:
+        if (cmd == (ad->waiting_cmd | GBRIDGE_CMD_REPLY_F)) ad->waiting_cmd = 0;
+        break;
+    }
+    send_pump(ad);
+}
+
+// Size of the unencoded frame at the start of the input, 0 if it isn't
+//   complete yet, or -1 if it isn't a frame
+static int legacy_frame_size(const unsigned char *buf, unsigned size)
+{
+    switch (buf[0]) {
+    case GBRIDGE_CMD_DATA_PC:
+        if (size < 2) return 0;
+        return 2 + buf[1] + 2;
+    case GBRIDGE_CMD_STREAM_PC:
+        if (size < 3) return 0;
+        return 3 + (buf[1] << 8 | buf[2]) + 2;
+    case GBRIDGE_CMD_DATA | GBRIDGE_CMD_REPLY_F:
+    case GBRIDGE_CMD_STREAM | GBRIDGE_CMD_REPLY_F:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static void recv_legacy(struct adapter *ad, unsigned char c)
+{
+    if (ad->in_size == sizeof(ad->in)) ad->in_size = 0;
+    ad->in[ad->in_size++] = c;
+
+    while (ad->in_size) {
+        int size = legacy_frame_size(ad->in, ad->in_size);
+        if (size == 0 || size > (int)ad->in_size) return;
+        if (size > 0) recv_frame(ad, ad->in, size);
+        if (size < 0) size = 1;
+        memmove(ad->in, ad->in + size, ad->in_size - size);
+        ad->in_size -= size;
+    }
+}
+
+static void recv_cobs(struct adapter *ad, unsigned char c)
+{
+    if (!c) {
+        if (!ad->cobs_skip) recv_frame(ad, ad->in, ad->in_size);
+        ad->in_size = 0;
+        ad->cobs_left = 0;
+        ad->cobs_zero = false;
+        ad->cobs_skip = false;
+        return;
+    }
+
+    if (!ad->cobs_left) {
+        // Every block except the last one is followed by a zero, which is
+        //   only known once the next block starts.
+        bool zero = ad->cobs_zero;
+        ad->cobs_left = c - 1;
+        ad->cobs_zero = c != 0xFF;
+        if (!zero) return;
+        c = 0;
+    } else {
+        ad->cobs_left--;
+    }
+
+    if (ad->cobs_skip) return;
+    if (ad->in_size == sizeof(ad->in)) {
+        ad->cobs_skip = true;
+        return;
+    }
+    ad->in[ad->in_size++] = c;
+}
+
+// Start over once the bridge has done the handshake
+static void link_up(struct adapter *ad, unsigned caps)
+{
+    if (ad->was_connected) {
+        fprintf(stderr, "%s: link reset\n", ad->name);
+        link_resets++;
+    }
+    ad->connected = true;
+    ad->was_connected = true;
+    ad->caps = caps;
+    ad->in_size = 0;
+    ad->cobs_left = 0;
+    ad->cobs_zero = false;
+    ad->cobs_skip = false;
+    ad->queue_count = 0;
+    ad->send_seq = 0;
+    ad->send_acked = 0;
+    ad->send_window = GBRIDGE_WINDOW_SIZE;
+    ad->recv_seq = 0;
+    ad->waiting_cmd = 0;
+    ad->push_stream = false;
+
+    if (!started) {
+        started = true;
+        stop_time = now + (uint64_t)run_secs * 1000000;
+    }
+    if (now >= stop_time) {
+        ad->state = STATE_DONE;
+        return;
+    }
+    ma_open(ad);
+}
+
+// Look for the handshake, which the bridge also sends after a timeout
+// Returns true if the byte was part of it.
+static bool recv_handshake(struct adapter *ad, unsigned char c)
+{
+    static const unsigned char handshake[] = GBRIDGE_HANDSHAKE;
+    static const unsigned char handshake_ext[] = GBRIDGE_HANDSHAKE_EXT;
+
+    unsigned caps = push ? CAPS | CAPS_PUSH : CAPS;
+    if (ad->handshake_caps) {
+        ad->handshake_caps = false;
+        ad->caps = c & caps;
+        for (unsigned i = 0; i < sizeof(handshake_ext); i++) {
+            out_put(ad, handshake_ext[i]);
+        }
+        out_put(ad, ad->caps);
+
+        // Another byte of them follows if both sides know about it
+        if (ad->caps & GBRIDGE_CAP_EXT) {
+            ad->handshake_caps_ext = true;
+            return true;
+        }
+        link_up(ad, ad->caps);
+        return true;
+    }
+    if (ad->handshake_caps_ext) {
+        ad->handshake_caps_ext = false;
+        unsigned char ext = c & (caps >> 8);
+        out_put(ad, ext);
+        link_up(ad, ad->caps | ext << 8);
+        return true;
+    }
+
+    // Adapters that only know the original handshake don't reply to the
+    //   extended one
+    if (!legacy && ad->handshake_progress == sizeof(handshake) - 1 &&
+            c == handshake_ext[ad->handshake_progress]) {
+        ad->handshake_progress = 0;
+        ad->handshake_caps = true;
+        return true;
+    }
+
+    if (c != handshake[ad->handshake_progress]) {
+        ad->handshake_progress = c == handshake[0];
+        return false;
+    }
+    if (++ad->handshake_progress != sizeof(handshake)) return false;
+    ad->handshake_progress = 0;
+    for (unsigned i = 0; i < sizeof(handshake); i++) out_put(ad, handshake[i]);
+    link_up(ad, 0);
+    return true;
+}
+
+static void adapter_read(struct adapter *ad)
+{
+    unsigned char buf[0x400];
+    ssize_t len = read(ad->fd, buf, sizeof(buf));
+    if (len <= 0) return;
+    for (ssize_t i = 0; i < len; i++) {
+        if (recv_handshake(ad, buf[i])) continue;
+        if (!ad->connected || ad->state == STATE_DONE) continue;
+        if (cobs(ad)) {
+            recv_cobs(ad, buf[i]);
+        } else {
+            recv_legacy(ad, buf[i]);
+        }
+    }
+}
+
+// Handle everything that's time-dependent
+static void adapter_tick(struct adapter *ad)
+{
+    if (!ad->connected || ad->state == STATE_DONE) return;
+
+    if (windowed(ad) && ad->send_seq != ad->send_acked &&
+            now - ad->send_time > RTO_US) {
+        send_retransmit(ad);
+    }
+
+    if (ad->state != STATE_IDLE) return;
+    if (now >= stop_time) {
+        ma_close(ad);
+        return;
+    }
+    if (now < ad->next_send) return;
+
+    // Falling behind isn't made up for, so the rate that's reached shows
+    //   whether the bridge keeps up
+    ma_send(ad);
+    if (rate) ad->next_send += 1000000 / rate;
+    if (ad->next_send < now) ad->next_send = now;
+}
+
+// Time until something has to be done, in microseconds
+static uint64_t adapter_deadline(const struct adapter *ad)
+{
+    uint64_t deadline = UINT64_MAX;
+    if (!ad->connected || ad->state == STATE_DONE) return deadline;
+    if (windowed(ad) && ad->send_seq != ad->send_acked) {
+        deadline = ad->send_time + RTO_US;
+    }
+    if (ad->state == STATE_IDLE) {
+        uint64_t next = ad->next_send < stop_time ? ad->next_send : stop_time;
+        if (next < deadline) deadline = next;
+    }
+    return deadline;
+}
+
+static bool adapter_open(struct adapter *ad, unsigned index)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1) {
+        perror("posix_openpt");
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    int peer = open(ptsname(fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (peer != -1 && tcgetattr(peer, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(peer, TCSANOW, &tio);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    *ad = (struct adapter){.fd = fd, .peer = peer, .payload_seed = index * 0x10};
+    snprintf(ad->name, sizeof(ad->name), "%s", ptsname(fd));
+    return true;
+}
+
+static bool echo_open(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    socklen_t addrlen = sizeof(addr);
+
+    echo_listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (echo_listen == -1 ||
+            bind(echo_listen, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(echo_listen, ADAPTERS_MAX) == -1 ||
+            getsockname(echo_listen, (struct sockaddr *)&addr, &addrlen) == -1) {
+        perror("echo server");
+        return false;
+    }
+    server_port = ntohs(addr.sin_port);
+    for (unsigned i = 0; i < ADAPTERS_MAX; i++) echo_clients[i].fd = -1;
+    return true;
+}
+
+static void echo_accept(void)
+{
+    int fd = accept4(echo_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) return;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    for (unsigned i = 0; i < ADAPTERS_MAX; i++) {
+        if (echo_clients[i].fd != -1) continue;
+        echo_clients[i] = (struct echo_client){.fd = fd};
+        return;
+    }
+    close(fd);
+}
+
+static void echo_close(struct echo_client *client)
+{
+    close(client->fd);
+    client->fd = -1;
+}
+
+// Take in bulk data, checking that nothing is missing in between
+static void echo_sink(struct echo_client *client)
+{
+    unsigned char buf[0x1000];
+    ssize_t len = read(client->fd, buf, sizeof(buf));
+    if (len == 0 || (len == -1 && errno != EAGAIN)) {
+        echo_close(client);
+        return;
+    }
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] != client->bulk_next) mismatches++;
+        client->bulk_next = (buf[i] + 1) % BULK_PERIOD;
+    }
+    if (len > 0) bytes_arrived += len;
+}
+
+// Send back whatever has been received, holding on to what doesn't go out
+static void echo_serve(struct echo_client *client, short revents)
+{
+    if (bulk) {
+        if (revents & POLLIN) echo_sink(client);
+        return;
+    }
+
+    if (revents & POLLIN && client->size < sizeof(client->buf)) {
+        ssize_t len = read(client->fd, client->buf + client->size,
+            sizeof(client->buf) - client->size);
+        if (len == 0 || (len == -1 && errno != EAGAIN)) {
+            echo_close(client);
+            return;
+        }
+        if (len > 0) client->size += len;
+    }
+    if (client->size) {
+        ssize_t len = write(client->fd, client->buf, client->size);
+        if (len == -1 && errno != EAGAIN) {
+            echo_close(client);
+            return;
+        }
+        if (len > 0) {
+            memmove(client->buf, client->buf + len, client->size - len);
+            client->size -= len;
+        }
+    }
+}
+
+static void bridge_exec(const char *command, const char *name)
+{
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) dup2(null, STDOUT_FILENO);
+    execlp(command, command, name, (char *)NULL);
+    perror(command);
+    _exit(EXIT_FAILURE);
+}
+
+static volatile sig_atomic_t trace_stop;
+
+static void trace_signal(int sig)
+{
+    (void)sig;
+    trace_stop = true;
+}
+
+// Run a bridge, counting the system calls made by all of its threads until
+//   it exits, and write the count to the pipe
+// Asking it to stop is passed on to the bridge.
+static void bridge_trace(const char *command, const char *name, int out)
+{
+    struct sigaction sa = {.sa_handler = trace_signal};
+    sigaction(SIGTERM, &sa, NULL);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        _exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        bridge_exec(command, name);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) _exit(1);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(PTRACE_O_TRACESYSGOOD
+        | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // Every system call stops the thread making it twice, going in and out
+    unsigned long stops = 0;
+    bool killed = false;
+    for (;;) {
+        if (trace_stop && !killed) {
+            kill(pid, SIGTERM);
+            killed = true;
+        }
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) break;
+            continue;
+        }
+
+        // Threads start out stopped, and events aren't signals either
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (sig == SIGSTOP || status >> 16) {
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+
+    unsigned long count = (stops + 1) / 2;
+    if (write(out, &count, sizeof(count)) != sizeof(count)) _exit(1);
+    _exit(EXIT_SUCCESS);
+}
+
+// Run a bridge on every pty, with its output out of the way
+static void bridges_start(const char *command)
+{
+    for (unsigned i = 0; i < adapter_count; i++) {
+        int fds[2] = {-1, -1};
+        if (count_syscalls && pipe(fds) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            if (count_syscalls) bridge_trace(command, adapters[i].name, fds[1]);
+            bridge_exec(command, adapters[i].name);
+        }
+        if (count_syscalls) close(fds[1]);
+        bridges[i] = pid;
+        bridge_counts[i] = fds[0];
+    }
+}
+
+// Find out whether any of the bridges has exited, which only happens if it
+//   failed, as they're only asked to stop afterwards
+static bool bridges_exited(void)
+{
+    bool exited = false;
+    for (unsigned i = 0; i < adapter_count; i++) {
+        if (bridges[i] <= 0) continue;
+        int status;
+        if (waitpid(bridges[i], &status, WNOHANG) != bridges[i]) continue;
+        if (WIFEXITED(status)) {
+            fprintf(stderr, "%s: bridge exited with status %d\n",
+                adapters[i].name, WEXITSTATUS(status));
+        } else {
+            fprintf(stderr, "%s: bridge killed by signal %d\n",
+                adapters[i].name, WTERMSIG(status));
+        }
+        bridges[i] = 0;
+        exited = true;
+    }
+    return exited;
+}
+
+static void bridges_stop(void)
+{
+    for (unsigned i = 0; i < adapter_count; i++) {
+        if (bridges[i] > 0) kill(bridges[i], SIGTERM);
+    }
+    for (unsigned i = 0; i < adapter_count; i++) {
+        if (bridges[i] > 0) waitpid(bridges[i], NULL, 0);
+        if (bridge_counts[i] == -1) continue;
+
+        unsigned long count;
+        if (read(bridge_counts[i], &count, sizeof(count)) == sizeof(count)) {
+            syscalls += count;
+        }
+        close(bridge_counts[i]);
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const struct samples *samples, double p)
+{
+    return samples->us[(size_t)((samples->count - 1) * p)] / 1000.0;
+}
+
+static void print_stats(void)
+{
+    unsigned connected = 0;
+    for (unsigned i = 0; i < adapter_count; i++) {
+        if (adapters[i].was_connected) connected++;
+    }
+    printf("%u of %u adapters connected, %lu failed, %lu link resets, "
+        "%lu retransmissions\n", connected, adapter_count, failures,
+        link_resets, retransmissions);
+
+    printf("%-8s %8s %8s %8s %8s %8s\n",
+        "request", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (unsigned i = 0; i < STAT_COUNT; i++) {
+        struct samples *samples = &stats[i];
+        if (!samples->count) continue;
+        qsort(samples->us, samples->count, sizeof(*samples->us), compare_u32);
+        printf("%-8s %8zu %8.2f %8.2f %8.2f %8.2f\n", stat_names[i],
+            samples->count, percentile_ms(samples, 0.5),
+            percentile_ms(samples, 0.9), percentile_ms(samples, 0.99),
+            percentile_ms(samples, 1));
+    }
+
+    double secs = run_secs;
+    if (bulk) {
+        printf("%lu bytes sent (%.1f B/s), %lu arrived, %lu short replies, "
+            "%lu gaps\n", bytes_sent, bytes_sent / secs, bytes_arrived,
+            short_sends, mismatches);
+    } else {
+        printf("%lu echoes (%.1f/s), %lu bytes (%.1f B/s), %lu mismatched\n",
+            (unsigned long)stats[STAT_ECHO].count, stats[STAT_ECHO].count / secs,
+            bytes_echoed, bytes_echoed / secs, mismatches);
+    }
+    printf("Frames sent %lu (%.1f/s), received %lu (%.1f/s)\n",
+        frames_sent, frames_sent / secs, frames_received, frames_received / secs);
+    if (count_syscalls) {
+        printf("System calls %lu (%.1f/s), %.3f per byte echoed\n", syscalls,
+            syscalls / secs, bytes_echoed ? (double)syscalls / bytes_echoed : 0);
+    }
+}
+
+static bool parse_server(const char *address)
+{
+    const char *port = strrchr(address, ':');
+    if (!port) return false;
+
+    char host[INET_ADDRSTRLEN];
+    if ((size_t)(port - address) >= sizeof(host)) return false;
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, host, &addr) != 1) return false;
+    memcpy(server_host, &addr, sizeof(server_host));
+    server_port = strtoul(port + 1, NULL, 10);
+    return server_port && server_port <= 0xFFFF;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *command = NULL;
+    const char *server = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:r:s:lpba:e:c")) != -1) {
+        switch (opt) {
+        case 'n': adapter_count = strtoul(optarg, NULL, 0); break;
+        case 't': run_secs = strtoul(optarg, NULL, 0); break;
+        case 'r': rate = strtoul(optarg, NULL, 0); break;
+        case 's': send_size = strtoul(optarg, NULL, 0); break;
+        case 'l': legacy = true; break;
+        case 'p': push = true; break;
+        case 'b': bulk = true; break;
+        case 'a': server = optarg; break;
+        case 'e': command = optarg; break;
+        case 'c': count_syscalls = true; break;
+        default: goto usage;
+        }
+    }
+    if (optind != argc) goto usage;
+    if (!adapter_count || adapter_count > ADAPTERS_MAX) {
+        fprintf(stderr, "Between 1 and %u adapters are supported\n", ADAPTERS_MAX);
+        return EXIT_FAILURE;
+    }
+    if (!send_size || send_size > SEND_MAX || !run_secs) goto usage;
+    if (count_syscalls && !command) goto usage;
+    // The data has to go to a server that checks it
+    if (bulk && server) goto usage;
+
+    if (server) {
+        if (!parse_server(server)) {
+            fprintf(stderr, "Invalid address: %s\n", server);
+            return EXIT_FAILURE;
+        }
+    } else if (!echo_open()) {
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned i = 0; i < adapter_count; i++) {
+        if (!adapter_open(&adapters[i], i)) return EXIT_FAILURE;
+        printf("%s\n", adapters[i].name);
+    }
+    fflush(stdout);
+    signal(SIGPIPE, SIG_IGN);
+    if (command) bridges_start(command);
+
+    // Without any bridge connecting, the test is over once it would have been
+    uint64_t start_deadline = now_us() + (uint64_t)run_secs * 1000000;
+
+    struct pollfd pfds[2 * ADAPTERS_MAX + 1];
+    for (;;) {
+        now = now_us();
+        if (command && bridges_exited()) {
+            aborted = true;
+            break;
+        }
+        if (!started && now > start_deadline) {
+            fprintf(stderr, "No bridge connected in time\n");
+            aborted = true;
+            break;
+        }
+
+        bool busy = !started;
+        uint64_t deadline = now + 100000;
+        if (!started && start_deadline < deadline) deadline = start_deadline;
+        for (unsigned i = 0; i < adapter_count; i++) {
+            struct adapter *ad = &adapters[i];
+            adapter_tick(ad);
+            out_flush(ad);
+            if (ad->connected && ad->state != STATE_DONE) busy = true;
+            uint64_t next = adapter_deadline(ad);
+            if (next < deadline) deadline = next;
+        }
+        if (started && !busy) break;
+        if (started && now > stop_time + GRACE_US) {
+            fprintf(stderr, "Some adapters didn't finish in time\n");
+            break;
+        }
+
+        unsigned count = 0;
+        for (unsigned i = 0; i < adapter_count; i++) {
+            pfds[count++] = (struct pollfd){
+                .fd = adapters[i].fd,
+                .events = POLLIN | (adapters[i].out_size ? POLLOUT : 0)
+            };
+        }
+        unsigned echo_first = count;
+        if (echo_listen != -1) {
+            pfds[count++] = (struct pollfd){.fd = echo_listen, .events = POLLIN};
+            for (unsigned i = 0; i < ADAPTERS_MAX; i++) {
+                struct echo_client *client = &echo_clients[i];
+                pfds[count++] = (struct pollfd){
+                    .fd = client->fd,
+                    .events = client->fd == -1 ? 0 :
+                        POLLIN | (client->size ? POLLOUT : 0)
+                };
+            }
+        }
+
+        int timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        if (poll(pfds, count, timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        now = now_us();
+
+        for (unsigned i = 0; i < adapter_count; i++) {
+            if (pfds[i].revents & POLLIN) adapter_read(&adapters[i]);
+        }
+        if (echo_listen != -1) {
+            if (pfds[echo_first].revents & POLLIN) echo_accept();
+            for (unsigned i = 0; i < ADAPTERS_MAX; i++) {
+                short revents = pfds[echo_first + 1 + i].revents;
+                if (echo_clients[i].fd != -1 && revents) {
+                    echo_serve(&echo_clients[i], revents);
+                }
+            }
+        }
+    }
+
+    if (command) bridges_stop();
+    print_stats();
+    return aborted ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+    fprintf(stderr, "Usage: %s [-n adapters] [-t seconds] [-r rate] "
+        "[-s size] [-l] [-p] [-b] [-a host:port] [-e bridge] [-c]\n", argv[0]);
+    return EXIT_FAILURE;
+}
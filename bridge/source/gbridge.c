@@ -1,216 +1,1392 @@
 #include "gbridge.h"
 
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <libserialport.h>
+#include <string.h>
 
 #include "gbridge_cmd.h"
+#include "link.h"
+#include "link_fault.h"
+#include "reactor.h"
+#include "timer.h"
+#include "uring.h"
+
+// Capabilities supported by this implementation
+#define GBRIDGE_CAPS (GBRIDGE_CAP_WINDOW | GBRIDGE_CAP_COBS | \
+    GBRIDGE_CAP_BAUD | GBRIDGE_CAP_CREDIT | GBRIDGE_CAP_RTSCTS | \
+    GBRIDGE_CAP_PUSH | GBRIDGE_CAP_EVENTS | GBRIDGE_CAP_EXT | \
+    GBRIDGE_CAP_INLINE)
+
+// Baud rates to try, from fastest to slowest
+// These are all exact on a 16MHz adapter.
+static const unsigned long baud_rates[] = {2000000, 1000000, GBRIDGE_BAUD};
+#define BAUD_RATES (sizeof(baud_rates) / sizeof(*baud_rates))
+
+// Broken frames tolerated at a faster baud rate, for every so many frames
+//   that are received correctly, before falling back to a slower one.
+#define BAUD_MAX_FAILS 4
+#define BAUD_FAIL_FRAMES 64
+
+// Time between reports on how the link recovers from injected faults
+#define RECOVERY_REPORT_US 10000000
 
 static const unsigned char handshake[] = GBRIDGE_HANDSHAKE;
-static unsigned char handshake_progress;
+static const unsigned char handshake_ext[] = GBRIDGE_HANDSHAKE_EXT;
+static const unsigned char baud_pattern[] = GBRIDGE_BAUD_PATTERN;
+
+static bool faulty(struct gbridge *state)
+{
+    return state->port->fault.enabled;
+}
+
+// Keep track of the time, and of the faults injected since the last time
+static void recovery_update(struct gbridge *state)
+{
+    struct gbridge_recovery *rec = &state->recovery;
+    uint32_t now = timer_get();
+    if (!rec->started) {
+        rec->started = true;
+        rec->last_time = now;
+        rec->report_time = now;
+    }
+    rec->time_total += now - rec->last_time;
+    rec->last_time = now;
 
-static bool connected;
-static enum gbridge_cmd waiting_cmd;
+    uint32_t time;
+    unsigned faults = link_fault_take(&state->port->fault, &time);
+    if (faults) {
+        rec->faults += faults;
+        if (!rec->pending) {
+            rec->pending = true;
+            rec->hit = false;
+            rec->fault_time = time;
+            rec->burst = 0;
+        }
+        rec->burst += faults;
+    }
 
-static unsigned char data_buf[GBRIDGE_MAX_DATA_SIZE];
-struct gbridge_data data;
-static bool data_ready;
+    // Faults that haven't been noticed in a while never will be
+    if (rec->pending && !rec->hit && now - rec->fault_time > GBRIDGE_TIMEOUT_US) {
+        rec->pending = false;
+        rec->unnoticed += rec->burst;
+    }
+}
+
+// Something went wrong, which might be due to a fault
+static void recovery_error(struct gbridge *state)
+{
+    if (!faulty(state)) return;
+    recovery_update(state);
+    if (state->recovery.pending) state->recovery.hit = true;
+}
+
+// Data went through, so whatever went wrong has been recovered from
+static void recovery_progress(struct gbridge *state, unsigned size)
+{
+    if (!faulty(state)) return;
+    struct gbridge_recovery *rec = &state->recovery;
+    rec->bytes_total += size;
+    if (!rec->pending || !rec->hit) {
+        rec->bytes += size;
+        return;
+    }
+
+    uint32_t time = timer_get() - rec->fault_time;
+    rec->pending = false;
+    rec->recoveries++;
+    rec->time_sum += time;
+    if (time > rec->time_max) rec->time_max = time;
+    fprintf(stderr, "gbridge: recovered from %u faults in %u ms\n",
+        rec->burst, time / 1000);
+}
+
+// Every so often, report how well the link recovers
+// The goodput lost is estimated from the goodput while not recovering.
+static void recovery_report(struct gbridge *state)
+{
+    if (!faulty(state)) return;
+    recovery_update(state);
+    struct gbridge_recovery *rec = &state->recovery;
+    if (timer_get() - rec->report_time < RECOVERY_REPORT_US) return;
+    rec->report_time = timer_get();
+
+    const unsigned *counts = state->port->fault.counts;
+    double total = rec->time_total / 1e6;
+    double clean = rec->time_total > rec->time_sum ?
+        (rec->time_total - rec->time_sum) / 1e6 : 0;
+    double expected = clean ? rec->bytes / clean * total : 0;
+    double lost = expected > rec->bytes_total ?
+        (expected - rec->bytes_total) / expected * 100 : 0;
+    fprintf(stderr, "gbridge: %u faults (%u flip, %u drop, %u dup, %u stall), "
+        "%u unnoticed, %u recoveries taking %u ms on average, %u ms at most, "
+        "goodput %.0f B/s, %.1f%% lost\n",
+        rec->faults, counts[LINK_FAULT_FLIP], counts[LINK_FAULT_DROP],
+        counts[LINK_FAULT_DUP], counts[LINK_FAULT_STALL], rec->unnoticed,
+        rec->recoveries,
+        rec->recoveries ? (unsigned)(rec->time_sum / rec->recoveries / 1000) : 0,
+        rec->time_max / 1000, total ? rec->bytes_total / total : 0, lost);
+}
+
+// Forget about the current link, and start over with a handshake
+static void gbridge_reset(struct gbridge *state)
+{
+    recovery_error(state);
+    state->connected = false;
+    state->caps = 0;
+    state->handshake_progress = 0;
+    state->handshake_sent = false;
+    state->waiting_cmd = GBRIDGE_CMD_NONE;
+    for (unsigned i = 0; i < GBRIDGE_WINDOW_SIZE; i++) {
+        state->data_queue[i] = (struct gbridge_data){.buffer = state->data_queue_buf[i]};
+    }
+    state->data_first = 0;
+    state->data_count = 0;
+    state->stream_max_size = 0;
+    state->send_seq = 0;
+    state->send_acked = 0;
+    state->send_window = GBRIDGE_WINDOW_SIZE;
+    state->send_retries = 0;
+    state->send_timing = false;
+    state->recv_seq = 0;
+    state->recv_acked = -1;
+    state->recv_acked_window = GBRIDGE_WINDOW_SIZE;
+    state->recv_nak_sent = false;
+    state->recv_window_probes = 0;
+    state->recv_resync_cmd = GBRIDGE_CMD_NONE;
+    state->rtt_measured = false;
+    state->rto = GBRIDGE_RTO_MAX_US;
+    state->in_pos = 0;
+    state->in_size = 0;
+    state->cobs = (struct gbridge_cobs){0};
+    state->out_pos = 0;
+    state->out_size = 0;
+    state->credit_epoch = 0;
+    state->credit_sent = 0;
+    state->credit_limit = 0;
+    state->credit_retries = 0;
+    state->credit_overruns_known = false;
+    state->baud_tuned = false;
+    state->baud_fails = 0;
+    state->baud_frames = 0;
+}
+
+void gbridge_init(struct gbridge *state, struct link *port)
+{
+    memset(state, 0, sizeof(*state));
+    state->port = port;
+    state->loop_timeout = 100;
+    state->baud_index = BAUD_RATES - 1;
+    gbridge_reset(state);
+}
+
+static bool baud_set(struct gbridge *state, unsigned index)
+{
+    link_drain(state->port);
+    if (!link_set_baudrate(state->port, baud_rates[index])) return false;
+    state->baud_index = index;
+    return true;
+}
+
+static void handshake_send(struct gbridge *state)
+{
+    // Every link starts out at the default baud rate
+    if (state->baud_index != BAUD_RATES - 1) baud_set(state, BAUD_RATES - 1);
+    if (state->rtscts) {
+        link_set_rtscts(state->port, false);
+        state->rtscts = false;
+    }
+
+    // Try the extended handshake first, and fall back to the original one
+    //   every other attempt, in case the adapter doesn't support it.
+    state->handshake_ext = !state->handshake_legacy;
+    state->handshake_legacy = !state->handshake_legacy;
+    const unsigned char *magic = state->handshake_ext ? handshake_ext : handshake;
+    link_write(state->port, magic, sizeof(handshake));
+    if (state->handshake_ext) {
+        link_write(state->port, &(char []){GBRIDGE_CAPS & 0xff}, 1);
+    }
+
+    state->handshake_sent = true;
+    state->handshake_time = timer_get();
+    state->handshake_progress = 0;
+    state->handshake_caps = false;
+    state->handshake_caps_ext = false;
+}
 
-void gbridge_init(void)
+// Read the adapter's reply to the handshake, one byte at a time
+// If gbridge_wait() has seen the adapter send something, only what has
+//   arrived is read, otherwise this waits until the handshake is sent again.
+static int handshake_read(struct gbridge *state, unsigned char *c, bool waited)
 {
-    connected = false;
-    handshake_progress = 0;
-    waiting_cmd = GBRIDGE_CMD_NONE;
-    data_ready = false;
-    data = (struct gbridge_data){.buffer = data_buf};
+    if (waited) return link_read_nonblocking(state->port, c, 1);
+
+    uint32_t elapsed = timer_get() - state->handshake_time;
+    if (elapsed >= GBRIDGE_TIMEOUT_US) return 0;
+    return link_read(state->port, c, 1, (GBRIDGE_TIMEOUT_US - elapsed) / 1000 + 1);
 }
 
-bool gbridge_handshake(struct sp_port *port)
+// Try to connect to the adapter
+// The handshake is sent again every so often, and this has to be called
+//   until it returns true.
+bool gbridge_handshake(struct gbridge *state)
 {
-    if (connected) return true;
+    if (state->connected) return true;
+    recovery_report(state);
+
+    bool waited = state->loop_waited;
+    state->loop_waited = false;
+    if (!state->handshake_sent ||
+            timer_get() - state->handshake_time >= GBRIDGE_TIMEOUT_US) {
+        handshake_send(state);
+    }
+    if (waited && !state->loop_readable) return false;
 
-    sp_blocking_write(port, handshake, sizeof(handshake), 0);
+    const unsigned char *magic = state->handshake_ext ? handshake_ext : handshake;
     unsigned char c;
-    while (sp_blocking_read(port, &c, 1, GBRIDGE_TIMEOUT_MS) == 1) {
-        if (c != handshake[handshake_progress++]) {
-            handshake_progress = c == handshake[0];
+    while (handshake_read(state, &c, waited) == 1) {
+        if (state->handshake_caps_ext) {
+            state->caps |= (c & (GBRIDGE_CAPS >> 8)) << 8;
+        } else if (state->handshake_caps) {
+            state->caps = c & GBRIDGE_CAPS;
+
+            // Another byte of them follows if both sides know about it
+            if (state->caps & GBRIDGE_CAP_EXT) {
+                link_write(state->port, &(char []){GBRIDGE_CAPS >> 8}, 1);
+                state->handshake_caps_ext = true;
+                continue;
+            }
+        } else {
+            if (c != magic[state->handshake_progress++]) {
+                state->handshake_progress = c == magic[0];
+            }
+            if (state->handshake_progress != sizeof(handshake)) continue;
+
+            // The extended handshake is followed by the capabilities
+            if (state->handshake_ext) {
+                state->handshake_caps = true;
+                continue;
+            }
         }
-        if (handshake_progress == sizeof(handshake)) {
-            handshake_progress = 0;
-            connected = true;
-            return true;
+
+        // Only wait for the adapter when it's actually driving the line
+        if (state->caps & GBRIDGE_CAP_RTSCTS) {
+            state->rtscts = link_set_rtscts(state->port, true);
         }
+        state->connected = true;
+        state->handshake_sent = false;
+        state->credit_time = timer_get();
+        recovery_progress(state, 0);
+        return true;
     }
     return false;
 }
 
-static bool recv_data(struct sp_port *port, void *buf, size_t count)
+static inline bool windowed(struct gbridge *state)
+{
+    return state->caps & GBRIDGE_CAP_WINDOW;
+}
+
+static inline bool cobs(struct gbridge *state)
+{
+    return (state->caps & GBRIDGE_CAP_COBS) && windowed(state);
+}
+
+static inline bool baud_switching(struct gbridge *state)
+{
+    return (state->caps & GBRIDGE_CAP_BAUD) && cobs(state);
+}
+
+static inline bool credits(struct gbridge *state)
+{
+    return (state->caps & GBRIDGE_CAP_CREDIT) && cobs(state);
+}
+
+// Amount of output the adapter is able to take
+static unsigned out_ready(struct gbridge *state)
+{
+    unsigned size = state->out_size - state->out_pos;
+    if (credits(state)) {
+        unsigned char room = state->credit_limit - state->credit_sent;
+        if (room >= 0x80) room = 0;
+        if (size > room) size = room;
+    }
+    return size;
+}
+
+// Write out as much of the output as the adapter is able to take
+// Unless asked to wait, only what the port takes right away is written, and
+//   the rest is kept for later.
+static void out_write(struct gbridge *state, bool wait)
 {
-    if (sp_blocking_read(port, buf, count, GBRIDGE_TIMEOUT_MS) !=
-            (enum sp_return)count) {
-        fprintf(stderr, "recv_data: timed out\n");
-        gbridge_init();
+    unsigned size = out_ready(state);
+    if (!size) return;
+
+    int rc;
+    if (wait) {
+        rc = link_write(state->port, state->out_buf + state->out_pos, size);
+    } else {
+        rc = link_write_nonblocking(state->port, state->out_buf + state->out_pos, size);
+    }
+    if (rc <= 0) return;
+    size = rc;
+
+    state->out_pos += size;
+    state->credit_sent += size;
+    state->credit_time = timer_get();
+    if (state->out_pos == state->out_size) {
+        state->out_pos = 0;
+        state->out_size = 0;
+    }
+}
+
+static void out_flush(struct gbridge *state)
+{
+    out_write(state, false);
+}
+
+// Write out whatever the adapter is able to take, waiting for the port
+static void out_drain(struct gbridge *state)
+{
+    out_write(state, true);
+}
+
+static void out_putchar(struct gbridge *state, unsigned char c)
+{
+    if (state->out_size == sizeof(state->out_buf)) {
+        if (!credits(state)) {
+            out_drain(state);
+        } else if (state->out_pos) {
+            memmove(state->out_buf, state->out_buf + state->out_pos,
+                state->out_size - state->out_pos);
+            state->out_frame -= state->out_pos;
+            state->out_size -= state->out_pos;
+            state->out_pos = 0;
+        } else {
+            // The frame is dropped, and will have to be retransmitted
+            state->out_full = true;
+            return;
+        }
+    }
+    state->out_buf[state->out_size++] = c;
+}
+
+static void frame_put(void *user, unsigned char c)
+{
+    out_putchar(user, c);
+}
+
+// Send a frame, encoding it if necessary
+static void frame_write(struct gbridge *state, const struct gbridge_frame_part *parts, unsigned count)
+{
+    // Unencoded frames are written out right away, as a whole
+    if (!cobs(state)) {
+        gbridge_frame_encode(parts, count, false, frame_put, state);
+        out_drain(state);
+        return;
+    }
+
+    state->out_frame = state->out_size;
+    state->out_full = false;
+    gbridge_frame_encode(parts, count, true, frame_put, state);
+    if (state->out_full) {
+        fprintf(stderr, "frame_write: output buffer full\n");
+        state->out_size = state->out_frame;
+    }
+    out_flush(state);
+}
+
+static void frame_write_bytes(struct gbridge *state, const unsigned char *buffer, unsigned size)
+{
+    frame_write(state, &(struct gbridge_frame_part){buffer, size}, 1);
+}
+
+// Read as much as the port has, once the previous input has been used up
+static int recv_fill(struct gbridge *state, unsigned timeout)
+{
+    if (state->in_pos != state->in_size) return state->in_size - state->in_pos;
+
+    int rc = link_read_next(state->port, state->in_buf, sizeof(state->in_buf), timeout);
+    if (rc <= 0) return rc;
+    state->in_pos = 0;
+    state->in_size = rc;
+    return rc;
+}
+
+// Check whether the end of a COBS frame has arrived
+static bool recv_frame_arrived(struct gbridge *state)
+{
+    return memchr(state->in_buf + state->in_pos, 0,
+        state->in_size - state->in_pos) != NULL;
+}
+
+// Take in what the port has, without waiting
+// Returns false if the current frame is still on its way, and can be waited
+//   for along with everything else. Frames that don't fit are read as usual.
+static bool recv_frame_fill(struct gbridge *state)
+{
+    if (recv_frame_arrived(state)) return true;
+
+    memmove(state->in_buf, state->in_buf + state->in_pos,
+        state->in_size - state->in_pos);
+    state->in_size -= state->in_pos;
+    state->in_pos = 0;
+    if (state->in_size == sizeof(state->in_buf)) return true;
+
+    int rc = link_read_nonblocking(state->port, state->in_buf + state->in_size,
+        sizeof(state->in_buf) - state->in_size);
+    if (rc < 0) return true;
+    state->in_size += rc;
+    return recv_frame_arrived(state);
+}
+
+// Read bytes of the current frame, decoding them if necessary
+// Returns less bytes than requested if the frame ends or a timeout occurs.
+static int recv_bytes(struct gbridge *state, void *buf, size_t count, unsigned timeout)
+{
+    unsigned char *out = buf;
+    size_t size = 0;
+    if (!cobs(state)) {
+        while (size < count) {
+            int rc = recv_fill(state, timeout);
+            if (rc < 0) return rc;
+            if (rc == 0) break;
+
+            unsigned len = state->in_size - state->in_pos;
+            if (len > count - size) len = count - size;
+            memcpy(out + size, state->in_buf + state->in_pos, len);
+            state->in_pos += len;
+            size += len;
+        }
+        return size;
+    }
+
+    while (size < count && !state->cobs.end) {
+        int rc = recv_fill(state, timeout);
+        if (rc < 0) return rc;
+        if (rc == 0) break;
+
+        int c = gbridge_cobs_decode(&state->cobs, state->in_buf[state->in_pos++]);
+        if (c >= 0) out[size++] = c;
+    }
+    return size;
+}
+
+// Skip whatever is left of the current frame
+static void recv_frame_done(struct gbridge *state)
+{
+    if (!cobs(state)) return;
+
+    if (state->cobs.end) {
+        state->cobs.end = false;
+    } else {
+        state->cobs.skip = true;
+    }
+}
+
+static bool recv_data(struct gbridge *state, void *buf, size_t count)
+{
+    // In windowed mode, broken frames are retransmitted instead
+    unsigned timeout = GBRIDGE_TIMEOUT_MS;
+    if (windowed(state)) timeout = state->rto / 1000 + 1;
+
+    if (recv_bytes(state, buf, count, timeout) != (int)count) {
+        if (!state->cobs.end) fprintf(stderr, "recv_data: timed out\n");
+        if (!windowed(state)) gbridge_reset(state);
         return false;
     }
     return true;
 }
 
-static void send_ack(struct sp_port *port, enum gbridge_cmd cmd)
+static void send_ack(struct gbridge *state, enum gbridge_cmd cmd)
 {
-    sp_blocking_write(port, &(char []){cmd | GBRIDGE_CMD_REPLY_F}, 1, 0);
+    link_write(state->port, &(char []){cmd | GBRIDGE_CMD_REPLY_F}, 1);
 }
 
-static uint16_t checksum_data(struct gbridge_data data)
+static uint16_t checksum_data(struct gbridge *state, const unsigned char *buffer, unsigned size)
 {
-    uint16_t checksum = 0;
-    for (unsigned char i = 0; i < data.size; i++) checksum += data.buffer[i];
-    return checksum;
+    // The original protocol only checksums the first (size % 0x100) bytes,
+    //   which is kept for compatibility.
+    if (!windowed(state)) size = (unsigned char)size;
+    return gbridge_checksum(buffer, size);
 }
 
-static void recv_cmd_debug_line(struct sp_port *port)
+// Update the round-trip time estimate, and the resulting timeout (RFC 6298)
+static void rtt_sample(struct gbridge *state, uint32_t rtt)
+{
+    if (!state->rtt_measured) {
+        state->rtt_measured = true;
+        state->rtt_avg = rtt;
+        state->rtt_var = rtt / 2;
+    } else {
+        uint32_t delta = rtt > state->rtt_avg ?
+            rtt - state->rtt_avg : state->rtt_avg - rtt;
+        state->rtt_var = (3 * state->rtt_var + delta) / 4;
+        state->rtt_avg = (7 * state->rtt_avg + rtt) / 8;
+    }
+    state->rto = state->rtt_avg + 4 * state->rtt_var;
+    if (state->rto < GBRIDGE_RTO_MIN_US) state->rto = GBRIDGE_RTO_MIN_US;
+    if (state->rto > GBRIDGE_RTO_MAX_US) state->rto = GBRIDGE_RTO_MAX_US;
+}
+
+// Acknowledge every frame that has been received, and let the adapter know
+//   how many more data packets can be queued up.
+static void send_ack_window(struct gbridge *state)
+{
+    unsigned char ack = state->recv_seq - 1;
+    unsigned char window = GBRIDGE_WINDOW_SIZE - state->data_count;
+    if (ack == state->recv_acked && window == state->recv_acked_window) return;
+
+    // If the adapter was waiting for the window to open, this acknowledgement
+    //   may need to be repeated in case it gets lost.
+    if (!state->recv_acked_window && window) {
+        state->recv_window_probes = GBRIDGE_RETRIES;
+        state->recv_window_time = timer_get();
+    }
+
+    frame_write_bytes(state,
+        (unsigned char []){GBRIDGE_CMD_ACK_PC, ack, window}, 3);
+    state->recv_acked = ack;
+    state->recv_acked_window = window;
+}
+
+// Ask the adapter to retransmit everything from the expected frame onwards
+static void send_nak(struct gbridge *state, enum gbridge_cmd cmd)
+{
+    frame_write_bytes(state,
+        (unsigned char []){(cmd + 1) | GBRIDGE_CMD_REPLY_F, state->recv_seq}, 2);
+    state->recv_nak_sent = true;
+    state->baud_fails++;
+    recovery_error(state);
+}
+
+// Discard the rest of a broken frame, and request it again
+// This only works in windowed mode, otherwise the link has to be reset.
+static void recv_fail(struct gbridge *state, enum gbridge_cmd cmd)
+{
+    if (!windowed(state)) {
+        gbridge_reset(state);
+        return;
+    }
+
+    // With COBS framing, the next frame is easily found
+    if (cobs(state)) {
+        send_nak(state, cmd);
+        return;
+    }
+
+    // Drop everything until the line goes quiet, which gbridge_loop() takes
+    //   care of, along with everything else
+    state->in_pos = 0;
+    state->in_size = 0;
+    state->recv_resync_cmd = cmd;
+    state->recv_resync_start = timer_get();
+    state->recv_resync_time = state->recv_resync_start;
+}
+
+// Drop whatever the adapter sends while resynchronizing
+// Without a timeout, this only takes what has already arrived.
+static void recv_resync(struct gbridge *state, unsigned timeout)
+{
+    unsigned char buf[0x40];
+    int rc;
+    do {
+        if (timeout) {
+            rc = link_read_next(state->port, buf, sizeof(buf), timeout);
+        } else {
+            rc = link_read_nonblocking(state->port, buf, sizeof(buf));
+        }
+        if (rc > 0) state->recv_resync_time = timer_get();
+        timeout = 0;
+    } while (rc > 0);
+    if (rc < 0) gbridge_reset(state);
+}
+
+// Read the sequence number of a windowed frame, if any
+static bool recv_frame_seq(struct gbridge *state, unsigned char *seq)
+{
+    *seq = 0;
+    if (!windowed(state)) return true;
+    return recv_data(state, seq, 1);
+}
+
+// Check the sequence number of a received frame
+// Returns false if the frame has to be discarded
+static bool recv_frame_check_seq(struct gbridge *state, unsigned char seq, enum gbridge_cmd cmd)
+{
+    if (!windowed(state)) return true;
+    if (seq == state->recv_seq) {
+        state->recv_seq++;
+        state->recv_nak_sent = false;
+        state->recv_window_probes = 0;
+        if (++state->baud_frames >= BAUD_FAIL_FRAMES) {
+            state->baud_frames = 0;
+            state->baud_fails = 0;
+        }
+        return true;
+    }
+
+    // Frames we've already received have lost their acknowledgement, but
+    //   frames from further ahead mean something went missing.
+    if ((unsigned char)(seq - state->recv_seq) >= 0x80) {
+        // Forget the last acknowledgement, so it's sent again
+        state->recv_acked = state->recv_seq;
+        send_ack_window(state);
+        recovery_error(state);
+    } else if (!state->recv_nak_sent) {
+        send_nak(state, cmd);
+    }
+    return false;
+}
+
+static void send_frame(struct gbridge *state, const struct gbridge_send_frame *frame, unsigned char seq)
+{
+    unsigned char header[4];
+    unsigned header_size = 0;
+    uint16_t checksum = checksum_data(state, frame->buffer, frame->size);
+
+    header[header_size++] = frame->cmd;
+    if (windowed(state)) {
+        header[header_size++] = seq;
+        checksum += seq;
+    }
+    if (frame->cmd == GBRIDGE_CMD_STREAM_PC) {
+        header[header_size++] = frame->size >> 8;
+    }
+    header[header_size++] = frame->size >> 0;
+
+    frame_write(state, (struct gbridge_frame_part []){
+        {header, header_size},
+        {frame->buffer, frame->size},
+        {(unsigned char []){checksum >> 8, checksum >> 0}, 2}
+    }, 3);
+}
+
+// Send every frame that hasn't been acknowledged again
+static void send_retransmit(struct gbridge *state)
+{
+    for (unsigned char seq = state->send_acked; seq != state->send_seq; seq++) {
+        send_frame(state, &state->send_queue[seq % GBRIDGE_WINDOW_SIZE], seq);
+    }
+    state->send_time = timer_get();
+    state->send_timing = false;
+}
+
+// Restart counting the bytes sent to the adapter
+// Anything that hasn't been sent yet is dropped, and will be retransmitted.
+static void credit_restart(struct gbridge *state)
+{
+    state->out_pos = 0;
+    state->out_size = 0;
+    state->credit_epoch++;
+    out_putchar(state, 0);
+    frame_write_bytes(state, (unsigned char []){
+        GBRIDGE_CMD_CREDIT_PC, state->credit_epoch, ~state->credit_epoch}, 3);
+
+    // This frame has to go through regardless of the credits
+    link_write(state->port, state->out_buf + state->out_pos,
+        state->out_size - state->out_pos);
+    state->out_pos = 0;
+    state->out_size = 0;
+    state->credit_sent = 0;
+    state->credit_limit = 0;
+    state->credit_time = timer_get();
+
+    // Acknowledgements might have been dropped
+    state->recv_acked = state->recv_seq;
+}
+
+static void recv_cmd_debug_line(struct gbridge *state)
 {
     unsigned char length;
-    if (!recv_data(port, &length, 1)) return;
+    if (!recv_data(state, &length, 1)) return;
 
     unsigned char string[length];
-    if (!recv_data(port, string, length)) return;
+    if (!recv_data(state, string, length)) return;
 
-    send_ack(port, GBRIDGE_CMD_DEBUG_LINE);
+    // Debug lines aren't acknowledged in windowed mode
+    if (!windowed(state)) send_ack(state, GBRIDGE_CMD_DEBUG_LINE);
 
     fwrite(string, length, 1, stderr);
     fputc('\n', stderr);
 }
 
-static void recv_cmd_data(struct sp_port *port)
+static void recv_cmd_ack(struct gbridge *state)
+{
+    unsigned char c[2];
+    if (!recv_data(state, &c, 2)) return;
+    unsigned char ack = c[0];
+    unsigned char window = c[1];
+
+    // Ignore acknowledgements for frames that haven't been sent
+    if ((unsigned char)(ack + 1 - state->send_acked) >
+            (unsigned char)(state->send_seq - state->send_acked)) {
+        return;
+    }
+    if (window > GBRIDGE_WINDOW_SIZE) return;
+
+    if ((unsigned char)(ack + 1) != state->send_acked) {
+        if (state->send_timing &&
+                (unsigned char)(ack - state->send_timing_seq) <
+                (unsigned char)(state->send_seq - state->send_timing_seq)) {
+            rtt_sample(state, timer_get() - state->send_timing_time);
+            state->send_timing = false;
+        }
+        unsigned size = 0;
+        for (unsigned char seq = state->send_acked; seq != (unsigned char)(ack + 1); seq++) {
+            size += state->send_queue[seq % GBRIDGE_WINDOW_SIZE].size;
+        }
+        recovery_progress(state, size);
+        state->send_acked = ack + 1;
+        state->send_time = timer_get();
+        state->send_retries = 0;
+    }
+    state->send_window = ack + 1 + window;
+}
+
+static void recv_cmd_fail(struct gbridge *state)
 {
-    if (data_ready) {
+    unsigned char seq;
+    if (!recv_data(state, &seq, 1)) return;
+
+    // Everything before the requested frame has been received
+    if ((unsigned char)(seq - state->send_acked) >
+            (unsigned char)(state->send_seq - state->send_acked)) {
+        return;
+    }
+    if (seq != state->send_acked) state->send_retries = 0;
+    state->send_acked = seq;
+    recovery_error(state);
+
+    // Some bytes might have gone missing, and anything that's still waiting
+    //   to be sent is retransmitted anyway
+    if (credits(state)) credit_restart(state);
+    send_retransmit(state);
+    state->baud_fails++;
+}
+
+static void recv_cmd_credit(struct gbridge *state)
+{
+    unsigned char c[4];
+    if (!recv_data(state, &c, 4)) return;
+    unsigned char epoch = c[0];
+    unsigned char limit = c[1];
+    unsigned char overruns = c[2];
+    if ((unsigned char)~(epoch + limit + overruns) != c[3]) return;
+
+    if (state->credit_overruns_known && overruns != state->credit_overruns) {
+        fprintf(stderr, "gbridge: adapter lost %u bytes\n",
+            (unsigned char)(overruns - state->credit_overruns));
+    }
+    state->credit_overruns = overruns;
+    state->credit_overruns_known = true;
+
+    // Ignore credits from before the count was restarted, or older ones
+    if (epoch != state->credit_epoch) return;
+    if ((unsigned char)(limit - state->credit_limit) >= 0x80) return;
+    state->credit_limit = limit;
+    state->credit_time = timer_get();
+    state->credit_retries = 0;
+}
+
+static void recv_cmd_data(struct gbridge *state)
+{
+    if (state->data_count >= GBRIDGE_WINDOW_SIZE) {
         fprintf(stderr, "recv_cmd_data: double receive\n");
-        gbridge_init();
+        recv_fail(state, GBRIDGE_CMD_DATA);
         return;
     }
 
+    unsigned slot = (state->data_first + state->data_count) % GBRIDGE_WINDOW_SIZE;
+    struct gbridge_data *data = &state->data_queue[slot];
+    unsigned char seq;
     unsigned char c[2];
 
-    if (!recv_data(port, &data.size, 1)) return;
-    if (!recv_data(port, data.buffer, data.size)) return;
-    if (!recv_data(port, &c, 2)) return;
+    if (!recv_frame_seq(state, &seq)) goto error;
+    if (!recv_data(state, &data->size, 1)) goto error;
+    if (data->size > GBRIDGE_MAX_DATA_SIZE) goto error;
+    if (!recv_data(state, data->buffer, data->size)) goto error;
+    if (!recv_data(state, &c, 2)) goto error;
     uint16_t checksum = c[0] << 8 | c[1];
-    if (checksum != checksum_data(data)) {
-        // TODO: Implement retrying?
+    if ((uint16_t)(checksum - seq) != checksum_data(state, data->buffer, data->size)) {
         fprintf(stderr, "recv_cmd_data: invalid checksum\n");
-        gbridge_init();
-        return;
+        goto error;
     }
-    data_ready = true;
-    send_ack(port, GBRIDGE_CMD_DATA);
+    if (!recv_frame_check_seq(state, seq, GBRIDGE_CMD_DATA)) return;
+    state->data_queue_seq[slot] = seq;
+    state->data_count++;
+    recovery_progress(state, data->size);
+    if (windowed(state)) {
+        send_ack_window(state);
+    } else {
+        send_ack(state, GBRIDGE_CMD_DATA);
+    }
+    return;
+
+error:
+    recv_fail(state, GBRIDGE_CMD_DATA);
 }
 
-void gbridge_loop(struct sp_port *port)
+static void recv_cmd_stream(struct gbridge *state)
 {
-    if (!connected) return;
-
-    unsigned char cmd;
-    enum sp_return rc = sp_blocking_read(port, &cmd, 1, 100);
-    if (rc == 0) return;
-    if (rc < 0) {
-        connected = false;
+    if (!state->stream_max_size) {
+        fprintf(stderr, "recv_cmd_stream: unexpected stream\n");
+        recv_fail(state, GBRIDGE_CMD_STREAM);
         return;
     }
 
-    if (waiting_cmd != GBRIDGE_CMD_NONE) {
-        if (cmd == (waiting_cmd | GBRIDGE_CMD_REPLY_F)) {
-            waiting_cmd = GBRIDGE_CMD_NONE;
+    unsigned char seq;
+    unsigned char c[2];
+
+    if (!recv_frame_seq(state, &seq)) goto error;
+    if (!recv_data(state, &c, 2)) goto error;
+    unsigned size = c[0] << 8 | c[1];
+    if (size > state->stream_max_size) goto error;
+    if (!recv_data(state, state->stream_buffer, size)) goto error;
+    if (!recv_data(state, &c, 2)) goto error;
+    uint16_t checksum = c[0] << 8 | c[1];
+    if ((uint16_t)(checksum - seq) != checksum_data(state, state->stream_buffer, size)) {
+        fprintf(stderr, "recv_cmd_stream: invalid checksum\n");
+        goto error;
+    }
+    if (!recv_frame_check_seq(state, seq, GBRIDGE_CMD_STREAM)) return;
+    state->stream_size = size;
+    state->stream_max_size = 0;
+    recovery_progress(state, size);
+    if (windowed(state)) {
+        send_ack_window(state);
+    } else {
+        send_ack(state, GBRIDGE_CMD_STREAM);
+    }
+    return;
+
+error:
+    recv_fail(state, GBRIDGE_CMD_STREAM);
+}
+
+static void recv_cmd_baud(struct gbridge *state)
+{
+    unsigned char c[4];
+    if (!recv_data(state, &c, 4)) return;
+    state->baud_reply = (unsigned long)c[0] << 24 | c[1] << 16 | c[2] << 8 | c[3];
+    state->baud_replied = true;
+}
+
+static void recv_cmd_baud_test(struct gbridge *state)
+{
+    unsigned char pattern[sizeof(baud_pattern) * GBRIDGE_BAUD_PATTERN_REPEAT];
+    if (!recv_data(state, pattern, sizeof(pattern))) return;
+
+    state->baud_test_ok = true;
+    for (unsigned i = 0; i < sizeof(pattern); i++) {
+        if (pattern[i] != baud_pattern[i % sizeof(baud_pattern)]) {
+            state->baud_test_ok = false;
         }
-        return;
     }
+    state->baud_tested = true;
+}
 
+static void process_cmd(struct gbridge *state, unsigned char cmd)
+{
     switch (cmd) {
     case GBRIDGE_CMD_DEBUG_LINE:
-        recv_cmd_debug_line(port);
+        recv_cmd_debug_line(state);
         break;
     case GBRIDGE_CMD_DATA:
-        recv_cmd_data(port);
+        recv_cmd_data(state);
+        break;
+    case GBRIDGE_CMD_STREAM:
+        recv_cmd_stream(state);
+        break;
+    case GBRIDGE_CMD_ACK:
+        if (windowed(state)) recv_cmd_ack(state);
+        break;
+    case GBRIDGE_CMD_CREDIT:
+        if (credits(state)) recv_cmd_credit(state);
+        break;
+    case GBRIDGE_CMD_DATA_FAIL_PC | GBRIDGE_CMD_REPLY_F:
+    case GBRIDGE_CMD_STREAM_FAIL_PC | GBRIDGE_CMD_REPLY_F:
+        if (windowed(state)) recv_cmd_fail(state);
+        break;
+    case GBRIDGE_CMD_BAUD_PC | GBRIDGE_CMD_REPLY_F:
+        if (baud_switching(state)) recv_cmd_baud(state);
+        break;
+    case GBRIDGE_CMD_BAUD_TEST_PC | GBRIDGE_CMD_REPLY_F:
+        if (baud_switching(state)) recv_cmd_baud_test(state);
         break;
     default:
         break;
     }
+    recv_frame_done(state);
+}
+
+// Handle everything that's time-dependent in windowed mode
+// Returns the time until something has to be done again, in ms, or
+//   UINT_MAX if nothing is pending.
+static unsigned loop_windowed(struct gbridge *state)
+{
+    uint32_t now = timer_get();
+    uint32_t next = UINT32_MAX;
+
+    // Request a retransmission once the line has gone quiet
+    if (state->recv_resync_cmd != GBRIDGE_CMD_NONE) {
+        recv_resync(state, 0);
+        if (!state->connected) return 0;
+        now = timer_get();
+        if (now - state->recv_resync_start > GBRIDGE_TIMEOUT_US) {
+            fprintf(stderr, "gbridge_loop: can't resynchronize\n");
+            gbridge_reset(state);
+            return 0;
+        }
+        if (now - state->recv_resync_time >= GBRIDGE_RESYNC_US) {
+            send_nak(state, state->recv_resync_cmd);
+            state->recv_resync_cmd = GBRIDGE_CMD_NONE;
+        } else {
+            next = GBRIDGE_RESYNC_US - (now - state->recv_resync_time);
+        }
+    }
+
+    // Start counting anew if the adapter hasn't given any credits in a while,
+    //   in case a CREDIT frame got lost
+    if (credits(state) && state->out_size && state->credit_sent == state->credit_limit) {
+        if (now - state->credit_time > state->rto) {
+            fprintf(stderr, "gbridge_loop: out of credits\n");
+            recovery_error(state);
+            if (++state->credit_retries > GBRIDGE_RETRIES) {
+                fprintf(stderr, "gbridge_loop: timed out\n");
+                gbridge_reset(state);
+                return 0;
+            }
+            credit_restart(state);
+        }
+        if (state->rto - (now - state->credit_time) < next) {
+            next = state->rto - (now - state->credit_time);
+        }
+    }
+
+    // Retransmit frames that haven't been acknowledged in time, counting from
+    //   when they've actually been sent
+    if (state->send_seq != state->send_acked) {
+        if (state->out_size) state->send_time = now;
+        if (now - state->send_time > state->rto) {
+            if (++state->send_retries > GBRIDGE_RETRIES) {
+                fprintf(stderr, "gbridge_loop: timed out\n");
+                gbridge_reset(state);
+                return 0;
+            }
+            state->rto *= 2;
+            if (state->rto > GBRIDGE_RTO_MAX_US) state->rto = GBRIDGE_RTO_MAX_US;
+            recovery_error(state);
+            send_retransmit(state);
+            state->baud_fails++;
+        }
+        if (state->rto - (now - state->send_time) < next) {
+            next = state->rto - (now - state->send_time);
+        }
+    }
+
+    if (state->recv_window_probes) {
+        if (now - state->recv_window_time > state->rto) {
+            state->recv_window_probes--;
+            state->recv_window_time = now;
+            state->recv_acked = state->recv_seq;
+        }
+        if (state->rto - (now - state->recv_window_time) < next) {
+            next = state->rto - (now - state->recv_window_time);
+        }
+    }
+
+    send_ack_window(state);
+    out_flush(state);
+    if (next == UINT32_MAX) return UINT_MAX;
+    return next / 1000 + 1;
 }
 
-bool gbridge_connected(void)
+// Keep handling frames until a reply arrives
+static bool baud_wait(struct gbridge *state, const bool *replied)
 {
-    return connected;
+    uint32_t start = timer_get();
+    while (state->connected && !*replied &&
+            timer_get() - start < GBRIDGE_BAUD_TIMEOUT_US) {
+        gbridge_loop(state);
+    }
+    return *replied;
 }
 
-const struct gbridge_data *gbridge_recv_data(void)
+// Discard whatever was being received at the previous baud rate
+static void baud_recv_reset(struct gbridge *state)
 {
-    if (!data_ready) return NULL;
-    return &data;
+    state->in_pos = 0;
+    state->in_size = 0;
+    state->cobs = (struct gbridge_cobs){.skip = true};
 }
 
-void gbridge_recv_data_done(void)
+// Switch both sides to another baud rate, and test it
+static bool baud_switch(struct gbridge *state, unsigned index)
 {
-    data_ready = false;
+    unsigned long bauds = baud_rates[index];
+    unsigned prev = state->baud_index;
+
+    state->baud_replied = false;
+    out_putchar(state, 0);
+    frame_write_bytes(state, (unsigned char []){
+        GBRIDGE_CMD_BAUD_PC,
+        bauds >> 24, bauds >> 16, bauds >> 8, bauds >> 0
+    }, 5);
+    if (!baud_wait(state, &state->baud_replied)) return false;
+    if (state->baud_reply != bauds) return false;
+    out_drain(state);
+    if (!baud_set(state, index)) return false;
+    baud_recv_reset(state);
+    if (credits(state)) credit_restart(state);
+
+    struct gbridge_frame_part parts[1 + GBRIDGE_BAUD_PATTERN_REPEAT];
+    parts[0] = (struct gbridge_frame_part){
+        (unsigned char []){GBRIDGE_CMD_BAUD_TEST_PC}, 1};
+    for (unsigned i = 1; i < sizeof(parts) / sizeof(*parts); i++) {
+        parts[i] = (struct gbridge_frame_part){baud_pattern, sizeof(baud_pattern)};
+    }
+    state->baud_tested = false;
+    out_putchar(state, 0);
+    frame_write(state, parts, sizeof(parts) / sizeof(*parts));
+    if (baud_wait(state, &state->baud_tested) && state->baud_test_ok) return true;
+
+    out_drain(state);
+    baud_set(state, prev);
+    baud_recv_reset(state);
+    if (credits(state)) credit_restart(state);
+    return false;
 }
 
-int gbridge_recv_stream(struct sp_port *port, void *buffer, unsigned max_size)
+// Whether loop_baud() has something to do, for which it waits on the
+//   adapter by itself
+static bool baud_pending(struct gbridge *state)
 {
-    if (!connected) return -1;
-    unsigned char c[2];
+    if (!baud_switching(state) || state->baud_busy) return false;
+    return !state->baud_tuned || state->baud_fails >= BAUD_MAX_FAILS;
+}
 
-    if (!recv_data(port, &c, 1)) return -1;
-    if (c[0] != GBRIDGE_CMD_STREAM) {
-        fprintf(stderr, "recv_stream: unexpected byte\n");
-        gbridge_init();
-        return -1;
+// Find the fastest baud rate that works, starting from the limit
+static void loop_baud(struct gbridge *state)
+{
+    // Fall back to a slower rate when too many frames get broken
+    if (state->baud_fails >= BAUD_MAX_FAILS) {
+        state->baud_fails = 0;
+        state->baud_frames = 0;
+        if (state->baud_index < BAUD_RATES - 1 &&
+                state->baud_limit <= state->baud_index) {
+            state->baud_limit = state->baud_index + 1;
+            state->baud_tuned = false;
+        }
     }
+    if (state->baud_tuned) return;
 
-    if (!recv_data(port, &c, 2)) return -1;
-    unsigned size = c[0] << 8 | c[1];
-    if (size > max_size) return -1;
-    if (!recv_data(port, buffer, size)) return -1;
-    if (!recv_data(port, &c, 2)) return -1;
-    uint16_t checksum = c[0] << 8 | c[1];
+    // Only switch while nothing's in flight
+    if (state->send_seq != state->send_acked) return;
+
+    unsigned prev = state->baud_index;
+    state->baud_busy = true;
+    for (unsigned i = state->baud_limit; i < BAUD_RATES && i != state->baud_index; i++) {
+        if (baud_switch(state, i)) break;
+        if (!state->connected) break;
 
-    struct gbridge_data data = {.buffer = buffer, .size = size};
-    if (checksum != checksum_data(data)) {
-        // TODO: Implement retrying?
-        fprintf(stderr, "recv_stream: invalid checksum\n");
-        gbridge_init();
-        return -1;
+        // Don't try this rate again
+        if (i + 1 < BAUD_RATES) state->baud_limit = i + 1;
+    }
+    state->baud_busy = false;
+    if (!state->connected) return;
+
+    state->baud_tuned = true;
+    state->baud_fails = 0;
+    state->baud_frames = 0;
+    if (state->baud_index != prev) {
+        printf("Baud rate: %lu\n", baud_rates[state->baud_index]);
     }
-    send_ack(port, GBRIDGE_CMD_STREAM);
-    return size;
 }
 
-static void wait_cmd(struct sp_port *port, unsigned char cmd)
+void gbridge_loop(struct gbridge *state)
 {
-    if (!connected) return;
-    while (waiting_cmd != GBRIDGE_CMD_NONE) gbridge_loop(port);
-    waiting_cmd = cmd;
-    while (waiting_cmd == cmd) gbridge_loop(port);
+    if (!state->connected) return;
+    recovery_report(state);
+    if (baud_switching(state) && !state->baud_busy) loop_baud(state);
+    if (!state->connected) return;
+
+    unsigned timeout = state->loop_timeout;
+    if (windowed(state)) timeout = loop_windowed(state);
+    if (!state->connected) return;
+    if (timeout > state->loop_timeout) timeout = state->loop_timeout;
+
+    // Only read if gbridge_wait() has seen the adapter send something
+    // Otherwise, the port isn't watched for writing while waiting for the
+    //   adapter, so whatever it can take has to be written out first.
+    bool waited = state->loop_waited;
+    if (state->loop_waited) {
+        state->loop_waited = false;
+        if (!state->loop_readable) return;
+    } else {
+        out_drain(state);
+    }
+
+    if (state->recv_resync_cmd != GBRIDGE_CMD_NONE) {
+        recv_resync(state, timeout);
+        return;
+    }
+
+    // Rather than waiting for the rest of a frame, which holds up every
+    //   other adapter the reactor is serving, wait for it along with them
+    if (waited && cobs(state) && !recv_frame_fill(state)) return;
+
+    unsigned char cmd;
+    int rc = recv_bytes(state, &cmd, 1, timeout);
+    if (rc == 0) {
+        // Skip empty frames
+        if (state->cobs.end) recv_frame_done(state);
+        return;
+    }
+    if (rc < 0) {
+        gbridge_reset(state);
+        return;
+    }
+
+    if (state->waiting_cmd != GBRIDGE_CMD_NONE) {
+        if (cmd == (state->waiting_cmd | GBRIDGE_CMD_REPLY_F)) {
+            state->waiting_cmd = GBRIDGE_CMD_NONE;
+        }
+        return;
+    }
+
+    process_cmd(state, cmd);
+    out_flush(state);
 }
 
-void gbridge_cmd_data(struct sp_port *port, struct gbridge_data data)
+// Get ready to wait on the adapter, along with everything else the reactor
+//   is watching
+// Returns false if the adapter can't be waited on right now, and
+//   gbridge_loop() has to wait for it by itself. Otherwise, the timeout is
+//   lowered to when something has to be done next.
+bool gbridge_wait_prepare(struct gbridge *state, int *timeout_ms)
 {
-    if (!connected) return;
-    if (data.size > GBRIDGE_MAX_DATA_SIZE) return;
+    state->loop_watched = false;
+    state->loop_waited = false;
+
+    int fd = link_fd(state->port);
+    if (fd == -1) return false;
 
-    uint16_t checksum = checksum_data(data);
+    unsigned timeout = UINT_MAX;
+    if (state->connected) {
+        // Switching baud rates waits for the adapter by itself
+        if (baud_pending(state)) return false;
+
+        // Bytes that have already been read won't wake the reactor up,
+        //   unless they're waiting for the rest of their frame
+        if (state->in_pos < state->in_size &&
+                (!cobs(state) || recv_frame_arrived(state) ||
+                    state->in_size - state->in_pos == sizeof(state->in_buf))) {
+            return false;
+        }
 
-    sp_blocking_write(port, &(char []){GBRIDGE_CMD_DATA_PC, data.size}, 2, 0);
-    sp_blocking_write(port, data.buffer, data.size, 0);
-    sp_blocking_write(port, &(char []){checksum >> 8, checksum >> 0}, 2, 0);
-    wait_cmd(port, GBRIDGE_CMD_DATA_PC);
+        if (windowed(state)) timeout = loop_windowed(state);
+    }
+
+    // Until connected, the handshake is sent again every so often
+    if (!state->connected) {
+        timeout = 0;
+        uint32_t elapsed = timer_get() - state->handshake_time;
+        if (state->handshake_sent && elapsed < GBRIDGE_TIMEOUT_US) {
+            timeout = (GBRIDGE_TIMEOUT_US - elapsed) / 1000 + 1;
+        }
+    }
+
+    // Input held back by the fault injection won't wake the reactor up either
+    int buffered = link_buffered(state->port);
+    if (buffered == 0) return false;
+    if (buffered > 0 && (unsigned)buffered < timeout) timeout = buffered;
+
+    // Output the adapter can take is written once the port has room for it,
+    //   unless it's stalled
+    unsigned stalled = link_stalled(state->port);
+    if (stalled && stalled < timeout) timeout = stalled;
+    reactor_watch(fd, state->connected && out_ready(state) && !stalled ?
+        REACTOR_IN | REACTOR_OUT : REACTOR_IN);
+    state->loop_watched = true;
+
+    if (timeout != UINT_MAX && (*timeout_ms < 0 || (int)timeout < *timeout_ms)) {
+        *timeout_ms = timeout;
+    }
+    return true;
+}
+
+// Take note of what the reactor has seen the adapter do while waiting
+void gbridge_wait_done(struct gbridge *state)
+{
+    if (!state->loop_watched) return;
+    state->loop_watched = false;
+    state->loop_waited = true;
+    state->loop_readable = reactor_ready(link_fd(state->port)) & REACTOR_IN;
 }
 
-void gbridge_cmd_stream(struct sp_port *port, void *buffer, unsigned size)
+// Sleep until the adapter sends something, a file descriptor watched by the
+//   reactor is ready, or a timer runs out
+// Where the reactor isn't available, this returns right away, and
+//   gbridge_loop() waits for the adapter by itself.
+void gbridge_wait(struct gbridge *state)
 {
-    if (!connected) return;
+    int timeout = -1;
+    if (!gbridge_wait_prepare(state, &timeout)) {
+        // The sockets' operations can't wait until the next time it sleeps
+        uring_submit();
+        return;
+    }
+    if (reactor_wait(timeout) < 0) return;
+    gbridge_wait_done(state);
+}
 
-    uint16_t checksum = checksum_data((struct gbridge_data){.buffer=buffer,.size=size});
+bool gbridge_connected(struct gbridge *state)
+{
+    return state->connected;
+}
+
+// Limit the time gbridge_loop() waits for the adapter, to be able to do other
+//   work in between
+void gbridge_loop_timeout(struct gbridge *state, unsigned timeout_ms)
+{
+    state->loop_timeout = timeout_ms;
+}
+
+// Capabilities that are in use on the current link
+unsigned gbridge_caps(struct gbridge *state)
+{
+    if (!windowed(state)) return 0;
+    return state->caps;
+}
+
+const struct gbridge_data *gbridge_recv_data(struct gbridge *state)
+{
+    if (!state->data_count) return NULL;
+    return &state->data_queue[state->data_first];
+}
+
+void gbridge_recv_data_done(struct gbridge *state)
+{
+    if (!state->data_count) return;
+    state->data_first = (state->data_first + 1) % GBRIDGE_WINDOW_SIZE;
+    state->data_count--;
+}
+
+int gbridge_recv_stream(struct gbridge *state, void *buffer, unsigned max_size)
+{
+    if (!state->connected) return -1;
+
+    state->stream_buffer = buffer;
+    state->stream_max_size = max_size;
+    if (!state->stream_max_size) return -1;
+
+    if (!windowed(state)) {
+        unsigned char c;
+        if (!recv_data(state, &c, 1)) return -1;
+        if (c != GBRIDGE_CMD_STREAM) {
+            fprintf(stderr, "recv_stream: unexpected byte\n");
+            gbridge_reset(state);
+            return -1;
+        }
+        recv_cmd_stream(state);
+        if (!state->connected) return -1;
+        return state->stream_size;
+    }
+
+    // In windowed mode, other frames may arrive before the stream, and it
+    //   might have to be retransmitted a few times.
+    uint32_t start = timer_get();
+    while (state->connected && state->stream_max_size) {
+        if (timer_get() - start > GBRIDGE_RTO_MAX_US * GBRIDGE_RETRIES) {
+            fprintf(stderr, "recv_stream: timed out\n");
+            gbridge_reset(state);
+            break;
+        }
+        gbridge_loop(state);
+    }
+    if (!state->connected) return -1;
+    return state->stream_size;
+}
+
+static void wait_cmd(struct gbridge *state, unsigned char cmd)
+{
+    if (!state->connected) return;
+    while (state->waiting_cmd != GBRIDGE_CMD_NONE) gbridge_loop(state);
+    state->waiting_cmd = cmd;
+
+    // The reply never comes if either it or the frame got broken
+    uint32_t start = timer_get();
+    while (state->waiting_cmd == cmd) {
+        if (timer_get() - start > GBRIDGE_TIMEOUT_US) {
+            fprintf(stderr, "wait_cmd: timed out\n");
+            gbridge_reset(state);
+            break;
+        }
+        gbridge_loop(state);
+    }
+}
+
+// Wait until the adapter is able to take another frame
+static void wait_window(struct gbridge *state)
+{
+    while (state->connected &&
+            ((unsigned char)(state->send_seq - state->send_acked) >=
+                GBRIDGE_WINDOW_SIZE ||
+            (unsigned char)(state->send_window - state->send_seq - 1) >=
+                GBRIDGE_WINDOW_SIZE)) {
+        gbridge_loop(state);
+    }
+}
+
+// Send a frame, keeping it around until it's been acknowledged
+// If the buffer isn't copied, this waits for the acknowledgement instead.
+static void send_frame_queue(struct gbridge *state, enum gbridge_cmd cmd, const void *buffer, unsigned size)
+{
+    struct gbridge_send_frame frame = {.cmd = cmd, .size = size, .buffer = buffer};
+    if (!windowed(state)) {
+        send_frame(state, &frame, 0);
+        wait_cmd(state, cmd);
+        if (state->connected) recovery_progress(state, size);
+        return;
+    }
+
+    wait_window(state);
+    if (!state->connected) return;
+
+    unsigned slot = state->send_seq % GBRIDGE_WINDOW_SIZE;
+    bool copy = cmd == GBRIDGE_CMD_DATA_PC;
+    if (copy) {
+        memcpy(state->send_queue_buf[slot], buffer, size);
+        frame.buffer = state->send_queue_buf[slot];
+    }
+    state->send_queue[slot] = frame;
+
+    send_ack_window(state);
+    send_frame(state, &frame, state->send_seq);
+    if (state->send_seq == state->send_acked) state->send_time = timer_get();
+    if (!state->send_timing) {
+        state->send_timing = true;
+        state->send_timing_seq = state->send_seq;
+        state->send_timing_time = timer_get();
+    }
+    state->send_seq++;
+
+    if (copy) return;
+    while (state->connected && state->send_acked != state->send_seq) gbridge_loop(state);
+}
+
+void gbridge_cmd_data(struct gbridge *state, struct gbridge_data data)
+{
+    if (!state->connected) return;
+    if (data.size > GBRIDGE_MAX_DATA_SIZE_PC) return;
+
+    send_frame_queue(state, GBRIDGE_CMD_DATA_PC, data.buffer, data.size);
+}
+
+void gbridge_cmd_stream(struct gbridge *state, void *buffer, unsigned size)
+{
+    if (!state->connected) return;
 
-    sp_blocking_write(port, &(char []){GBRIDGE_CMD_STREAM_PC, size >> 8, size >> 0}, 3, 0);
-    sp_blocking_write(port, buffer, size, 0);
-    sp_blocking_write(port, &(char []){checksum >> 8, checksum >> 0}, 2, 0);
-    wait_cmd(port, GBRIDGE_CMD_STREAM_PC);
+    send_frame_queue(state, GBRIDGE_CMD_STREAM_PC, buffer, size);
 }
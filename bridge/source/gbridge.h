@@ -1,19 +1,163 @@
 #pragma once
 
 #include <stdbool.h>
-struct sp_port;
+#include <stdint.h>
+
+#include "gbridge_cmd.h"
+#include "gbridge_codec.h"
+
+struct link;
 
 struct gbridge_data {
     unsigned char size;
     unsigned char *buffer;
 };
 
-void gbridge_init(void);
-bool gbridge_handshake(struct sp_port *port);
-void gbridge_loop(struct sp_port *port);
-bool gbridge_connected(void);
-const struct gbridge_data *gbridge_recv_data(void);
-void gbridge_recv_data_done(void);
-int gbridge_recv_stream(struct sp_port *port, void *buffer, unsigned max_size);
-void gbridge_cmd_data(struct sp_port *port, struct gbridge_data data);
-void gbridge_cmd_stream(struct sp_port *port, void *buffer, unsigned size);
+// Frame that hasn't been acknowledged yet
+// Data packets are copied, but streams wait until they're acknowledged.
+struct gbridge_send_frame {
+    enum gbridge_cmd cmd;
+    unsigned size;
+    const unsigned char *buffer;
+};
+
+// Recovery from the faults injected into the link, see link_fault.c
+// A fault is recovered from once the link makes progress again, after
+//   whatever it broke has been noticed.
+struct gbridge_recovery {
+    bool started;
+    bool pending;  // Faults have been injected since the link last recovered
+    bool hit;  // The link has noticed them
+    uint32_t fault_time;  // Time the first of them was injected
+    unsigned burst;  // Amount of them
+    unsigned faults;
+    unsigned recoveries;
+    unsigned unnoticed;  // Faults that never made a difference
+    uint64_t time_sum;  // Time spent recovering, in us
+    uint32_t time_max;
+    uint64_t time_total;  // Time spent connected, in us
+    uint64_t bytes;  // Data that got through while not recovering
+    uint64_t bytes_total;
+    uint32_t last_time;
+    uint32_t report_time;
+};
+
+// Everything known about the link with one adapter
+// Nothing is shared between these, so adapters can be served from different
+//   threads.
+struct gbridge {
+    struct link *port;
+
+    unsigned char handshake_progress;
+    bool handshake_legacy;  // The next handshake is the original one
+    bool handshake_sent;  // Waiting for the reply to a handshake
+    bool handshake_ext;  // The extended handshake has been sent
+    bool handshake_caps;  // Waiting for the adapter's capabilities
+    bool handshake_caps_ext;  // Waiting for the second byte of them
+    uint32_t handshake_time;
+
+    bool connected;
+    unsigned caps;
+    bool rtscts;
+    enum gbridge_cmd waiting_cmd;
+    unsigned loop_timeout;  // Longest wait for the adapter, in ms
+    bool loop_watched;  // The reactor is watching the adapter
+    bool loop_waited;  // gbridge_wait() has checked on the adapter
+    bool loop_readable;  // The adapter has sent something
+
+    // Received data packets, queued up until they're processed
+    unsigned char data_queue_buf[GBRIDGE_WINDOW_SIZE][GBRIDGE_MAX_DATA_SIZE];
+    struct gbridge_data data_queue[GBRIDGE_WINDOW_SIZE];
+    unsigned char data_queue_seq[GBRIDGE_WINDOW_SIZE];
+    unsigned data_first;
+    unsigned data_count;
+
+    unsigned char *stream_buffer;
+    unsigned stream_size;
+    unsigned stream_max_size;
+
+    // Frames that haven't been acknowledged yet, kept for retransmission
+    struct gbridge_send_frame send_queue[GBRIDGE_WINDOW_SIZE];
+    unsigned char send_queue_buf[GBRIDGE_WINDOW_SIZE][GBRIDGE_MAX_DATA_SIZE];
+
+    // Windowed mode sequence numbers
+    unsigned char send_seq;  // Next frame to be sent
+    unsigned char send_acked;  // Oldest frame that hasn't been acknowledged
+    unsigned char send_window;  // First frame the receiver can't take
+    uint32_t send_time;
+    unsigned send_retries;
+    bool send_timing;  // Measuring the round-trip time of a frame
+    unsigned char send_timing_seq;
+    uint32_t send_timing_time;
+
+    unsigned char recv_seq;  // Next frame to be received
+    unsigned char recv_acked;  // Last acknowledgement sent
+    unsigned char recv_acked_window;
+    bool recv_nak_sent;
+    enum gbridge_cmd recv_resync_cmd;  // Frame to ask for once the line is quiet
+    uint32_t recv_resync_start;
+    uint32_t recv_resync_time;  // Last time something arrived meanwhile
+    unsigned recv_window_probes;
+    uint32_t recv_window_time;
+
+    // Round-trip time estimation, in microseconds
+    bool rtt_measured;
+    uint32_t rtt_avg;
+    uint32_t rtt_var;
+    uint32_t rto;
+
+    // Input, read from the port in bigger chunks
+    // With COBS, this holds the biggest frame, so it can be waited for.
+    unsigned char in_buf[0x400];
+    unsigned in_pos;
+    unsigned in_size;
+
+    struct gbridge_cobs cobs;  // Decoder of the current frame
+
+    // Output, with every frame written out in one go where possible
+    // With credits, this holds everything the adapter can't take yet.
+    unsigned char out_buf[0x1000];
+    unsigned out_pos;
+    unsigned out_size;
+    unsigned out_frame;  // Start of the frame being encoded
+    bool out_full;
+
+    // Receive buffer credits, counting bytes sent modulo 0x100
+    unsigned char credit_epoch;
+    unsigned char credit_sent;
+    unsigned char credit_limit;  // First byte the adapter can't take
+    uint32_t credit_time;
+    unsigned credit_retries;
+    bool credit_overruns_known;
+    unsigned char credit_overruns;
+
+    // Baud rate switching
+    // The fastest rate that has been working is kept across resets.
+    unsigned baud_index;
+    unsigned baud_limit;
+    bool baud_tuned;
+    bool baud_busy;
+    unsigned baud_fails;
+    unsigned baud_frames;
+    bool baud_replied;
+    unsigned long baud_reply;
+    bool baud_tested;
+    bool baud_test_ok;
+
+    struct gbridge_recovery recovery;
+};
+
+void gbridge_init(struct gbridge *state, struct link *port);
+bool gbridge_handshake(struct gbridge *state);
+void gbridge_loop(struct gbridge *state);
+bool gbridge_wait_prepare(struct gbridge *state, int *timeout_ms);
+void gbridge_wait_done(struct gbridge *state);
+void gbridge_wait(struct gbridge *state);
+void gbridge_loop_timeout(struct gbridge *state, unsigned timeout_ms);
+bool gbridge_connected(struct gbridge *state);
+unsigned gbridge_caps(struct gbridge *state);
+const struct gbridge_data *gbridge_recv_data(struct gbridge *state);
+void gbridge_recv_data_done(struct gbridge *state);
+int gbridge_recv_stream(struct gbridge *state, void *buffer, unsigned max_size);
+void gbridge_cmd_data(struct gbridge *state, struct gbridge_data data);
+void gbridge_cmd_stream(struct gbridge *state, void *buffer, unsigned size);
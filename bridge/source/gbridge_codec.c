@@ -0,0 +1 @@
+../../atmega328p/source/gbridge_codec.c
\ No newline at end of file
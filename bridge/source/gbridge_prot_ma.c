@@ -1,80 +1,68 @@
 #include "gbridge_prot_ma.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #include "gbridge.h"
 #include "gbridge_cmd.h"
+#include "gbridge_codec.h"
 #include "gbridge_prot_ma_cmd.h"
+#include "reactor.h"
 #include "socket_impl.h"
 
-static unsigned char data_buf[GBRIDGE_MAX_DATA_SIZE];
-static struct gbridge_data data;
-static struct socket_impl socket;
-
-void gbridge_prot_ma_init(void)
-{
-    data.buffer = data_buf;
-    data.size = 0;
-    socket_impl_init(&socket);
-}
-
-#define ADDRESS_MAXLEN (3 + MOBILE_HOSTLEN_IPV6)
-static unsigned address_write(const struct mobile_addr *addr, unsigned char *buffer)
-{
-    if (!addr) {
-        buffer[0] = MOBILE_ADDRTYPE_NONE;
-        return 1;
-    } else if (addr->type == MOBILE_ADDRTYPE_IPV4) {
-        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-        buffer[0] = MOBILE_ADDRTYPE_IPV4;
-        buffer[1] = (addr4->port >> 8) & 0xFF;
-        buffer[2] = (addr4->port >> 0) & 0xFF;
-        memcpy(buffer + 3, addr4->host, MOBILE_HOSTLEN_IPV4);
-        return 3 + MOBILE_HOSTLEN_IPV4;
-    } else if (addr->type == MOBILE_ADDRTYPE_IPV6) {
-        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-        buffer[0] = MOBILE_ADDRTYPE_IPV6;
-        buffer[1] = (addr6->port >> 8) & 0xFF;
-        buffer[2] = (addr6->port >> 0) & 0xFF;
-        memcpy(buffer + 3, addr6->host, MOBILE_HOSTLEN_IPV6);
-        return 3 + MOBILE_HOSTLEN_IPV6;
-    } else {
-        buffer[0] = MOBILE_ADDRTYPE_NONE;
-        return 1;
-    }
+// Time to wait for the adapter at most while sockets have to be checked,
+//   where the reactor isn't available to wait on them along with it
+#define PUSH_POLL_MS 2
+
+void gbridge_prot_ma_init(struct gbridge_prot_ma *state, struct gbridge *bridge)
+{
+    state->bridge = bridge;
+    state->data.buffer = state->data_buf;
+    state->data.size = 0;
+    socket_impl_init(&state->socket);
+    memset(state->pushes, 0, sizeof(state->pushes));
+    state->send.busy = false;
 }
 
-static unsigned address_read(struct mobile_addr *addr, const unsigned char *buffer, unsigned size)
+// Close every connection, after the adapter has been reset
+void gbridge_prot_ma_reset(struct gbridge_prot_ma *state)
 {
-    if (size < 1) return 0;
-    if (buffer[0] == MOBILE_ADDRTYPE_NONE) {
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_NONE;
-        }
-        return 1;
-    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV4) {
-        if (size < 3 + MOBILE_HOSTLEN_IPV4) return 0;
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_IPV4;
-            struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-            addr4->port = buffer[1] << 8 | buffer[2];
-            memcpy(addr4->host, buffer + 3, MOBILE_HOSTLEN_IPV4);
-        }
-        return 3 + MOBILE_HOSTLEN_IPV4;
-    } else if (buffer[0] == MOBILE_ADDRTYPE_IPV6) {
-        if (size < 3 + MOBILE_HOSTLEN_IPV6) return 0;
-        if (addr) {
-            addr->type = MOBILE_ADDRTYPE_IPV6;
-            struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-            addr6->port = buffer[1] << 8 | buffer[2];
-            memcpy(addr6->host, buffer + 3, MOBILE_HOSTLEN_IPV6);
-        }
-        return 3 + MOBILE_HOSTLEN_IPV6;
-    }
-    return 0;
+    socket_impl_stop(&state->socket);
+    gbridge_prot_ma_init(state, state->bridge);
+}
+
+static bool pushing(struct gbridge_prot_ma *state)
+{
+    return gbridge_caps(state->bridge) & GBRIDGE_CAP_PUSH;
 }
 
-static bool recv_cmd_sock_open(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool events(struct gbridge_prot_ma *state)
+{
+    return pushing(state) && (gbridge_caps(state->bridge) & GBRIDGE_CAP_EVENTS);
+}
+
+// Add data to the end of a reply, if it fits in there
+// Returns false if it has to be sent in a stream instead.
+static bool inline_data(struct gbridge_prot_ma *state, const void *buffer, int size)
+{
+    if (!(gbridge_caps(state->bridge) & GBRIDGE_CAP_INLINE)) return false;
+    if (size <= 0) return false;
+    if (state->data.size + size > GBRIDGE_MAX_DATA_SIZE_PC) return false;
+    memcpy(state->data.buffer + state->data.size, buffer, size);
+    state->data.size += size;
+    return true;
+}
+
+// Check if a connection has been opened
+// The adapter doesn't wait for a connection to be opened before using it, so
+//   it may still do so after opening it has failed. Such requests fail too.
+static bool conn_open(struct gbridge_prot_ma *state, unsigned conn)
+{
+    if (conn >= MOBILE_MAX_CONNECTIONS) return false;
+    return state->pushes[conn].open;
+}
+
+static bool recv_cmd_sock_open(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size != 6) return false;
 
@@ -83,160 +71,445 @@ static bool recv_cmd_sock_open(const struct gbridge_data *recv_data, struct sp_p
     enum mobile_addrtype addrtype = recv_data->buffer[3];
     unsigned bindport = recv_data->buffer[4] << 8 | recv_data->buffer[5];
 
-    bool res = socket_impl_open(&socket, conn, socktype, addrtype,
-        bindport);
+    bool res = false;
+    if (conn < MOBILE_MAX_CONNECTIONS) {
+        // Whatever was left of the connection isn't of any use anymore
+        if (conn_open(state, conn)) socket_impl_close(&state->socket, conn);
+
+        res = socket_impl_open(&state->socket, conn, socktype, addrtype,
+            bindport);
+        state->pushes[conn] = (struct gbridge_prot_ma_push){
+            .open = res,
+            .ready = res && socktype == MOBILE_SOCKTYPE_UDP,
+            .udp = socktype == MOBILE_SOCKTYPE_UDP,
+        };
+    }
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_OPEN;
-    data.buffer[1] = res;
-    data.size = 2;
-    gbridge_cmd_data(port, data);
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_OPEN;
+    state->data.buffer[1] = res;
+    state->data.size = 2;
+    gbridge_cmd_data(state->bridge, state->data);
     return true;
 }
 
-static bool recv_cmd_sock_close(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool recv_cmd_sock_close(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size != 2) return false;
 
     unsigned conn = recv_data->buffer[1];
 
-    socket_impl_close(&socket, conn);
+    if (conn_open(state, conn)) {
+        socket_impl_close(&state->socket, conn);
+        state->pushes[conn] = (struct gbridge_prot_ma_push){0};
+    }
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_CLOSE;
-    data.size = 1;
-    gbridge_cmd_data(port, data);
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_CLOSE;
+    state->data.size = 1;
+    gbridge_cmd_data(state->bridge, state->data);
     return true;
 }
 
-static bool recv_cmd_sock_connect(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool recv_cmd_sock_connect(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size < 2) return false;
     unsigned conn = recv_data->buffer[1];
 
     struct mobile_addr recv_addr;
-    unsigned recv_addrlen = address_read(&recv_addr, recv_data->buffer + 2,
+    unsigned recv_addrlen = gbridge_address_read(&recv_addr, recv_data->buffer + 2,
         recv_data->size - 2);
     if (recv_addrlen <= 1) return false;
     if (recv_data->size != 2 + recv_addrlen) return false;
 
-    int res = socket_impl_connect(&socket, conn, &recv_addr);
+    int res = -1;
+    if (conn_open(state, conn)) {
+        res = socket_impl_connect(&state->socket, conn, &recv_addr);
+    }
+    if (res > 0) state->pushes[conn].ready = true;
+
+    // Keep trying until it's done, and tell the adapter
+    if (res == 0 && events(state)) {
+        state->pushes[conn].connecting = true;
+        state->pushes[conn].connect_addr = recv_addr;
+    }
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_CONNECT;
-    data.buffer[1] = res;
-    data.size = 2;
-    gbridge_cmd_data(port, data);
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_CONNECT;
+    state->data.buffer[1] = res;
+    state->data.size = 2;
+    gbridge_cmd_data(state->bridge, state->data);
     return true;
 }
 
-static bool recv_cmd_sock_listen(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool recv_cmd_sock_listen(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size != 2) return false;
     unsigned conn = recv_data->buffer[1];
 
-    bool res = socket_impl_listen(&socket, conn);
+    bool res = conn_open(state, conn) &&
+        socket_impl_listen(&state->socket, conn);
+    if (res && events(state)) state->pushes[conn].listening = true;
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_LISTEN;
-    data.buffer[1] = res;
-    data.size = 2;
-    gbridge_cmd_data(port, data);
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_LISTEN;
+    state->data.buffer[1] = res;
+    state->data.size = 2;
+    gbridge_cmd_data(state->bridge, state->data);
     return true;
 }
 
-static bool recv_cmd_sock_accept(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool recv_cmd_sock_accept(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size != 2) return false;
     unsigned conn = recv_data->buffer[1];
 
-    bool res = socket_impl_accept(&socket, conn);
+    bool res = conn_open(state, conn) &&
+        socket_impl_accept(&state->socket, conn);
+    if (res) state->pushes[conn].ready = true;
+
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_ACCEPT;
+    state->data.buffer[1] = res;
+    state->data.size = 2;
+    gbridge_cmd_data(state->bridge, state->data);
+    return true;
+}
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_ACCEPT;
-    data.buffer[1] = res;
-    data.size = 2;
-    gbridge_cmd_data(port, data);
+// Send as much of the held data as the socket takes, and reply once it's
+//   all been taken
+// Returns false while some of it is still left.
+static bool send_continue(struct gbridge_prot_ma *state)
+{
+    struct gbridge_prot_ma_send *send = &state->send;
+    int res = -1;
+    if (conn_open(state, send->conn)) {
+        res = socket_impl_send(&state->socket, send->conn,
+            send->buf + send->sent, send->size - send->sent, &send->addr);
+    }
+    if (res > 0) send->sent += res;
+
+    // Without windowed mode, the adapter is told how much has been taken
+    bool windowed = gbridge_caps(state->bridge) & GBRIDGE_CAP_WINDOW;
+    if (res >= 0 && send->sent != send->size && windowed) return false;
+    if (res >= 0) res = send->sent;
+    send->busy = false;
+
+    state->data.buffer[0] = send->cmd;
+    state->data.buffer[1] = res >> 8;
+    state->data.buffer[2] = res >> 0;
+    state->data.size = 3;
+    gbridge_cmd_data(state->bridge, state->data);
     return true;
 }
 
-static bool recv_cmd_sock_send(const struct gbridge_data *recv_data, struct sp_port *port)
+// Hold on to the data of a SEND request, and start sending it
+static void send_start(struct gbridge_prot_ma *state, unsigned char cmd, unsigned conn, const struct mobile_addr *addr, const void *buffer, unsigned size)
+{
+    struct gbridge_prot_ma_send *send = &state->send;
+    send->busy = true;
+    send->cmd = cmd;
+    send->conn = conn;
+    send->addr = *addr;
+    send->size = size;
+    send->sent = 0;
+    if (buffer != send->buf) memcpy(send->buf, buffer, size);
+    send_continue(state);
+}
+
+static bool recv_cmd_sock_send(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size < 2) return false;
 
     unsigned conn = recv_data->buffer[1];
 
     struct mobile_addr recv_addr;
-    unsigned recv_addrlen = address_read(&recv_addr, recv_data->buffer + 2,
+    unsigned recv_addrlen = gbridge_address_read(&recv_addr, recv_data->buffer + 2,
         recv_data->size - 2);
     if (!recv_addrlen) return false;
 
-    unsigned char recv_buffer[0x200];
-    int stream_res = gbridge_recv_stream(port, recv_buffer, sizeof(recv_buffer));
+    int stream_res = gbridge_recv_stream(state->bridge, state->send.buf,
+        sizeof(state->send.buf));
     if (stream_res < 0) return false;
-    unsigned recv_size = stream_res;
 
-    int res = socket_impl_send(&socket, conn, recv_buffer,
-        recv_size, &recv_addr);
+    send_start(state, GBRIDGE_PROT_MA_CMD_SEND, conn, &recv_addr,
+        state->send.buf, stream_res);
+    return true;
+}
+
+static bool recv_cmd_sock_send_inline(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
+{
+    if (recv_data->size < 2) return false;
+
+    unsigned conn = recv_data->buffer[1];
 
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_SEND;
-    data.buffer[1] = res >> 8;
-    data.buffer[2] = res >> 0;
-    data.size = 3;
-    gbridge_cmd_data(port, data);
+    struct mobile_addr recv_addr;
+    unsigned recv_addrlen = gbridge_address_read(&recv_addr, recv_data->buffer + 2,
+        recv_data->size - 2);
+    if (!recv_addrlen) return false;
+
+    send_start(state, GBRIDGE_PROT_MA_CMD_SEND_INLINE, conn, &recv_addr,
+        recv_data->buffer + 2 + recv_addrlen,
+        recv_data->size - 2 - recv_addrlen);
     return true;
 }
 
-static bool recv_cmd_sock_recv(const struct gbridge_data *recv_data, struct sp_port *port)
+static bool recv_cmd_sock_recv(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
 {
     if (recv_data->size != 4) return false;
     unsigned conn = recv_data->buffer[1];
     unsigned size = recv_data->buffer[2] << 8 | recv_data->buffer[3];
 
-    unsigned char buffer[size];
+    // The adapter is given no more than fits in a single data packet, as it
+    //   asks for little more than that anyway
+    unsigned char buffer[GBRIDGE_MAX_DATA_SIZE_PC];
+    if (size > sizeof(buffer)) size = sizeof(buffer);
     struct mobile_addr recv_addr = {0};
 
-    int res = socket_impl_recv(&socket, conn, buffer, size, &recv_addr);
-
-    data.buffer[0] = GBRIDGE_PROT_MA_CMD_RECV;
-    data.buffer[1] = res >> 8;
-    data.buffer[2] = res >> 0;
-    unsigned addrlen = address_write(&recv_addr, data.buffer + 3);
-    data.size = addrlen + 3;
-    gbridge_cmd_data(port, data);
-    if (!gbridge_connected()) return false;
+    // Asking for nothing only checks whether the connection is still there
+    int res = -1;
+    if (conn_open(state, conn)) {
+        res = socket_impl_recv(&state->socket, conn, size ? buffer : NULL,
+            size, &recv_addr);
+    }
+    if (!size && res > 0) res = 0;
+
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_RECV;
+    state->data.buffer[1] = res >> 8;
+    state->data.buffer[2] = res >> 0;
+    unsigned addrlen = gbridge_address_write(&recv_addr, state->data.buffer + 3);
+    state->data.size = addrlen + 3;
+    bool data_inline = inline_data(state, buffer, res);
+    gbridge_cmd_data(state->bridge, state->data);
+    if (!gbridge_connected(state->bridge)) return false;
+
+    if (res <= 0 || data_inline) return true;
+    gbridge_cmd_stream(state->bridge, buffer, res);
+    return true;
+}
 
-    if (res <= 0) return true;
-    gbridge_cmd_stream(port, buffer, res);
+static bool recv_cmd_sock_recv_window(struct gbridge_prot_ma *state, const struct gbridge_data *recv_data)
+{
+    if (recv_data->size != 3) return false;
+    unsigned conn = recv_data->buffer[1];
+    unsigned char limit = recv_data->buffer[2];
+    if (conn >= MOBILE_MAX_CONNECTIONS) return false;
+
+    struct gbridge_prot_ma_push *push = &state->pushes[conn];
+    if (!push->active) {
+        push->active = true;
+        push->capacity = limit - push->sent;
+    } else if ((unsigned char)(limit - push->limit) > push->capacity) {
+        // Older than the last one
+        return true;
+    }
+    push->limit = limit;
     return true;
 }
 
-void gbridge_prot_ma_loop(struct sp_port *port)
+// Send data that has arrived on a socket to the adapter, if it has room
+static void push_conn(struct gbridge_prot_ma *state, unsigned conn)
+{
+    struct gbridge_prot_ma_push *push = &state->pushes[conn];
+    if (!push->ready || !push->active || push->ended) return;
+    unsigned room = (unsigned char)(push->limit - push->sent);
+
+    unsigned char buffer[0x100];
+    unsigned char *push_buffer = buffer;
+    struct mobile_addr *addr = NULL;
+    unsigned header = 0;
+    int res = 0;
+    if (push->udp) {
+        if (!push->held) {
+            res = socket_impl_recv(&state->socket, conn, push->held_buf,
+                sizeof(push->held_buf), &push->held_addr);
+            if (res == 0) return;
+            if (res > 0) push->held = res;
+        }
+        if (push->held) {
+            // Datagrams are stored whole, and cut short if they never fit
+            addr = &push->held_addr;
+            header = 1 + gbridge_address_write(addr, state->data.buffer + 4);
+            unsigned max = 0;
+            if (push->capacity > header) max = push->capacity - header;
+            if (push->held > max) {
+                fprintf(stderr, "push: datagram cut to %u bytes\n", max);
+                push->held = max;
+                if (!max) return;
+            }
+            if (room < header + push->held) return;
+            res = push->held;
+            push->held = 0;
+            push_buffer = push->held_buf;
+        }
+    } else {
+        if (!room) return;
+        res = socket_impl_recv(&state->socket, conn, buffer, room, NULL);
+        if (res == 0) return;
+    }
+    if (res < 0) push->ended = true;
+    if (res == -2 && events(state)) {
+        push->events |= GBRIDGE_PROT_MA_EVENT_CLOSED;
+        return;
+    }
+
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_PUSH;
+    state->data.buffer[1] = conn;
+    state->data.buffer[2] = res >> 8;
+    state->data.buffer[3] = res >> 0;
+    unsigned addrlen = gbridge_address_write(addr, state->data.buffer + 4);
+    state->data.size = addrlen + 4;
+    bool data_inline = inline_data(state, push_buffer, res);
+    gbridge_cmd_data(state->bridge, state->data);
+    if (!gbridge_connected(state->bridge)) return;
+
+    if (res <= 0) return;
+    push->sent += header + res;
+    if (data_inline) return;
+    gbridge_cmd_stream(state->bridge, push_buffer, res);
+}
+
+// Check on connections that are being made, and listening sockets
+static void watch_conn(struct gbridge_prot_ma *state, unsigned conn)
+{
+    struct gbridge_prot_ma_push *push = &state->pushes[conn];
+    if (push->connecting) {
+        int res = socket_impl_connect(&state->socket, conn, &push->connect_addr);
+        if (res > 0) {
+            push->connecting = false;
+            push->ready = true;
+            push->events |= GBRIDGE_PROT_MA_EVENT_CONNECTED;
+        } else if (res < 0) {
+            push->connecting = false;
+            push->events |= GBRIDGE_PROT_MA_EVENT_CONNECT_FAILED;
+        }
+    }
+    if (push->listening && socket_impl_accept(&state->socket, conn)) {
+        push->listening = false;
+        push->ready = true;
+        push->events |= GBRIDGE_PROT_MA_EVENT_ACCEPTED;
+    }
+}
+
+// Tell the reactor what to wait for on a connection's socket
+static void watch_socket(struct gbridge_prot_ma *state, unsigned conn, bool queued)
+{
+    struct gbridge_prot_ma_push *push = &state->pushes[conn];
+    unsigned events = 0;
+    if (queued || push->connecting) events |= REACTOR_OUT;
+    if (push->listening) events |= REACTOR_IN;
+
+    // Data is only read once the adapter has room for it
+    if (push->ready && push->active && !push->ended) {
+        if (push->udp ? !push->held : push->limit != push->sent) {
+            events |= REACTOR_IN;
+        }
+    }
+    socket_impl_watch(&state->socket, conn, events);
+}
+
+// Send every event that has happened since the last time, all at once
+static void send_events(struct gbridge_prot_ma *state)
+{
+    state->data.buffer[0] = GBRIDGE_PROT_MA_CMD_EVENT;
+    bool any = false;
+    for (unsigned conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
+        state->data.buffer[1 + conn] = state->pushes[conn].events;
+        if (state->pushes[conn].events) any = true;
+        state->pushes[conn].events = 0;
+    }
+    if (!any) return;
+    state->data.size = 1 + MOBILE_MAX_CONNECTIONS;
+    gbridge_cmd_data(state->bridge, state->data);
+}
+
+// Push everything that has happened on the sockets, and send the data
+//   that's been queued on them
+// The reactor wakes the bridge up once a socket has something to do, or
+//   the adapter has sent RECV_WINDOW. Without it, the sockets are checked
+//   in between waiting for the adapter, which is kept brief while they have
+//   to be.
+static void push_all(struct gbridge_prot_ma *state)
 {
-    const struct gbridge_data *recv_data = gbridge_recv_data();
+    bool polling = false;
+    bool queued[MOBILE_MAX_CONNECTIONS];
+    for (unsigned conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
+        queued[conn] = socket_impl_flush(&state->socket, conn) > 0;
+        if (queued[conn]) polling = true;
+    }
+    if (socket_impl_flush_closing(&state->socket)) polling = true;
+    if (pushing(state)) {
+        for (unsigned conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
+            struct gbridge_prot_ma_push *push = &state->pushes[conn];
+            watch_conn(state, conn);
+            push_conn(state, conn);
+            if (!gbridge_connected(state->bridge)) return;
+            if (push->ready && push->active) polling = true;
+            if (push->connecting || push->listening) polling = true;
+        }
+        send_events(state);
+        if (!gbridge_connected(state->bridge)) return;
+    }
+    if (state->send.busy) polling = true;
+
+    for (unsigned conn = 0; conn < MOBILE_MAX_CONNECTIONS; conn++) {
+        watch_socket(state, conn, queued[conn]);
+        reactor_watch(state->socket.closing[conn].sock, REACTOR_OUT);
+    }
+    if (!reactor_enabled()) {
+        gbridge_loop_timeout(state->bridge, polling ? PUSH_POLL_MS : 100);
+    }
+}
+
+static void recv_cmd(struct gbridge_prot_ma *state)
+{
+    // Requests wait until the data that's being sent has been taken, apart
+    //   from the room made for pushed data, which the socket might be
+    //   waiting on as well
+    if (state->send.busy && !send_continue(state)) {
+        const struct gbridge_data *recv_data = gbridge_recv_data(state->bridge);
+        if (!recv_data || recv_data->size < 1) return;
+        if (recv_data->buffer[0] != GBRIDGE_PROT_MA_CMD_RECV_WINDOW) return;
+    }
+    if (!gbridge_connected(state->bridge)) return;
+
+    const struct gbridge_data *recv_data = gbridge_recv_data(state->bridge);
     if (!recv_data) return;
     if (recv_data->size < 1) goto error;
 
     switch (recv_data->buffer[0]) {
     case GBRIDGE_PROT_MA_CMD_OPEN:
-        recv_cmd_sock_open(recv_data, port);
+        recv_cmd_sock_open(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_CLOSE:
-        recv_cmd_sock_close(recv_data, port);
+        recv_cmd_sock_close(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_CONNECT:
-        recv_cmd_sock_connect(recv_data, port);
+        recv_cmd_sock_connect(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_LISTEN:
-        recv_cmd_sock_listen(recv_data, port);
+        recv_cmd_sock_listen(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_ACCEPT:
-        recv_cmd_sock_accept(recv_data, port);
+        recv_cmd_sock_accept(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_SEND:
-        recv_cmd_sock_send(recv_data, port);
+        recv_cmd_sock_send(state, recv_data);
         break;
     case GBRIDGE_PROT_MA_CMD_RECV:
-        recv_cmd_sock_recv(recv_data, port);
+        recv_cmd_sock_recv(state, recv_data);
+        break;
+    case GBRIDGE_PROT_MA_CMD_SEND_INLINE:
+        recv_cmd_sock_send_inline(state, recv_data);
+        break;
+    case GBRIDGE_PROT_MA_CMD_RECV_WINDOW:
+        recv_cmd_sock_recv_window(state, recv_data);
         break;
     }
 
 error:
-    gbridge_recv_data_done();
+    gbridge_recv_data_done(state->bridge);
     return;
 }
+
+void gbridge_prot_ma_loop(struct gbridge_prot_ma *state)
+{
+    recv_cmd(state);
+    if (!gbridge_connected(state->bridge)) return;
+    push_all(state);
+}
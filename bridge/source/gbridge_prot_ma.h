@@ -1,6 +1,58 @@
 #pragma once
 
-struct sp_port;
+#include <stdbool.h>
 
-void gbridge_prot_ma_init(void);
-void gbridge_prot_ma_loop(struct sp_port *port);
+#include "gbridge.h"
+#include "socket_impl.h"
+
+// Data and events pushed to the adapter, for every connection
+struct gbridge_prot_ma_push {
+    bool open;  // The socket has been opened
+    bool ready;  // The socket is able to receive data
+    bool active;  // The adapter has told how much room it has
+    bool ended;  // An error has been pushed
+    bool udp;
+    bool connecting;  // Waiting for the connection to be made
+    bool listening;  // Waiting for an incoming connection
+    unsigned char events;  // Events that haven't been sent yet
+    struct mobile_addr connect_addr;
+    unsigned char sent;  // Bytes stored in the adapter, modulo 0x100
+    unsigned char limit;  // First byte the adapter can't take
+    unsigned char capacity;  // Size of the adapter's buffer
+
+    // Datagram that doesn't fit yet
+    unsigned held;
+    struct mobile_addr held_addr;
+    unsigned char held_buf[0x200];
+};
+
+// Data of a SEND request that the socket hasn't taken all of yet
+// In windowed mode, SEND is only replied to once all of its data has been
+//   taken, so the reply never falls short of what the adapter sent, as it
+//   doesn't keep the data around to send the rest. Meanwhile, other requests
+//   wait in the link's window, which holds the adapter back once it's full.
+// Without windowed mode, the reply may fall short like it always has, as
+//   the adapter can't be held back.
+struct gbridge_prot_ma_send {
+    bool busy;
+    unsigned char cmd;  // Request to reply to
+    unsigned char conn;
+    struct mobile_addr addr;
+    unsigned size;
+    unsigned sent;
+    unsigned char buf[0x200];
+};
+
+// Connections made on behalf of one adapter
+struct gbridge_prot_ma {
+    struct gbridge *bridge;
+    unsigned char data_buf[GBRIDGE_MAX_DATA_SIZE];
+    struct gbridge_data data;
+    struct socket_impl socket;
+    struct gbridge_prot_ma_push pushes[MOBILE_MAX_CONNECTIONS];
+    struct gbridge_prot_ma_send send;
+};
+
+void gbridge_prot_ma_init(struct gbridge_prot_ma *state, struct gbridge *bridge);
+void gbridge_prot_ma_reset(struct gbridge_prot_ma *state);
+void gbridge_prot_ma_loop(struct gbridge_prot_ma *state);
@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "link.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libserialport.h>
+
+#if defined(__unix__)
+#include <sys/un.h>
+#endif
+
+#include "link_fault.h"
+#include "link_tty.h"
+#include "socket.h"
+#include "timer.h"
+
+// Timeouts of 0 mean waiting forever, like libserialport does
+
+#if defined(MSG_NOSIGNAL)
+#define LINK_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define LINK_SEND_FLAGS 0
+#endif
+
+void link_serial(struct link *link, struct sp_port *port)
+{
+    *link = (struct link){.type = LINK_SERIAL, .port = port, .sock = -1,
+        .tty = -1};
+    link_fault_init(&link->fault);
+}
+
+#if defined(__unix__)
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        socket_perror("socket");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        socket_perror("connect");
+        socket_close(sock);
+        return -1;
+    }
+    return sock;
+}
+#endif
+
+// Connect to an adapter listening on a socket
+// The address is either "tcp:host:port" or "unix:path".
+bool link_connect(struct link *link, const char *address)
+{
+    int sock = -1;
+    if (strncmp(address, "tcp:", 4) == 0) {
+        char host[0x100];
+        const char *port = strrchr(address + 4, ':');
+        if (!port || (size_t)(port - (address + 4)) >= sizeof(host)) {
+            fprintf(stderr, "Invalid address: %s\n", address);
+            return false;
+        }
+        memcpy(host, address + 4, port - (address + 4));
+        host[port - (address + 4)] = '\0';
+
+        sock = socket_connect(host, port + 1);
+        if (sock == -1) {
+            fprintf(stderr, "Could not connect to %s: ", address);
+            socket_perror(NULL);
+            return false;
+        }
+
+        // Frames are small, and every one of them is waited on
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                (char *)&(int){1}, sizeof(int)) == -1) {
+            socket_perror("setsockopt");
+        }
+#if defined(__unix__)
+    } else if (strncmp(address, "unix:", 5) == 0) {
+        sock = connect_unix(address + 5);
+        if (sock == -1) return false;
+#endif
+    } else {
+        fprintf(stderr, "Invalid address: %s\n", address);
+        return false;
+    }
+
+    if (socket_setblocking(sock, 0) == -1) {
+        socket_close(sock);
+        return false;
+    }
+    *link = (struct link){.type = LINK_SOCKET, .sock = sock, .tty = -1};
+    link_fault_init(&link->fault);
+    return true;
+}
+
+void link_close(struct link *link)
+{
+    if (link->type == LINK_SERIAL) {
+        sp_close(link->port);
+        sp_free_port(link->port);
+    } else if (link->type == LINK_TTY) {
+        link_tty_close(link);
+    } else {
+        socket_close(link->sock);
+    }
+}
+
+// File descriptor to wait on, or -1 if there's none
+int link_fd(struct link *link)
+{
+    if (link->type == LINK_SOCKET) return link->sock;
+    if (link->type == LINK_TTY) return link->tty;
+
+    int fd = -1;
+#if defined(__unix__)
+    if (sp_get_port_handle(link->port, &fd) != SP_OK) fd = -1;
+#endif
+    return fd;
+}
+
+// Time left until a timeout runs out, 0 if it has, or -1 if there's none
+static int time_left(uint32_t start, unsigned timeout_ms)
+{
+    if (!timeout_ms) return -1;
+    uint32_t elapsed = (timer_get() - start) / 1000;
+    if (elapsed >= timeout_ms) return 0;
+    return timeout_ms - elapsed;
+}
+
+// Read whatever is available on the socket, waiting for at least one byte
+static int sock_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+    int sock = link->sock;
+    uint32_t start = timer_get();
+    for (;;) {
+        int left = time_left(start, timeout_ms);
+        if (left == 0) return 0;
+
+        // Wait in steps, in case waiting forever isn't possible
+        int rc = socket_hasdata(sock, left < 0 || left > 1000 ? 1000 : left);
+        if (rc < 0) return -1;
+        if (rc > 0) break;
+    }
+
+    int len = recv(sock, buf, count, 0);
+    if (len == -1) {
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) return 0;
+        socket_perror("recv");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "link: connection closed\n");
+        link->closed = true;
+        return -1;
+    }
+    return len;
+}
+
+// Read as many bytes as are available, waiting for at least one
+static int raw_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+    if (link->type == LINK_SERIAL) {
+        return sp_blocking_read_next(link->port, buf, count, timeout_ms);
+    }
+    if (link->type == LINK_TTY) {
+        return link_tty_read_next(link, buf, count, timeout_ms);
+    }
+    return sock_read_next(link, buf, count, timeout_ms);
+}
+
+// Read the requested amount of bytes, unless the timeout runs out first
+static int raw_read(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+    if (link->type == LINK_SERIAL) {
+        return sp_blocking_read(link->port, buf, count, timeout_ms);
+    }
+
+    uint32_t start = timer_get();
+    size_t size = 0;
+    while (size < count) {
+        int left = time_left(start, timeout_ms);
+        if (left == 0) break;
+
+        int rc = raw_read_next(link, (char *)buf + size, count - size,
+            left < 0 ? 0 : left);
+        if (rc < 0) return rc;
+        size += rc;
+    }
+    return size;
+}
+
+// Read whatever is available, without waiting
+static int raw_read_nonblocking(struct link *link, void *buf, size_t count)
+{
+    if (link->type == LINK_SERIAL) {
+        return sp_nonblocking_read(link->port, buf, count);
+    }
+    if (link->type == LINK_TTY) {
+        return link_tty_read_nonblocking(link, buf, count);
+    }
+
+    int len = recv(link->sock, buf, count, 0);
+    if (len == -1) {
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) return 0;
+        socket_perror("recv");
+        return -1;
+    }
+    if (len == 0) {
+        fprintf(stderr, "link: connection closed\n");
+        link->closed = true;
+        return -1;
+    }
+    return len;
+}
+
+static int raw_write(struct link *link, const void *buf, size_t count)
+{
+    if (link->type == LINK_SERIAL) {
+        return sp_blocking_write(link->port, buf, count, 0);
+    }
+    if (link->type == LINK_TTY) return link_tty_write(link, buf, count);
+
+    size_t size = 0;
+    while (size < count) {
+        int len = send(link->sock, (const char *)buf + size, count - size,
+            LINK_SEND_FLAGS);
+        if (len == -1) {
+            if (socket_geterror() != SOCKET_EWOULDBLOCK) {
+                socket_perror("send");
+                link->closed = true;
+                return -1;
+            }
+            if (socket_isconnected(link->sock, 1000) < 0) {
+                socket_perror("send");
+                return -1;
+            }
+            continue;
+        }
+        size += len;
+    }
+    return size;
+}
+
+// Write as many bytes as can be written without waiting
+static int raw_write_nonblocking(struct link *link, const void *buf, size_t count)
+{
+    if (link->type == LINK_SERIAL) {
+        return sp_nonblocking_write(link->port, buf, count);
+    }
+    if (link->type == LINK_TTY) {
+        return link_tty_write_nonblocking(link, buf, count);
+    }
+
+    int len = send(link->sock, buf, count, LINK_SEND_FLAGS);
+    if (len == -1) {
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) return 0;
+        socket_perror("send");
+        return -1;
+    }
+    return len;
+}
+
+// Read through the fault injection, which keeps the input it has broken
+// Unless asked to read everything, this returns once anything's been read.
+//   Without waiting, only what has arrived is read.
+static int fault_read(struct link *link, void *buf, size_t count, unsigned timeout_ms, bool all, bool wait)
+{
+    struct link_fault *fault = &link->fault;
+    uint32_t start = timer_get();
+    size_t size = 0;
+    for (;;) {
+        size += link_fault_read(fault, (unsigned char *)buf + size,
+            count - size);
+        if (size == count || (size && !all)) return size;
+
+        unsigned char in[0x100];
+        int rc;
+        if (wait) {
+            int left = time_left(start, timeout_ms);
+            if (left == 0) return size;
+
+            // While stalled, keep taking in whatever arrives
+            int stall = link_fault_in_wait(fault);
+            unsigned wait_ms = left < 0 ? 0 : left;
+            if (stall > 0 && (!wait_ms || (unsigned)stall < wait_ms)) {
+                wait_ms = stall;
+            }
+            rc = raw_read_next(link, in, sizeof(in), wait_ms);
+        } else {
+            rc = raw_read_nonblocking(link, in, sizeof(in));
+        }
+        if (rc < 0) return rc;
+        link_fault_in(fault, in, rc);
+        if (!wait) {
+            return size + link_fault_read(fault, (unsigned char *)buf + size,
+                count - size);
+        }
+    }
+}
+
+// Write through the fault injection
+// What gets through is always written out as a whole, so the data given is
+//   either taken or not. Without waiting, nothing is taken while stalled.
+static int fault_write(struct link *link, const void *buf, size_t count, bool wait)
+{
+    struct link_fault *fault = &link->fault;
+    size_t size = 0;
+    while (size < count) {
+        unsigned stall = link_fault_out_wait(fault);
+        if (stall) {
+            if (!wait) break;
+            timer_sleep(stall * 1000);
+            continue;
+        }
+
+        unsigned char out[0x200];
+        unsigned used;
+        unsigned part = count - size;
+        if (part > sizeof(out) / 2) part = sizeof(out) / 2;
+        unsigned len = link_fault_out(fault, (const unsigned char *)buf + size,
+            part, out, &used);
+        if (len && raw_write(link, out, len) < 0) return -1;
+        size += used;
+    }
+    return size;
+}
+
+// Everything goes through the fault injection, when it's enabled
+int link_read(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+    if (link->fault.enabled) {
+        return fault_read(link, buf, count, timeout_ms, true, true);
+    }
+    return raw_read(link, buf, count, timeout_ms);
+}
+
+int link_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+    if (link->fault.enabled) {
+        return fault_read(link, buf, count, timeout_ms, false, true);
+    }
+    return raw_read_next(link, buf, count, timeout_ms);
+}
+
+int link_read_nonblocking(struct link *link, void *buf, size_t count)
+{
+    if (link->fault.enabled) return fault_read(link, buf, count, 0, false, false);
+    return raw_read_nonblocking(link, buf, count);
+}
+
+int link_write(struct link *link, const void *buf, size_t count)
+{
+    if (link->fault.enabled) return fault_write(link, buf, count, true);
+    return raw_write(link, buf, count);
+}
+
+int link_write_nonblocking(struct link *link, const void *buf, size_t count)
+{
+    if (link->fault.enabled) return fault_write(link, buf, count, false);
+    return raw_write_nonblocking(link, buf, count);
+}
+
+// Time until input that has already been read is available, in ms, or -1 if
+//   there's none, as the port won't tell when it is
+int link_buffered(struct link *link)
+{
+    if (!link->fault.enabled) return -1;
+    return link_fault_in_wait(&link->fault);
+}
+
+// Time until output may be written again, in ms, or 0 if it may be now
+unsigned link_stalled(struct link *link)
+{
+    if (!link->fault.enabled) return 0;
+    return link_fault_out_wait(&link->fault);
+}
+
+// Wait until everything that's been written has been transmitted
+void link_drain(struct link *link)
+{
+    if (link->type == LINK_SERIAL) sp_drain(link->port);
+    if (link->type == LINK_TTY) link_tty_drain(link);
+}
+
+// Sockets have no baud rate, so it's always changed successfully
+bool link_set_baudrate(struct link *link, unsigned long baudrate)
+{
+    if (link->type == LINK_TTY) return link_tty_set_baudrate(link, baudrate);
+    if (link->type != LINK_SERIAL) return true;
+    return sp_set_baudrate(link->port, baudrate) == SP_OK;
+}
+
+// Sockets have flow control of their own, so it's always enabled
+bool link_set_rtscts(struct link *link, bool enable)
+{
+    if (link->type == LINK_TTY) return link_tty_set_rtscts(link, enable);
+    if (link->type != LINK_SERIAL) return true;
+    return sp_set_flowcontrol(link->port,
+        enable ? SP_FLOWCONTROL_RTSCTS : SP_FLOWCONTROL_NONE) == SP_OK;
+}
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct sp_port;
+
+// Connection to the adapter, over a serial port or a stream socket
+// Sockets let emulators and host-side adapters connect without a UART.
+//   Serial ports may also be used as terminals directly, without
+//   libserialport, on Linux.
+enum link_type {
+    LINK_SERIAL,
+    LINK_SOCKET,
+    LINK_TTY,
+};
+
+enum link_fault_kind {
+    LINK_FAULT_NONE,
+    LINK_FAULT_FLIP,  // A bit of the byte is flipped
+    LINK_FAULT_DROP,  // The byte goes missing
+    LINK_FAULT_DUP,  // The byte arrives twice
+    LINK_FAULT_STALL,  // The line goes quiet for a while, from the byte on
+    LINK_FAULT_KINDS
+};
+
+// Faults injected into the data going through a link, see link_fault.c
+#define LINK_FAULT_BUF_SIZE 0x1000
+struct link_fault {
+    bool enabled;
+    uint32_t random;
+
+    // Input with the faults in it, held back while it's stalled
+    unsigned char in_buf[LINK_FAULT_BUF_SIZE];
+    unsigned in_pos;
+    unsigned in_size;
+    bool in_stalled;
+    uint32_t in_stall_end;
+    bool out_stalled;
+    uint32_t out_stall_end;
+
+    unsigned counts[LINK_FAULT_KINDS];
+    unsigned overruns;  // Bytes lost because they arrived during a stall
+    unsigned unseen;  // Faults since link_fault_take() was last called
+    uint32_t unseen_time;  // Time the first of them was injected
+};
+
+struct link {
+    enum link_type type;
+    struct sp_port *port;
+    int sock;
+    int tty;
+    bool closed;  // The socket has been closed by the other side
+    struct link_fault fault;
+};
+
+void link_serial(struct link *link, struct sp_port *port);
+bool link_connect(struct link *link, const char *address);
+bool link_tty(struct link *link, const char *name, unsigned long baudrate);
+void link_close(struct link *link);
+int link_fd(struct link *link);
+int link_read(struct link *link, void *buf, size_t count, unsigned timeout_ms);
+int link_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms);
+int link_read_nonblocking(struct link *link, void *buf, size_t count);
+int link_write(struct link *link, const void *buf, size_t count);
+int link_write_nonblocking(struct link *link, const void *buf, size_t count);
+void link_drain(struct link *link);
+int link_buffered(struct link *link);
+unsigned link_stalled(struct link *link);
+bool link_set_baudrate(struct link *link, unsigned long baudrate);
+bool link_set_rtscts(struct link *link, bool enable);
@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "link_fault.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+// Fault injection, breaking the data going through a link the way a bad
+//   serial line would, to find out how well the protocol recovers.
+// Every byte may get a bit flipped, go missing, arrive twice, or make the
+//   line go quiet for a while, at the configured rates. Faults go both ways,
+//   unless only one direction is asked for.
+
+#define DIR_IN 0x01  // From the adapter
+#define DIR_OUT 0x02  // To the adapter
+
+struct link_fault_config {
+    double rates[LINK_FAULT_KINDS];  // Percentage of bytes hit by each fault
+    unsigned stall_ms;  // Time the line goes quiet for
+    unsigned dirs;
+    uint32_t seed;  // Start of the random sequence, to repeat a run
+};
+
+static const char *const names[LINK_FAULT_KINDS] = {
+    [LINK_FAULT_FLIP] = "flip",
+    [LINK_FAULT_DROP] = "drop",
+    [LINK_FAULT_DUP] = "dup",
+    [LINK_FAULT_STALL] = "stall",
+};
+
+static bool enabled;
+static struct link_fault_config config = {
+    .stall_ms = 100,
+    .dirs = DIR_IN | DIR_OUT,
+    .seed = 1,
+};
+
+static bool configure_rate(const char *name, const char *value)
+{
+    for (unsigned i = 0; i < LINK_FAULT_KINDS; i++) {
+        if (!names[i] || strcmp(name, names[i]) != 0) continue;
+
+        char *end;
+        double num = strtod(value, &end);
+        if (!*value || *end || num < 0 || num > 100) {
+            fprintf(stderr, "faults: invalid value: %s\n", value);
+            return false;
+        }
+        config.rates[i] = num;
+        return true;
+    }
+    fprintf(stderr, "faults: invalid setting: %s\n", name);
+    return false;
+}
+
+// Read the settings from a comma-separated list of name=value pairs, and
+//   enable fault injection on every link
+// Has to happen before any adapter is served, as it's shared by all of them.
+bool link_fault_configure(const char *spec)
+{
+    char buf[0x100];
+    if (strlen(spec) >= sizeof(buf)) return false;
+    strcpy(buf, spec);
+
+    for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        if (strcmp(item, "on") == 0) continue;
+
+        char *value = strchr(item, '=');
+        if (!value) {
+            fprintf(stderr, "faults: missing value: %s\n", item);
+            return false;
+        }
+        *value++ = '\0';
+
+        if (strcmp(item, "dir") == 0) {
+            if (strcmp(value, "in") == 0) {
+                config.dirs = DIR_IN;
+            } else if (strcmp(value, "out") == 0) {
+                config.dirs = DIR_OUT;
+            } else if (strcmp(value, "both") == 0) {
+                config.dirs = DIR_IN | DIR_OUT;
+            } else {
+                fprintf(stderr, "faults: invalid value: %s\n", value);
+                return false;
+            }
+            continue;
+        }
+        if (strcmp(item, "stall_ms") != 0 && strcmp(item, "seed") != 0) {
+            if (!configure_rate(item, value)) return false;
+            continue;
+        }
+
+        char *end;
+        unsigned long num = strtoul(value, &end, 0);
+        if (!*value || *end) {
+            fprintf(stderr, "faults: invalid value: %s\n", value);
+            return false;
+        }
+        if (strcmp(item, "stall_ms") == 0) {
+            config.stall_ms = num;
+        } else if (num) {
+            config.seed = num;
+        } else {
+            fprintf(stderr, "faults: invalid setting: %s\n", item);
+            return false;
+        }
+    }
+    enabled = true;
+    return true;
+}
+
+bool link_fault_enabled(void)
+{
+    return enabled;
+}
+
+void link_fault_init(struct link_fault *fault)
+{
+    *fault = (struct link_fault){
+        .enabled = enabled,
+        // Spread out, so that small seeds don't start off with small numbers
+        .random = config.seed * 0x9E3779B9,
+    };
+}
+
+// Xorshift, good enough to pick faults, and repeatable
+static uint32_t random_next(struct link_fault *fault)
+{
+    uint32_t x = fault->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    fault->random = x;
+    return x;
+}
+
+// Decide what happens to the next byte going one way
+// Stalls start right away, and every other fault has to be applied by the
+//   caller.
+enum link_fault_kind link_fault_pick(struct link_fault *fault, bool out)
+{
+    if (!(config.dirs & (out ? DIR_OUT : DIR_IN))) return LINK_FAULT_NONE;
+
+    double roll = random_next(fault) * (100.0 / 4294967296.0);
+    enum link_fault_kind kind = LINK_FAULT_NONE;
+    for (unsigned i = 0; i < LINK_FAULT_KINDS; i++) {
+        if (roll < config.rates[i]) {
+            kind = i;
+            break;
+        }
+        roll -= config.rates[i];
+    }
+    if (kind == LINK_FAULT_NONE) return kind;
+
+    if (kind == LINK_FAULT_STALL) {
+        uint32_t end = timer_get() + config.stall_ms * 1000;
+        if (out) {
+            fault->out_stalled = true;
+            fault->out_stall_end = end;
+        } else {
+            fault->in_stalled = true;
+            fault->in_stall_end = end;
+        }
+    }
+    fault->counts[kind]++;
+    if (!fault->unseen++) fault->unseen_time = timer_get();
+    return kind;
+}
+
+unsigned char link_fault_flip(struct link_fault *fault, unsigned char c)
+{
+    return c ^ (1 << (random_next(fault) % 8));
+}
+
+static void in_put(struct link_fault *fault, unsigned char c)
+{
+    if (fault->in_size == sizeof(fault->in_buf)) {
+        if (!fault->in_pos) {
+            fault->overruns++;
+            return;
+        }
+        memmove(fault->in_buf, fault->in_buf + fault->in_pos,
+            fault->in_size - fault->in_pos);
+        fault->in_size -= fault->in_pos;
+        fault->in_pos = 0;
+    }
+    fault->in_buf[fault->in_size++] = c;
+}
+
+// Take in bytes received from the adapter, breaking some of them
+// Whatever doesn't fit while the input is stalled is lost.
+void link_fault_in(struct link_fault *fault, const unsigned char *data, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++) {
+        unsigned char c = data[i];
+        switch (link_fault_pick(fault, false)) {
+        case LINK_FAULT_FLIP: in_put(fault, link_fault_flip(fault, c)); break;
+        case LINK_FAULT_DROP: break;
+        case LINK_FAULT_DUP: in_put(fault, c); in_put(fault, c); break;
+        default: in_put(fault, c); break;
+        }
+    }
+}
+
+// Time until the input is readable, in ms, or -1 if there's none
+int link_fault_in_wait(struct link_fault *fault)
+{
+    if (fault->in_stalled) {
+        int32_t left = fault->in_stall_end - timer_get();
+        if (left > 0) return (left + 999) / 1000;
+        fault->in_stalled = false;
+    }
+    if (fault->in_pos == fault->in_size) return -1;
+    return 0;
+}
+
+// Hand out the input, unless it's stalled
+unsigned link_fault_read(struct link_fault *fault, unsigned char *buf, unsigned count)
+{
+    if (link_fault_in_wait(fault) != 0) return 0;
+
+    unsigned size = fault->in_size - fault->in_pos;
+    if (size > count) size = count;
+    memcpy(buf, fault->in_buf + fault->in_pos, size);
+    fault->in_pos += size;
+    if (fault->in_pos == fault->in_size) {
+        fault->in_pos = 0;
+        fault->in_size = 0;
+    }
+    return size;
+}
+
+// Break some of the bytes about to be sent to the adapter
+// The output has to have room for twice the input. Only the input up to a
+//   stall is used, and the rest has to wait until it's over.
+unsigned link_fault_out(struct link_fault *fault, const unsigned char *data, unsigned size, unsigned char *out, unsigned *used)
+{
+    unsigned len = 0;
+    unsigned i = 0;
+    while (i < size && !link_fault_out_wait(fault)) {
+        unsigned char c = data[i++];
+        switch (link_fault_pick(fault, true)) {
+        case LINK_FAULT_FLIP: out[len++] = link_fault_flip(fault, c); break;
+        case LINK_FAULT_DROP: break;
+        case LINK_FAULT_DUP: out[len++] = c; out[len++] = c; break;
+        case LINK_FAULT_STALL: i--; break;
+        default: out[len++] = c; break;
+        }
+    }
+    *used = i;
+    return len;
+}
+
+// Time until output may be sent again, in ms, or 0 if it isn't stalled
+unsigned link_fault_out_wait(struct link_fault *fault)
+{
+    if (!fault->out_stalled) return 0;
+    int32_t left = fault->out_stall_end - timer_get();
+    if (left > 0) return (left + 999) / 1000;
+    fault->out_stalled = false;
+    return 0;
+}
+
+// Take note of the faults injected since the last time
+// Returns the amount of them, along with the time the first one was injected.
+unsigned link_fault_take(struct link_fault *fault, uint32_t *time)
+{
+    unsigned unseen = fault->unseen;
+    *time = fault->unseen_time;
+    fault->unseen = 0;
+    return unseen;
+}
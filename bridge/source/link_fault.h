@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#include "link.h"
+
+bool link_fault_configure(const char *spec);
+bool link_fault_enabled(void);
+
+void link_fault_init(struct link_fault *fault);
+enum link_fault_kind link_fault_pick(struct link_fault *fault, bool out);
+unsigned char link_fault_flip(struct link_fault *fault, unsigned char c);
+void link_fault_in(struct link_fault *fault, const unsigned char *data, unsigned size);
+unsigned link_fault_read(struct link_fault *fault, unsigned char *buf, unsigned count);
+int link_fault_in_wait(struct link_fault *fault);
+unsigned link_fault_out(struct link_fault *fault, const unsigned char *data, unsigned size, unsigned char *out, unsigned *used);
+unsigned link_fault_out_wait(struct link_fault *fault);
+unsigned link_fault_take(struct link_fault *fault, uint32_t *time);
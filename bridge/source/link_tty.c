@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "link_tty.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif
+
+#include "link_fault.h"
+#include "timer.h"
+
+// Serial ports used as terminals directly, without libserialport
+// The terminal is made raw, and never blocks. Reads return whatever has
+//   arrived, as much of a frame as there is, and waiting for more is done
+//   through poll(), or by the reactor. VMIN and VTIME are both left at 0, as
+//   the timeouts are in milliseconds, where VTIME counts tenths of a second.
+
+// Ask the driver to pass received bytes along right away
+// USB-serial adapters otherwise tend to hold on to them for several
+//   milliseconds, which adds up on every round trip. Not every driver
+//   supports this, so failing is fine.
+void link_tty_low_latency(int fd)
+{
+#if defined(__linux__)
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == -1) return;
+    if (serial.flags & ASYNC_LOW_LATENCY) return;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &serial);
+#else
+    (void)fd;
+#endif
+}
+
+#if defined(__linux__)
+// Terminal speed for a baud rate, or B0 if it isn't supported
+static speed_t tty_speed(unsigned long baudrate)
+{
+    switch (baudrate) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 1500000: return B1500000;
+    case 2000000: return B2000000;
+    default: return B0;
+    }
+}
+
+static bool tty_set_speed(struct termios *tio, unsigned long baudrate)
+{
+    speed_t speed = tty_speed(baudrate);
+    if (speed == B0) {
+        fprintf(stderr, "link: unsupported baud rate: %lu\n", baudrate);
+        return false;
+    }
+    cfsetispeed(tio, speed);
+    cfsetospeed(tio, speed);
+    return true;
+}
+
+// Wait until the terminal is readable or writable, or the timeout runs out,
+//   -1 meaning no timeout
+// Returns 1 if it is, 0 if it isn't, or -1 if waiting failed.
+static int tty_poll(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = fd, .events = events};
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc == -1) {
+        if (errno == EINTR) return 0;
+        perror("poll");
+        return -1;
+    }
+    return rc > 0;
+}
+#endif
+
+// Open a serial port as a raw terminal, with 8 data bits, no parity, one
+//   stop bit and no flow control
+bool link_tty(struct link *link, const char *name, unsigned long baudrate)
+{
+#if defined(__linux__)
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", name, strerror(errno));
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == -1) {
+        perror("tcgetattr");
+        close(fd);
+        return false;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (!tty_set_speed(&tio, baudrate)) {
+        close(fd);
+        return false;
+    }
+    if (tcsetattr(fd, TCSANOW, &tio) == -1) {
+        perror("tcsetattr");
+        close(fd);
+        return false;
+    }
+    tcflush(fd, TCIOFLUSH);
+    link_tty_low_latency(fd);
+
+    *link = (struct link){.type = LINK_TTY, .sock = -1, .tty = fd};
+    link_fault_init(&link->fault);
+    return true;
+#else
+    (void)link;
+    (void)baudrate;
+    fprintf(stderr, "Could not open %s: raw terminals are only supported on "
+        "Linux\n", name);
+    return false;
+#endif
+}
+
+void link_tty_close(struct link *link)
+{
+#if defined(__linux__)
+    close(link->tty);
+#else
+    (void)link;
+#endif
+}
+
+// Read whatever has arrived, without waiting
+int link_tty_read_nonblocking(struct link *link, void *buf, size_t count)
+{
+#if defined(__linux__)
+    int len = read(link->tty, buf, count);
+    if (len >= 0) return len;
+    if (errno == EAGAIN || errno == EINTR) return 0;
+
+    // The other side of a pseudo-terminal going away looks like this too
+    perror("link: read");
+    link->closed = true;
+    return -1;
+#else
+    (void)link; (void)buf; (void)count;
+    return -1;
+#endif
+}
+
+// Read whatever has arrived, waiting for at least one byte
+int link_tty_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms)
+{
+#if defined(__linux__)
+    uint32_t start = timer_get();
+    for (;;) {
+        int len = link_tty_read_nonblocking(link, buf, count);
+        if (len) return len;
+
+        int left = -1;
+        if (timeout_ms) {
+            uint32_t elapsed = (timer_get() - start) / 1000;
+            if (elapsed >= timeout_ms) return 0;
+            left = timeout_ms - elapsed;
+        }
+        if (tty_poll(link->tty, POLLIN, left) < 0) return -1;
+    }
+#else
+    (void)link; (void)buf; (void)count; (void)timeout_ms;
+    return -1;
+#endif
+}
+
+// Write as many bytes as can be written without waiting
+int link_tty_write_nonblocking(struct link *link, const void *buf, size_t count)
+{
+#if defined(__linux__)
+    int len = write(link->tty, buf, count);
+    if (len >= 0) return len;
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    perror("link: write");
+    link->closed = true;
+    return -1;
+#else
+    (void)link; (void)buf; (void)count;
+    return -1;
+#endif
+}
+
+// Write everything, waiting for the port to take it
+int link_tty_write(struct link *link, const void *buf, size_t count)
+{
+#if defined(__linux__)
+    size_t size = 0;
+    while (size < count) {
+        int len = link_tty_write_nonblocking(link, (const char *)buf + size,
+            count - size);
+        if (len < 0) return -1;
+        if (!len && tty_poll(link->tty, POLLOUT, -1) < 0) return -1;
+        size += len;
+    }
+    return size;
+#else
+    (void)link; (void)buf; (void)count;
+    return -1;
+#endif
+}
+
+void link_tty_drain(struct link *link)
+{
+#if defined(__linux__)
+    tcdrain(link->tty);
+#else
+    (void)link;
+#endif
+}
+
+bool link_tty_set_baudrate(struct link *link, unsigned long baudrate)
+{
+#if defined(__linux__)
+    struct termios tio;
+    if (tcgetattr(link->tty, &tio) == -1) return false;
+    if (!tty_set_speed(&tio, baudrate)) return false;
+    return tcsetattr(link->tty, TCSANOW, &tio) == 0;
+#else
+    (void)link; (void)baudrate;
+    return false;
+#endif
+}
+
+bool link_tty_set_rtscts(struct link *link, bool enable)
+{
+#if defined(__linux__)
+    struct termios tio;
+    if (tcgetattr(link->tty, &tio) == -1) return false;
+    if (enable) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_cflag &= ~CRTSCTS;
+    }
+    return tcsetattr(link->tty, TCSANOW, &tio) == 0;
+#else
+    (void)link; (void)enable;
+    return false;
+#endif
+}
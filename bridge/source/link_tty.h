@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "link.h"
+
+void link_tty_low_latency(int fd);
+void link_tty_close(struct link *link);
+int link_tty_read_next(struct link *link, void *buf, size_t count, unsigned timeout_ms);
+int link_tty_read_nonblocking(struct link *link, void *buf, size_t count);
+int link_tty_write(struct link *link, const void *buf, size_t count);
+int link_tty_write_nonblocking(struct link *link, const void *buf, size_t count);
+void link_tty_drain(struct link *link);
+bool link_tty_set_baudrate(struct link *link, unsigned long baudrate);
+bool link_tty_set_rtscts(struct link *link, bool enable);
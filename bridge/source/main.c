@@ -2,15 +2,30 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <locale.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <libserialport.h>
 
 #include "socket.h"
 #include "gbridge.h"
+#include "gbridge_cmd.h"
 #include "gbridge_prot_ma.h"
+#include "link.h"
+#include "link_fault.h"
+#include "link_tty.h"
+#include "reactor.h"
+#include "socket_loop.h"
+#include "socket_shape.h"
+#include "uring.h"
 
 const char *program_name;
 
+// Open serial ports as terminals directly, instead of through libserialport
+bool serial_raw;
+
 void program_error(const char *fmt, ...)
 {
     va_list ap;
@@ -67,6 +82,18 @@ struct sp_port *serial_guess_port(void)
     return res;
 }
 
+// Ask the driver to pass received bytes along right away, see link_tty.c
+void serial_low_latency(struct sp_port *port)
+{
+#if defined(__linux__)
+    int fd;
+    if (sp_get_port_handle(port, &fd) != SP_OK) return;
+    link_tty_low_latency(fd);
+#else
+    (void)port;
+#endif
+}
+
 int serial_open(struct sp_port *port)
 {
     // Open a port with default settings
@@ -75,17 +102,307 @@ int serial_open(struct sp_port *port)
         serial_error(rc, "sp_open failed");
         return -1;
     }
-    if (sp_set_baudrate(port, 500000) != SP_OK) return -1;
+    if (sp_set_baudrate(port, GBRIDGE_BAUD) != SP_OK) return -1;
     if (sp_set_bits(port, 8) != SP_OK) return -1;
     if (sp_set_parity(port, SP_PARITY_NONE) != SP_OK) return -1;
     if (sp_set_stopbits(port, 1) != SP_OK) return -1;
     if (sp_set_flowcontrol(port, SP_FLOWCONTROL_NONE) != SP_OK) return -1;
+    serial_low_latency(port);
     return 0;
 }
 
+// Open the link to an adapter, through a socket or a serial port
+bool adapter_open(struct link *link, const char *name)
+{
+    // Adapters may also be reached through a socket, instead of a serial port
+    if (strncmp(name, "tcp:", 4) == 0 || strncmp(name, "unix:", 5) == 0) {
+        if (!link_connect(link, name)) {
+            program_error("Can't connect to adapter: '%s'", name);
+            return false;
+        }
+        return true;
+    }
+
+    if (serial_raw) {
+        if (!link_tty(link, name, GBRIDGE_BAUD)) {
+            program_error("Can't open serial port: '%s'", name);
+            return false;
+        }
+        return true;
+    }
+
+    struct sp_port *port;
+    if (sp_get_port_by_name(name, &port) != SP_OK) {
+        program_error("Can't get serial port: '%s'", name);
+        return false;
+    }
+    if (serial_open(port) != 0) {
+        program_error("serial_open failed: '%s'", name);
+        sp_free_port(port);
+        return false;
+    }
+    link_serial(link, port);
+    return true;
+}
+
+// Serve a single adapter, until it disconnects
+int run_single(const char *name)
+{
+    char *guessed = NULL;
+    if (!name) {
+        struct sp_port *port = serial_guess_port();
+        if (!port) return EXIT_FAILURE;
+        name = guessed = strdup(sp_get_port_name(port));
+        sp_free_port(port);
+    }
+
+    struct link link;
+    bool opened = adapter_open(&link, name);
+    if (opened) {
+        printf("Selected %s: %s\n",
+            link.type == LINK_SOCKET ? "socket" : "port", name);
+    }
+    free(guessed);
+    if (!opened) return EXIT_FAILURE;
+
+    // Without the reactor, the sockets are polled instead
+    if (!reactor_init()) fprintf(stderr, "Waiting on sockets unavailable\n");
+
+    static struct gbridge bridge;
+    static struct gbridge_prot_ma prot_ma;
+    gbridge_init(&bridge, &link);
+    gbridge_prot_ma_init(&prot_ma, &bridge);
+    while (!gbridge_handshake(&bridge)) {
+        if (link.closed) return EXIT_FAILURE;
+    }
+    printf("Connected!\n");
+
+    while (gbridge_connected(&bridge)) {
+        gbridge_wait(&bridge);
+        gbridge_loop(&bridge);
+        gbridge_prot_ma_loop(&prot_ma);
+    }
+
+    link_close(&link);
+    return EXIT_SUCCESS;
+}
+
+// Adapters a worker can wait on at once, with every connection it may open
+#define WORKER_MAX_ADAPTERS \
+    (REACTOR_MAX_FDS / (1 + 2 * MOBILE_MAX_CONNECTIONS))
+
+// Adapter served in hub mode
+// Adapters that disconnect are connected to again, until their link closes.
+struct adapter {
+    char *name;
+    struct link link;
+    struct gbridge bridge;
+    struct gbridge_prot_ma prot_ma;
+    bool closed;
+};
+
+// Thread serving some of the adapters, all of them waited on at once
+struct worker {
+    pthread_t thread;
+    struct adapter **adapters;
+    unsigned count;
+};
+
+void adapter_close(struct adapter *adapter)
+{
+    gbridge_prot_ma_reset(&adapter->prot_ma);
+    reactor_forget(link_fd(&adapter->link));
+    link_close(&adapter->link);
+    adapter->closed = true;
+    printf("%s: Closed\n", adapter->name);
+}
+
+void adapter_step(struct adapter *adapter)
+{
+    if (!gbridge_connected(&adapter->bridge)) {
+        if (gbridge_handshake(&adapter->bridge)) {
+            printf("%s: Connected!\n", adapter->name);
+        } else if (adapter->link.closed) {
+            adapter_close(adapter);
+        }
+        return;
+    }
+
+    gbridge_loop(&adapter->bridge);
+    gbridge_prot_ma_loop(&adapter->prot_ma);
+    if (gbridge_connected(&adapter->bridge)) return;
+
+    // Whatever the adapter had open is gone along with the link
+    printf("%s: Disconnected\n", adapter->name);
+    gbridge_prot_ma_reset(&adapter->prot_ma);
+    if (adapter->link.closed) adapter_close(adapter);
+}
+
+void *worker_run(void *arg)
+{
+    struct worker *worker = arg;
+
+    // Without the reactor, every adapter is polled in turn instead
+    if (!reactor_init()) fprintf(stderr, "Waiting on sockets unavailable\n");
+
+    unsigned active = worker->count;
+    while (active) {
+        int timeout = -1;
+        for (unsigned i = 0; i < worker->count; i++) {
+            struct adapter *adapter = worker->adapters[i];
+            if (adapter->closed) continue;
+            if (!gbridge_wait_prepare(&adapter->bridge, &timeout)) {
+                timeout = 0;
+            }
+        }
+        if (reactor_wait(timeout) >= 0) {
+            for (unsigned i = 0; i < worker->count; i++) {
+                struct adapter *adapter = worker->adapters[i];
+                if (adapter->closed) continue;
+                gbridge_wait_done(&adapter->bridge);
+            }
+        }
+
+        for (unsigned i = 0; i < worker->count; i++) {
+            struct adapter *adapter = worker->adapters[i];
+            if (adapter->closed) continue;
+            adapter_step(adapter);
+            if (adapter->closed) active--;
+        }
+    }
+    return NULL;
+}
+
+// Serve every adapter from a single process, spread across worker threads
+int run_hub(char **names, unsigned count, unsigned workers_count)
+{
+    struct adapter *adapters = calloc(count, sizeof(*adapters));
+    struct adapter **opened = calloc(count, sizeof(*opened));
+    if (!adapters || !opened) {
+        program_error("Out of memory");
+        return EXIT_FAILURE;
+    }
+
+    unsigned opened_count = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct adapter *adapter = &adapters[i];
+        adapter->name = names[i];
+        if (!adapter_open(&adapter->link, adapter->name)) continue;
+        gbridge_init(&adapter->bridge, &adapter->link);
+        gbridge_prot_ma_init(&adapter->prot_ma, &adapter->bridge);
+        opened[opened_count++] = adapter;
+        printf("Selected: %s\n", adapter->name);
+    }
+    if (!opened_count) {
+        program_error("No adapters to serve");
+        return EXIT_FAILURE;
+    }
+
+    if (!workers_count) workers_count = 4;
+    if (workers_count > opened_count) workers_count = opened_count;
+    if (workers_count < (opened_count + WORKER_MAX_ADAPTERS - 1) /
+            WORKER_MAX_ADAPTERS) {
+        workers_count = (opened_count + WORKER_MAX_ADAPTERS - 1) /
+            WORKER_MAX_ADAPTERS;
+    }
+
+    // Every worker gets an equal share of the adapters
+    struct worker *workers = calloc(workers_count, sizeof(*workers));
+    if (!workers) {
+        program_error("Out of memory");
+        return EXIT_FAILURE;
+    }
+    unsigned start = 0;
+    for (unsigned i = 0; i < workers_count; i++) {
+        struct worker *worker = &workers[i];
+        worker->adapters = opened + start;
+        worker->count = (opened_count - start) / (workers_count - i);
+        start += worker->count;
+    }
+
+    printf("Serving %u adapters with %u workers\n",
+        opened_count, workers_count);
+    unsigned started = 0;
+    for (unsigned i = 0; i < workers_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run,
+                &workers[i]) != 0) {
+            program_error("pthread_create failed");
+            break;
+        }
+        started++;
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    free(opened);
+    free(adapters);
+    return started == workers_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Add a port or address to the list of adapters to serve
+bool names_add(char ***names, unsigned *count, const char *name)
+{
+    char **new_names = realloc(*names, (*count + 1) * sizeof(**names));
+    if (!new_names) return false;
+    *names = new_names;
+    if (!((*names)[*count] = strdup(name))) return false;
+    (*count)++;
+    return true;
+}
+
+// Add every port or address in a file, one per line, to the list
+// Empty lines, and anything following a '#', are ignored.
+bool config_read(const char *path, char ***names, unsigned *count)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        program_error("Can't open config: '%s'", path);
+        return false;
+    }
+
+    char line[0x200];
+    while (fgets(line, sizeof(line), file)) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *name = line;
+        while (isspace((unsigned char)*name)) name++;
+        char *end = name + strlen(name);
+        while (end > name && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        if (!*name) continue;
+
+        if (!names_add(names, count, name)) break;
+    }
+    fclose(file);
+    return true;
+}
+
+// Add every serial port on the system to the list
+bool discover_ports(char ***names, unsigned *count)
+{
+    struct sp_port **ports;
+    if (sp_list_ports(&ports) != SP_OK) {
+        program_error("Can't list serial devices");
+        return false;
+    }
+    for (struct sp_port **port = ports; *port != NULL; port++) {
+        if (!names_add(names, count, sp_get_port_name(*port))) break;
+    }
+    sp_free_port_list(ports);
+    return true;
+}
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: %s [-j workers] [-c config] [-a] [-l loopback] "
+        "[-s shaping] [-f faults] [-u] [-r] [port...]\n", program_name);
+}
+
 int main(int argc, char *argv[])
 {
-    (void)argc;
     program_name = argv[0];
     setlocale(LC_ALL, "");
 
@@ -99,34 +416,45 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    struct sp_port *port;
-
-    if (argc > 1) {
-        if (sp_get_port_by_name(argv[1], &port) != SP_OK) {
-            program_error("Can't get serial port: '%s'", argv[1]);
-            return EXIT_FAILURE;
+    unsigned workers = 0;
+    const char *config = NULL;
+    bool discover = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:al:s:f:ur")) != -1) {
+        switch (opt) {
+        case 'j': workers = strtoul(optarg, NULL, 0); break;
+        case 'c': config = optarg; break;
+        case 'a': discover = true; break;
+        case 'l':
+            if (!socket_loop_configure(optarg)) return EXIT_FAILURE;
+            break;
+        case 's':
+            if (!socket_shape_configure(optarg)) return EXIT_FAILURE;
+            break;
+        case 'f':
+            if (!link_fault_configure(optarg)) return EXIT_FAILURE;
+            break;
+        case 'u': uring_enable(); break;
+        case 'r': serial_raw = true; break;
+        default: usage(); return EXIT_FAILURE;
         }
-    } else {
-        port = serial_guess_port();
-        if (!port) return EXIT_FAILURE;
     }
+    argc -= optind;
+    argv += optind;
 
-    printf("Selected port: %s\n", sp_get_port_name(port));
-    if (serial_open(port) != 0) {
-        program_error("serial_open failed");
-        return EXIT_FAILURE;
+    // A single adapter is served like it always has been
+    if (!config && !discover && argc <= 1) {
+        return run_single(argc ? argv[0] : NULL);
     }
 
-    gbridge_init();
-    gbridge_prot_ma_init();
-    while (!gbridge_handshake(port));
-    printf("Connected!\n");
-
-    while (gbridge_connected()) {
-        gbridge_loop(port);
-        gbridge_prot_ma_loop(port);
-    }
+    char **names = NULL;
+    unsigned count = 0;
+    for (int i = 0; i < argc; i++) names_add(&names, &count, argv[i]);
+    if (config && !config_read(config, &names, &count)) return EXIT_FAILURE;
+    if (discover && !discover_ports(&names, &count)) return EXIT_FAILURE;
 
-    sp_close(port);
-    sp_free_port(port);
+    int rc = run_hub(names, count, workers);
+    for (unsigned i = 0; i < count; i++) free(names[i]);
+    free(names);
+    return rc;
 }
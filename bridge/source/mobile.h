@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+// The parts of libmobile's mobile.h that the bridge shares with the adapter
+#define MOBILE_MAX_CONNECTIONS 2
+#define MOBILE_HOSTLEN_IPV4 4
+#define MOBILE_HOSTLEN_IPV6 16
+enum mobile_socktype {
+    MOBILE_SOCKTYPE_TCP,
+    MOBILE_SOCKTYPE_UDP,
+};
+enum mobile_addrtype {
+    MOBILE_ADDRTYPE_NONE,
+    MOBILE_ADDRTYPE_IPV4,
+    MOBILE_ADDRTYPE_IPV6,
+};
+struct mobile_addr4 {
+    enum mobile_addrtype type;
+    unsigned port;
+    unsigned char host[MOBILE_HOSTLEN_IPV4];
+};
+struct mobile_addr6 {
+    enum mobile_addrtype type;
+    unsigned port;
+    unsigned char host[MOBILE_HOSTLEN_IPV6];
+};
+struct mobile_addr {
+    // Make sure it's big enough to hold all types
+    union {
+        enum mobile_addrtype type;
+
+        // Don't access these directly, cast instead
+        struct mobile_addr4 _addr4;
+        struct mobile_addr6 _addr6;
+    };
+};
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "reactor.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "uring.h"
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+// Waits for the serial port and the sockets all at once, so the bridge can
+//   sleep until any of them needs attention.
+// Where epoll isn't available, reactor_wait() fails, and the caller has to
+//   poll everything instead.
+// Every thread has a reactor of its own, for the adapters it serves.
+// When io_uring is in use, the reactor sleeps on the ring instead, so the
+//   operations queued on it are submitted by the same system call.
+
+struct watch {
+    int fd;
+    unsigned events;  // Events asked for
+    unsigned ready;  // Events that happened in the last wait
+};
+static _Thread_local struct watch watches[REACTOR_MAX_FDS];
+static _Thread_local unsigned watches_count;
+static _Thread_local int timer_ms = -1;
+
+#if defined(__linux__)
+static _Thread_local int epoll_fd = -1;
+
+static uint32_t epoll_events(unsigned events)
+{
+    uint32_t res = 0;
+    if (events & REACTOR_IN) res |= EPOLLIN;
+    if (events & REACTOR_OUT) res |= EPOLLOUT;
+    return res;
+}
+#endif
+
+bool reactor_init(void)
+{
+    watches_count = 0;
+#if defined(__linux__)
+    if (epoll_fd != -1) close(epoll_fd);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    uring_init();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Whether the reactor is able to wait on this thread
+bool reactor_enabled(void)
+{
+#if defined(__linux__)
+    return epoll_fd != -1;
+#else
+    return false;
+#endif
+}
+
+static struct watch *watch_find(int fd)
+{
+    for (unsigned i = 0; i < watches_count; i++) {
+        if (watches[i].fd == fd) return &watches[i];
+    }
+    return NULL;
+}
+
+// Set the events to wait for on a file descriptor, none to stop watching it
+// The kernel is only told when they change.
+void reactor_watch(int fd, unsigned events)
+{
+    if (fd == -1) return;
+    struct watch *watch = watch_find(fd);
+    if (!events) {
+        reactor_forget(fd);
+        return;
+    }
+    if (watch && watch->events == events) return;
+    if (!watch && watches_count >= REACTOR_MAX_FDS) {
+        fprintf(stderr, "reactor_watch: too many file descriptors\n");
+        return;
+    }
+
+#if defined(__linux__)
+    if (epoll_fd == -1) return;
+    struct epoll_event ev = {.events = epoll_events(events), .data.fd = fd};
+    if (epoll_ctl(epoll_fd, watch ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd,
+            &ev) == -1) {
+        perror("epoll_ctl");
+        return;
+    }
+#endif
+
+    if (!watch) {
+        watch = &watches[watches_count++];
+        *watch = (struct watch){.fd = fd};
+    }
+    watch->events = events;
+}
+
+// Stop watching a file descriptor
+// This has to happen before closing it, as the number may be reused.
+void reactor_forget(int fd)
+{
+    struct watch *watch = watch_find(fd);
+    if (!watch) return;
+
+#if defined(__linux__)
+    if (epoll_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+#endif
+
+    *watch = watches[--watches_count];
+}
+
+// Wake up after a while during the next wait, for things that don't have a
+//   file descriptor to watch
+void reactor_timer(unsigned timeout_ms)
+{
+    if (timer_ms < 0 || (int)timeout_ms < timer_ms) timer_ms = timeout_ms;
+}
+
+// Sleep until any of the watched file descriptors is ready, or the timeout
+//   runs out, -1 meaning no timeout
+// Returns the amount of ready file descriptors, or -1 if waiting isn't
+//   possible.
+int reactor_wait(int timeout_ms)
+{
+    for (unsigned i = 0; i < watches_count; i++) watches[i].ready = 0;
+    if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms)) {
+        timeout_ms = timer_ms;
+    }
+    timer_ms = -1;
+
+#if defined(__linux__)
+    if (epoll_fd == -1) return -1;
+
+    // Only look at what epoll has seen if it's seen anything
+    if (uring_ready()) {
+        int rc = uring_wait(epoll_fd, timeout_ms);
+        if (rc <= 0) return rc;
+        timeout_ms = 0;
+    }
+
+    struct epoll_event evs[REACTOR_MAX_FDS];
+    int rc = epoll_wait(epoll_fd, evs, REACTOR_MAX_FDS, timeout_ms);
+    if (rc == -1) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < rc; i++) {
+        struct watch *watch = watch_find(evs[i].data.fd);
+        if (!watch) continue;
+
+        // Errors and hangups are reported as whatever was asked for, so
+        //   the next call on the file descriptor finds out about them.
+        if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+            watch->ready = watch->events;
+        }
+        if (evs[i].events & EPOLLIN) watch->ready |= REACTOR_IN;
+        if (evs[i].events & EPOLLOUT) watch->ready |= REACTOR_OUT;
+    }
+    return rc;
+#else
+    (void)timeout_ms;
+    return -1;
+#endif
+}
+
+// Events that happened on a file descriptor during the last wait
+unsigned reactor_ready(int fd)
+{
+    struct watch *watch = watch_find(fd);
+    if (!watch) return 0;
+    return watch->ready;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#define REACTOR_IN 0x01
+#define REACTOR_OUT 0x02
+
+// Largest amount of file descriptors that can be watched at once
+#define REACTOR_MAX_FDS 64
+
+bool reactor_init(void);
+bool reactor_enabled(void);
+void reactor_watch(int fd, unsigned events);
+void reactor_forget(int fd);
+void reactor_timer(unsigned timeout_ms);
+int reactor_wait(int timeout_ms);
+unsigned reactor_ready(int fd);
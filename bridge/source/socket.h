@@ -22,6 +22,7 @@
 #define SOCKET_EWOULDBLOCK EWOULDBLOCK
 #define SOCKET_EINPROGRESS EINPROGRESS
 #define SOCKET_EALREADY EALREADY
+#define SOCKET_EISCONN EISCONN
 #elif defined(__WIN32__)
 #define socket_close closesocket
 #define socket_geterror() WSAGetLastError()
@@ -29,6 +30,7 @@
 #define SOCKET_EWOULDBLOCK WSAEWOULDBLOCK
 #define SOCKET_EINPROGRESS WSAEINPROGRESS
 #define SOCKET_EALREADY WSAEALREADY
+#define SOCKET_EISCONN WSAEISCONN
 #endif
 
 void socket_perror(const char *func);
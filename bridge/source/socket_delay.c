@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "socket_delay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+
+// Delay line for the data of a connection
+// Every piece of data is kept as a segment with the time it may be taken
+//   out at. Segments leave in the order they came in, so a later one is
+//   never due before an earlier one.
+
+bool socket_delay_init(struct socket_delay *delay, unsigned capacity)
+{
+    *delay = (struct socket_delay){0};
+    delay->buf = malloc(capacity);
+    if (!delay->buf) {
+        perror("socket_delay: malloc");
+        return false;
+    }
+    delay->capacity = capacity;
+    return true;
+}
+
+void socket_delay_free(struct socket_delay *delay)
+{
+    free(delay->buf);
+    *delay = (struct socket_delay){0};
+}
+
+// Bytes that can be added right now
+unsigned socket_delay_room(struct socket_delay *delay)
+{
+    if (delay->count == SOCKET_DELAY_MAX_SEGMENTS) return 0;
+    return delay->capacity - delay->size;
+}
+
+// Add data that may be taken out at a given time
+// Returns the amount of bytes taken, which for datagrams is all or nothing.
+unsigned socket_delay_put(struct socket_delay *delay, const void *data, unsigned size, const struct mobile_addr *addr, uint32_t due, bool datagram)
+{
+    unsigned keep = size;
+    unsigned room = socket_delay_room(delay);
+    if (keep > room) {
+        if (datagram) return 0;
+        keep = room;
+    }
+    if (!keep) return 0;
+
+    unsigned pos = (delay->start + delay->size) % delay->capacity;
+    unsigned first = delay->capacity - pos;
+    if (first > keep) first = keep;
+    memcpy(delay->buf + pos, data, first);
+    memcpy(delay->buf, (const unsigned char *)data + first, keep - first);
+    delay->size += keep;
+
+    if (delay->count) {
+        struct socket_delay_segment *last = &delay->segments[
+            (delay->first + delay->count - 1) % SOCKET_DELAY_MAX_SEGMENTS];
+        if ((int32_t)(due - last->due) < 0) due = last->due;
+    }
+    struct socket_delay_segment *segment = &delay->segments[
+        (delay->first + delay->count++) % SOCKET_DELAY_MAX_SEGMENTS];
+    *segment = (struct socket_delay_segment){
+        .due = due,
+        .size = keep,
+        .has_addr = addr != NULL,
+    };
+    if (addr) segment->addr = *addr;
+    return keep;
+}
+
+// Copy the first segment, if it's due, without taking it out
+// Returns the amount of bytes copied, at most the size given.
+unsigned socket_delay_peek(struct socket_delay *delay, void *data, unsigned size, struct mobile_addr *addr)
+{
+    if (!delay->count) return 0;
+    struct socket_delay_segment *segment = &delay->segments[delay->first];
+    if ((int32_t)(timer_get() - segment->due) < 0) return 0;
+
+    if (size > segment->size) size = segment->size;
+    unsigned first = delay->capacity - delay->start;
+    if (first > size) first = size;
+    memcpy(data, delay->buf + delay->start, first);
+    memcpy((unsigned char *)data + first, delay->buf, size - first);
+    if (addr && segment->has_addr) *addr = segment->addr;
+    return size;
+}
+
+// Take bytes out of the first segment
+void socket_delay_drop(struct socket_delay *delay, unsigned size)
+{
+    if (!delay->count) return;
+    struct socket_delay_segment *segment = &delay->segments[delay->first];
+    if (size > segment->size) size = segment->size;
+
+    delay->start = (delay->start + size) % delay->capacity;
+    delay->size -= size;
+    segment->size -= size;
+    if (segment->size) return;
+    delay->first = (delay->first + 1) % SOCKET_DELAY_MAX_SEGMENTS;
+    delay->count--;
+}
+
+// Take out whatever is due, like a socket would hand it out
+// Datagrams come out one at a time, and whatever doesn't fit is lost.
+int socket_delay_get(struct socket_delay *delay, void *data, unsigned size, struct mobile_addr *addr, bool datagram)
+{
+    if (datagram) {
+        if (!delay->count) return 0;
+        unsigned segment_size = delay->segments[delay->first].size;
+        unsigned len = socket_delay_peek(delay, data, size, addr);
+        if (len || !size) socket_delay_drop(delay, segment_size);
+        return len;
+    }
+
+    unsigned len = 0;
+    while (len < size) {
+        unsigned part = socket_delay_peek(delay, (unsigned char *)data + len,
+            size - len, addr);
+        if (!part) break;
+        socket_delay_drop(delay, part);
+        len += part;
+    }
+    return len;
+}
+
+// Make everything due right away
+void socket_delay_expire(struct socket_delay *delay)
+{
+    uint32_t now = timer_get();
+    for (unsigned i = 0; i < delay->count; i++) {
+        delay->segments[(delay->first + i) % SOCKET_DELAY_MAX_SEGMENTS].due =
+            now;
+    }
+}
+
+// Time until the first segment is due, in ms, or -1 if there's none
+int socket_delay_wait(struct socket_delay *delay)
+{
+    if (!delay->count) return -1;
+    int32_t left = delay->segments[delay->first].due - timer_get();
+    if (left <= 0) return 0;
+    return (left + 999) / 1000;
+}
@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#include "socket_impl.h"
+
+bool socket_delay_init(struct socket_delay *delay, unsigned capacity);
+void socket_delay_free(struct socket_delay *delay);
+unsigned socket_delay_room(struct socket_delay *delay);
+unsigned socket_delay_put(struct socket_delay *delay, const void *data, unsigned size, const struct mobile_addr *addr, uint32_t due, bool datagram);
+unsigned socket_delay_peek(struct socket_delay *delay, void *data, unsigned size, struct mobile_addr *addr);
+void socket_delay_drop(struct socket_delay *delay, unsigned size);
+int socket_delay_get(struct socket_delay *delay, void *data, unsigned size, struct mobile_addr *addr, bool datagram);
+void socket_delay_expire(struct socket_delay *delay);
+int socket_delay_wait(struct socket_delay *delay);
@@ -1,11 +1,24 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE  // accept4()
 #include "socket_impl.h"
 
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#include "reactor.h"
 #include "socket.h"
+#include "socket_delay.h"
+#include "socket_loop.h"
+#include "socket_shape.h"
+#include "timer.h"
+
+// Time given to queued data to leave after closing a socket
+#define CLOSE_FLUSH_MS 1000
+
+// Room needed to take in a datagram while shaping, larger ones are cut short
+#define SHAPE_DATAGRAM_MAX 0x800
 
 union u_sockaddr {
     struct sockaddr addr;
@@ -17,14 +30,16 @@ void socket_impl_init(struct socket_impl *state)
 {
     for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
         state->sockets[i] = -1;
+        state->connecting[i] = false;
+        state->sendq[i] = (struct socket_impl_sendq){0};
+        state->closing[i].sock = -1;
+        state->uring[i] = (struct socket_impl_uring){0};
+        state->loop[i] = (struct socket_loop_conn){0};
+        state->shape[i] = (struct socket_shape_conn){0};
     }
-}
-
-void socket_impl_stop(struct socket_impl *state)
-{
-    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
-        if (state->sockets[i] != -1) socket_close(state->sockets[i]);
-    }
+    state->loopback = socket_loop_enabled();
+    state->shaping = socket_shape_enabled();
+    state->shape_random = socket_shape_seed();
 }
 
 static struct sockaddr *convert_sockaddr(socklen_t *addrlen, union u_sockaddr *u_addr, const struct mobile_addr *addr)
@@ -58,8 +73,219 @@ static struct sockaddr *convert_sockaddr(socklen_t *addrlen, union u_sockaddr *u
     }
 }
 
-bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+// Convert a sockaddr to the address used by the adapter
+static void convert_mobile_addr(struct mobile_addr *addr, const union u_sockaddr *u_addr)
+{
+    if (u_addr->addr.sa_family == AF_INET) {
+        struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
+        addr4->type = MOBILE_ADDRTYPE_IPV4;
+        addr4->port = ntohs(u_addr->addr4.sin_port);
+        memcpy(addr4->host, &u_addr->addr4.sin_addr.s_addr,
+            sizeof(addr4->host));
+    } else if (u_addr->addr.sa_family == AF_INET6) {
+        struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
+        addr6->type = MOBILE_ADDRTYPE_IPV6;
+        addr6->port = ntohs(u_addr->addr6.sin6_port);
+        memcpy(addr6->host, &u_addr->addr6.sin6_addr.s6_addr,
+            sizeof(addr6->host));
+    }
+}
+
+static void ring_send_done(struct uring_op *op, int res)
+{
+    struct socket_impl_uring *uring = (struct socket_impl_uring *)
+        ((char *)op - offsetof(struct socket_impl_uring, send_op));
+    struct socket_impl_sendq *sendq = uring->sendq;
+
+    // Whatever is left once it's cancelled is sent the usual way
+    if (res == -ECANCELED) return;
+    if (res < 0) {
+        socket_seterror(-res);
+        socket_perror("send");
+        sendq->failed = true;
+        sendq->size = 0;
+        return;
+    }
+    sendq->start += res;
+    sendq->size -= res;
+    if (!sendq->size) sendq->start = 0;
+}
+
+static void ring_recv_done(struct uring_op *op, int res)
+{
+    struct socket_impl_uring *uring = (struct socket_impl_uring *)
+        ((char *)op - offsetof(struct socket_impl_uring, recv_op));
+
+    if (res == -ECANCELED) return;
+    if (res < 0) {
+        socket_seterror(-res);
+        socket_perror("recv");
+        uring->error = -1;
+        return;
+    }
+
+    // A length of 0 will be returned if the remote has disconnected, though
+    //   UDP sockets may receive zero-length datagrams as well.
+    if (!res && !uring->udp) uring->error = -2;
+    if (uring->udp) {
+        uring->addr = (struct mobile_addr){0};
+        convert_mobile_addr(&uring->addr,
+            (union u_sockaddr *)&uring->recv_name);
+    }
+    uring->start = 0;
+    uring->size = res;
+}
+
+// Keep a receive in flight, as long as there's room for what it brings in
+static void ring_arm(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    if (uring->recv_op.busy || uring->size || uring->error) return;
+    if (uring->udp) {
+        uring_recvmsg(&uring->recv_op, state->sockets[conn], &uring->recv_msg,
+            uring->buf, sizeof(uring->buf), &uring->recv_name,
+            sizeof(uring->recv_name));
+    } else {
+        uring_recv(&uring->recv_op, state->sockets[conn], uring->buf,
+            sizeof(uring->buf));
+    }
+}
+
+// Let the ring take over a socket once it can carry data, if the thread has
+//   one, and start receiving right away
+static void ring_start(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    if (uring->ready || !uring_ready()) return;
+
+    reactor_forget(state->sockets[conn]);
+    *uring = (struct socket_impl_uring){
+        .ready = true,
+        .udp = state->types[conn] == MOBILE_SOCKTYPE_UDP,
+        .recv_op.done = ring_recv_done,
+        .send_op.done = ring_send_done,
+    };
+    ring_arm(state, conn);
+}
+
+// Cancel whatever the ring is doing on a socket, to use it directly again
+static void ring_stop(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    if (!uring->ready) return;
+    uring_cancel(&uring->recv_op);
+    uring_cancel(&uring->send_op);
+    *uring = (struct socket_impl_uring){0};
+}
+
+// Hand the queued data to the ring, unless it's still sending some of it
+// Returns the amount of bytes left to send, or -1 if sending failed.
+static int ring_flush(struct socket_impl *state, unsigned conn)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    struct socket_impl_sendq *sendq = &state->sendq[conn];
+    if (sendq->failed) return -1;
+    if (!sendq->size || uring->send_op.busy) return sendq->size;
+
+    if (sendq->start) {
+        memmove(sendq->buf, sendq->buf + sendq->start, sendq->size);
+        sendq->start = 0;
+    }
+    uring->sendq = sendq;
+    if (sendq->has_addr) {
+        socklen_t sock_addrlen;
+        if (!convert_sockaddr(&sock_addrlen,
+                (union u_sockaddr *)&uring->send_name, &sendq->addr)) {
+            sock_addrlen = 0;
+        }
+        uring_sendmsg(&uring->send_op, state->sockets[conn], &uring->send_msg,
+            sendq->buf, sendq->size, &uring->send_name, sock_addrlen);
+    } else {
+        uring_send(&uring->send_op, state->sockets[conn], sendq->buf,
+            sendq->size);
+    }
+    return sendq->size;
+}
+
+// Queue data for the ring to send
+// Returns the amount of bytes accepted, which is only less than the size
+//   given if the send queue is full, in which case the caller holds on to
+//   the rest and tries again. The data that's being sent can't be moved, so
+//   only the room after it can be used until it's out.
+static int ring_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    struct socket_impl_sendq *sendq = &state->sendq[conn];
+    int queued = ring_flush(state, conn);
+    if (queued < 0) return -1;
+    // Datagrams are queued whole, one at a time
+    if (queued && uring->udp) return 0;
+    if (!queued) {
+        sendq->has_addr = addr != NULL;
+        if (addr) sendq->addr = *addr;
+    }
+
+    unsigned keep = size;
+    unsigned room = sizeof(sendq->buf) - sendq->start - sendq->size;
+    if (keep > room) {
+        if (uring->udp) return 0;
+        keep = room;
+    }
+    memcpy(sendq->buf + sendq->start + sendq->size, data, keep);
+    sendq->size += keep;
+    ring_flush(state, conn);
+    return keep;
+}
+
+// Take out the data the ring has received
+static int ring_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct socket_impl_uring *uring = &state->uring[conn];
+    if (!uring->size) {
+        // Errors are only reported once the data before them is out
+        if (uring->error) return uring->error;
+        ring_arm(state, conn);
+        return 0;
+    }
+    if (!data) return 1;
+
+    unsigned len = size < uring->size ? size : uring->size;
+    memcpy(data, uring->buf + uring->start, len);
+    if (uring->udp) {
+        // Whatever doesn't fit of a datagram is lost, like with recvfrom()
+        if (addr) *addr = uring->addr;
+        uring->size = 0;
+    } else {
+        uring->start += len;
+        uring->size -= len;
+    }
+    ring_arm(state, conn);
+    return len;
+}
+
+static void direct_stop(struct socket_impl *state)
 {
+    if (state->loopback) {
+        socket_loop_stop(state);
+        return;
+    }
+
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->sockets[i] == -1) continue;
+        ring_stop(state, i);
+        reactor_forget(state->sockets[i]);
+        socket_close(state->sockets[i]);
+    }
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->closing[i].sock == -1) continue;
+        reactor_forget(state->closing[i].sock);
+        socket_close(state->closing[i].sock);
+    }
+}
+
+static bool direct_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    if (state->loopback) return socket_loop_open(state, conn, type);
     assert(state->sockets[conn] == -1);
 
     int sock_type;
@@ -76,6 +302,15 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
         default: assert(false); return false;
     }
 
+#ifdef SOCK_NONBLOCK
+    // Save a few calls by creating the socket non-blocking right away
+    int sock = socket(sock_addrtype, sock_type | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        0);
+    if (sock == -1) {
+        socket_perror("socket");
+        return false;
+    }
+#else
     int sock = socket(sock_addrtype, sock_type, 0);
     if (sock == -1) {
         socket_perror("socket");
@@ -85,9 +320,11 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
         socket_close(sock);
         return false;
     }
+#endif
 
     // Set SO_REUSEADDR so that we can bind to the same port again after
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+    // Ports picked by the system are never the same, so they don't need it.
+    if (bindport && setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
             (char *)&(int){1}, sizeof(int)) == -1) {
         socket_perror("setsockopt");
         socket_close(sock);
@@ -124,18 +361,114 @@ bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_sock
     }
 
     state->sockets[conn] = sock;
+    state->types[conn] = type;
+    state->connecting[conn] = false;
+    state->sendq[conn] = (struct socket_impl_sendq){0};
+
+    // Datagrams can be received right away
+    if (type == MOBILE_SOCKTYPE_UDP) ring_start(state, conn);
     return true;
 }
 
-void socket_impl_close(struct socket_impl *state, unsigned conn)
+// Send as much of a send queue as the socket takes
+// Returns the amount of bytes left in the queue, or -1 if sending failed.
+static int sendq_flush(int sock, struct socket_impl_sendq *sendq)
+{
+    if (sendq->failed) return -1;
+    if (!sendq->size) return 0;
+    assert(sock != -1);
+
+    union u_sockaddr u_addr;
+    socklen_t sock_addrlen;
+    struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr,
+        sendq->has_addr ? &sendq->addr : NULL);
+
+    while (sendq->size) {
+        ssize_t len = sendto(sock, (char *)sendq->buf + sendq->start,
+            sendq->size, 0, sock_addr, sock_addrlen);
+        if (len == -1) {
+            int err = socket_geterror();
+            if (err == SOCKET_EWOULDBLOCK) break;
+
+            socket_perror("send");
+            sendq->failed = true;
+            sendq->size = 0;
+            return -1;
+        }
+        sendq->start += len;
+        sendq->size -= len;
+    }
+    if (!sendq->size) sendq->start = 0;
+    return sendq->size;
+}
+
+static int direct_flush(struct socket_impl *state, unsigned conn)
+{
+    if (state->uring[conn].ready) return ring_flush(state, conn);
+    return sendq_flush(state->sockets[conn], &state->sendq[conn]);
+}
+
+static void closing_done(struct socket_impl_closing *closing)
 {
+    if (closing->sendq.size) {
+        fprintf(stderr, "close: dropped %u unsent bytes\n",
+            closing->sendq.size);
+    }
+    reactor_forget(closing->sock);
+    socket_close(closing->sock);
+    closing->sock = -1;
+}
+
+static void direct_close(struct socket_impl *state, unsigned conn)
+{
+    if (state->loopback) {
+        socket_loop_close(state, conn);
+        return;
+    }
     assert(state->sockets[conn] != -1);
-    socket_close(state->sockets[conn]);
+    ring_stop(state, conn);
+
+    // The adapter has been told the queued data was sent, so the socket is
+    //   kept around for a while to let it actually leave.
+    if (direct_flush(state, conn) > 0) {
+        // Make room by giving up on the oldest one, if necessary
+        struct socket_impl_closing *closing = NULL;
+        for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+            struct socket_impl_closing *other = &state->closing[i];
+            if (other->sock == -1) {
+                closing = other;
+                break;
+            }
+            if (!closing || (int32_t)(other->time - closing->time) < 0) {
+                closing = other;
+            }
+        }
+        if (closing->sock != -1) closing_done(closing);
+
+        closing->sock = state->sockets[conn];
+        closing->time = timer_get();
+        closing->sendq = state->sendq[conn];
+    } else {
+        reactor_forget(state->sockets[conn]);
+        socket_close(state->sockets[conn]);
+    }
     state->sockets[conn] = -1;
+    state->connecting[conn] = false;
+    state->sendq[conn] = (struct socket_impl_sendq){0};
 }
 
-int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr)
+// Take note of a connection having been made
+static int direct_connected(struct socket_impl *state, unsigned conn)
 {
+    state->connecting[conn] = false;
+    ring_start(state, conn);
+    return 1;
+}
+
+static int direct_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr)
+{
+    if (state->loopback) return socket_loop_connect(state, conn, addr);
+
     int sock = state->sockets[conn];
     assert(sock != -1);
 
@@ -143,17 +476,25 @@ int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct m
     socklen_t sock_addrlen;
     struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr, addr);
 
-    // Try to connect/check if we're connected
-    if (connect(sock, sock_addr, sock_addrlen) != -1) return 1;
-    int err = socket_geterror();
+    // Try to connect, unless that's already been done
+    int err = SOCKET_EALREADY;
+    if (!state->connecting[conn]) {
+        if (connect(sock, sock_addr, sock_addrlen) != -1) {
+            return direct_connected(state, conn);
+        }
+        err = socket_geterror();
+        if (err == SOCKET_EISCONN) return direct_connected(state, conn);
+    }
 
-    // If the connection is in progress, block at most 100ms to see if it's
-    //   enough for it to connect.
+    // If the connection is in progress, check if it's done without waiting,
+    //   the caller will ask again later.
     if (err == SOCKET_EWOULDBLOCK || err == SOCKET_EINPROGRESS
             || err == SOCKET_EALREADY) {
-        int rc = socket_isconnected(sock, 100);
-        if (rc > 0) return 1;
+        state->connecting[conn] = true;
+        int rc = socket_isconnected(sock, 0);
         if (rc == 0) return 0;
+        state->connecting[conn] = false;
+        if (rc > 0) return direct_connected(state, conn);
         err = socket_geterror();
     }
 
@@ -168,8 +509,10 @@ int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct m
     return -1;
 }
 
-bool socket_impl_listen(struct socket_impl *state, unsigned conn)
+static bool direct_listen(struct socket_impl *state, unsigned conn)
 {
+    if (state->loopback) return true;
+
     int sock = state->sockets[conn];
     assert(sock != -1);
 
@@ -181,53 +524,136 @@ bool socket_impl_listen(struct socket_impl *state, unsigned conn)
     return true;
 }
 
-bool socket_impl_accept(struct socket_impl *state, unsigned conn)
+static bool direct_accept(struct socket_impl *state, unsigned conn)
 {
+    if (state->loopback) return false;
+
     int sock = state->sockets[conn];
     assert(sock != -1);
 
-    if (socket_hasdata(sock, 0) <= 0) return false;
+    // The socket is non-blocking, so this fails if nobody's connected yet
+#ifdef SOCK_NONBLOCK
+    int newsock = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     int newsock = accept(sock, NULL, NULL);
+#endif
     if (newsock == -1) {
+        if (socket_geterror() == SOCKET_EWOULDBLOCK) return false;
         socket_perror("accept");
         return false;
     }
-    if (socket_setblocking(newsock, 0) == -1) return false;
+#ifndef SOCK_NONBLOCK
+    if (socket_setblocking(newsock, 0) == -1) {
+        socket_close(newsock);
+        return false;
+    }
+#endif
 
+    reactor_forget(sock);
     socket_close(sock);
     state->sockets[conn] = newsock;
+    ring_start(state, conn);
     return true;
 }
 
-int socket_impl_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+// Send the data left on closed sockets, and finish closing them
+// Returns true if there's any left.
+bool socket_impl_flush_closing(struct socket_impl *state)
+{
+    bool res = false;
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        struct socket_impl_closing *closing = &state->closing[i];
+        if (closing->sock == -1) continue;
+        uint32_t elapsed = timer_get() - closing->time;
+        if (sendq_flush(closing->sock, &closing->sendq) > 0 &&
+                elapsed < CLOSE_FLUSH_MS * 1000) {
+            // Give up on time, even if the socket never takes the rest
+            reactor_timer((CLOSE_FLUSH_MS * 1000 - elapsed) / 1000 + 1);
+            res = true;
+            continue;
+        }
+        closing_done(closing);
+    }
+    return res;
+}
+
+// Send data, queueing whatever the socket can't take right away
+// Returns the amount of bytes accepted, which is only less than the size
+//   given if the send queue is full, in which case the caller holds on to
+//   the rest and tries again, see struct gbridge_prot_ma_send.
+static int direct_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
 {
+    if (state->loopback) {
+        return socket_loop_send(state, conn, data, size, addr);
+    }
+    if (state->uring[conn].ready) {
+        return ring_send(state, conn, data, size, addr);
+    }
+
     int sock = state->sockets[conn];
     assert(sock != -1);
 
-    union u_sockaddr u_addr;
-    socklen_t sock_addrlen;
-    struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr, addr);
+    // Anything queued before has to leave first
+    struct socket_impl_sendq *sendq = &state->sendq[conn];
+    int queued = direct_flush(state, conn);
+    if (queued < 0) return -1;
+    // Datagrams are queued whole, one at a time
+    bool udp = state->types[conn] == MOBILE_SOCKTYPE_UDP;
+    if (queued && udp) return 0;
+
+    unsigned sent = 0;
+    if (!queued) {
+        union u_sockaddr u_addr;
+        socklen_t sock_addrlen;
+        struct sockaddr *sock_addr = convert_sockaddr(&sock_addrlen, &u_addr,
+            addr);
+
+        ssize_t len = sendto(sock, data, size, 0, sock_addr, sock_addrlen);
+        if (len == -1) {
+            // If the socket is blocking, we just haven't sent anything
+            int err = socket_geterror();
+            if (err != SOCKET_EWOULDBLOCK) {
+                socket_perror("send");
+                return -1;
+            }
+            len = 0;
+        }
+        sent = len;
+        if (sent == size) return size;
 
-    ssize_t len = sendto(sock, data, size, 0, sock_addr, sock_addrlen);
-    if (len == -1) {
-        // If the socket is blocking, we just haven't sent anything
-        int err = socket_geterror();
-        if (err == SOCKET_EWOULDBLOCK) return 0;
+        sendq->has_addr = addr != NULL;
+        if (addr) sendq->addr = *addr;
+    }
 
-        socket_perror("send");
-        return -1;
+    // Keep the rest until the socket can take it
+    unsigned keep = size - sent;
+    unsigned room = sizeof(sendq->buf) - sendq->size;
+    if (keep > room) {
+        if (udp) return 0;
+        keep = room;
     }
-    return (int)len;
+    if (sendq->start + sendq->size + keep > sizeof(sendq->buf)) {
+        memmove(sendq->buf, sendq->buf + sendq->start, sendq->size);
+        sendq->start = 0;
+    }
+    memcpy(sendq->buf + sendq->start + sendq->size,
+        (const unsigned char *)data + sent, keep);
+    sendq->size += keep;
+    return sent + keep;
 }
 
-int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+static int direct_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
 {
+    if (state->loopback) {
+        return socket_loop_recv(state, conn, data, size, addr);
+    }
+    if (state->uring[conn].ready) {
+        return ring_recv(state, conn, data, size, addr);
+    }
+
     int sock = state->sockets[conn];
     assert(sock != -1);
 
-    // Make sure at least one byte is in the buffer
-    if (socket_hasdata(sock, 0) <= 0) return 0;
-
     union u_sockaddr u_addr = {0};
     socklen_t sock_addrlen = sizeof(u_addr);
     struct sockaddr *sock_addr = (struct sockaddr *)&u_addr;
@@ -242,8 +668,7 @@ int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsig
         len = recvfrom(sock, &c, 1, MSG_PEEK, sock_addr, &sock_addrlen);
     }
     if (len == -1) {
-        // If the socket is blocking, we just haven't received anything
-        // Though this shouldn't happen thanks to the socket_hasdata check.
+        // The socket is non-blocking, so we just haven't received anything
         int err = socket_geterror();
         if (err == SOCKET_EWOULDBLOCK) return 0;
 
@@ -255,33 +680,243 @@ int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsig
     if (len == 0) {
         // Though it's only relevant to TCP sockets, as UDP sockets may receive
         // zero-length datagrams.
-        int sock_type = 0;
-        socklen_t sock_type_len = sizeof(sock_type);
-        if (getsockopt(sock, SOL_SOCKET, SO_TYPE, (char *)&sock_type,
-                &sock_type_len) == -1) {
-            socket_perror("getsockopt");
-            return -1;
-        }
-        if (sock_type == SOCK_STREAM) return -2;
+        if (state->types[conn] == MOBILE_SOCKTYPE_TCP) return -2;
     }
 
     if (!data) return 0;
 
-    if (addr && sock_addrlen) {
-        if (sock_addr->sa_family == AF_INET) {
-            struct mobile_addr4 *addr4 = (struct mobile_addr4 *)addr;
-            addr4->type = MOBILE_ADDRTYPE_IPV4;
-            addr4->port = ntohs(u_addr.addr4.sin_port);
-            memcpy(addr4->host, &u_addr.addr4.sin_addr.s_addr,
-                sizeof(addr4->host));
-        } else if (sock_addr->sa_family == AF_INET6) {
-            struct mobile_addr6 *addr6 = (struct mobile_addr6 *)addr;
-            addr6->type = MOBILE_ADDRTYPE_IPV6;
-            addr6->port = ntohs(u_addr.addr6.sin6_port);
-            memcpy(addr6->host, &u_addr.addr6.sin6_addr.s6_addr,
-                sizeof(addr6->host));
+    if (addr && sock_addrlen) convert_mobile_addr(addr, &u_addr);
+
+    return (int)len;
+}
+
+// Tell the reactor what to wait for on a connection
+static void direct_watch(struct socket_impl *state, unsigned conn, unsigned events)
+{
+    if (state->loopback) {
+        socket_loop_watch(state, conn, events);
+        return;
+    }
+
+    // The ring wakes the reactor up by itself once it's done something
+    if (state->uring[conn].ready) {
+        ring_arm(state, conn);
+        events = 0;
+    }
+    reactor_watch(state->sockets[conn], events);
+}
+
+// Send the held back data that's due, as far as the socket takes it
+static void shape_release(struct socket_impl *state, unsigned conn)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    unsigned char buf[SOCKET_SHAPE_QUEUE_SIZE];
+    while (!shape->failed) {
+        struct mobile_addr addr = {0};
+        unsigned size = socket_delay_peek(&shape->up, buf, sizeof(buf), &addr);
+        if (!size) break;
+        int res = direct_send(state, conn, buf, size, &addr);
+        if (res < 0) {
+            shape->failed = true;
+            break;
         }
+        if (!res) break;
+        socket_delay_drop(&shape->up, res);
     }
+}
 
-    return (int)len;
+// Take in whatever has been received, and hold it back
+static void shape_pull(struct socket_impl *state, unsigned conn)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (!shape->udp && !shape->connected) return;
+
+    unsigned char buf[SOCKET_SHAPE_QUEUE_SIZE];
+    while (!shape->error) {
+        unsigned room = socket_delay_room(&shape->down);
+        if (shape->udp) {
+            if (room < SHAPE_DATAGRAM_MAX) break;
+            room = SHAPE_DATAGRAM_MAX;
+        }
+        if (!room) break;
+
+        struct mobile_addr addr = {0};
+        int res = direct_recv(state, conn, buf, room, &addr);
+        if (res < 0) {
+            socket_shape_error(state, conn, res);
+            break;
+        }
+        if (!res) break;
+        socket_shape_down(state, conn, buf, res, shape->udp ? &addr : NULL);
+    }
+}
+
+static bool shape_due(uint32_t due)
+{
+    return (int32_t)(timer_get() - due) >= 0;
+}
+
+static void shape_timer(uint32_t due)
+{
+    int32_t left = due - timer_get();
+    reactor_timer(left > 0 ? (left + 999) / 1000 : 0);
+}
+
+void socket_impl_stop(struct socket_impl *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->shape[i].open) socket_shape_close(state, i);
+    }
+    direct_stop(state);
+}
+
+bool socket_impl_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type, enum mobile_addrtype addrtype, unsigned bindport)
+{
+    if (!direct_open(state, conn, type, addrtype, bindport)) return false;
+    if (state->shaping && !socket_shape_open(state, conn, type)) {
+        direct_close(state, conn);
+        return false;
+    }
+    return true;
+}
+
+void socket_impl_close(struct socket_impl *state, unsigned conn)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (shape->open) {
+        // The adapter has been told the held back data was sent, so it's
+        //   sent right away instead.
+        socket_delay_expire(&shape->up);
+        shape_release(state, conn);
+        if (shape->up.size) {
+            fprintf(stderr, "close: dropped %u held back bytes\n",
+                shape->up.size);
+        }
+        socket_shape_close(state, conn);
+    }
+    direct_close(state, conn);
+}
+
+int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr)
+{
+    if (!state->shaping) return direct_connect(state, conn, addr);
+
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (!shape->connected) {
+        int res = direct_connect(state, conn, addr);
+        shape->connecting = res == 0;
+        if (res <= 0) return res;
+        socket_shape_connected(state, conn);
+    }
+    shape->connecting = !shape_due(shape->connect_due);
+    return !shape->connecting;
+}
+
+bool socket_impl_listen(struct socket_impl *state, unsigned conn)
+{
+    if (state->shaping) state->shape[conn].listening = true;
+    return direct_listen(state, conn);
+}
+
+bool socket_impl_accept(struct socket_impl *state, unsigned conn)
+{
+    if (!direct_accept(state, conn)) return false;
+    if (state->shaping) {
+        state->shape[conn].listening = false;
+        state->shape[conn].connected = true;
+        state->shape[conn].connect_due = timer_get();
+    }
+    return true;
+}
+
+// Send data, holding it back first when shaping
+// Returns the amount of bytes accepted, which is only less than the size
+//   given if the queues are full.
+int socket_impl_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    if (!state->shaping) return direct_send(state, conn, data, size, addr);
+
+    struct socket_shape_conn *shape = &state->shape[conn];
+    shape_release(state, conn);
+    if (shape->failed) return -1;
+    return socket_shape_up(state, conn, data, size, addr);
+}
+
+// Send the data that's been queued, and take in what's been received
+// Returns the amount of bytes left to send, or -1 if sending failed.
+int socket_impl_flush(struct socket_impl *state, unsigned conn)
+{
+    if (!state->shaping) return direct_flush(state, conn);
+
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (!shape->open) return 0;
+    shape_release(state, conn);
+    shape_pull(state, conn);
+    if (shape->failed) return -1;
+    int res = direct_flush(state, conn);
+    if (res < 0) return -1;
+    return res + shape->up.size;
+}
+
+int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    if (!state->shaping) return direct_recv(state, conn, data, size, addr);
+
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (!shape->udp && !shape->connected) {
+        return direct_recv(state, conn, data, size, addr);
+    }
+    shape_pull(state, conn);
+    if (data) {
+        int len = socket_delay_get(&shape->down, data, size, addr, shape->udp);
+        if (len) return len;
+    }
+
+    // Errors are only reported once the data before them is out
+    if (shape->error && !shape->down.count && shape_due(shape->error_due)) {
+        return shape->error;
+    }
+    return 0;
+}
+
+// Tell the reactor what to wait for on a connection
+// While shaping, the socket is only watched for what it has to do itself,
+//   and timers take care of the data that's being held back.
+void socket_impl_watch(struct socket_impl *state, unsigned conn, unsigned events)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    if (!shape->open) {
+        direct_watch(state, conn, events);
+        return;
+    }
+
+    unsigned raw = 0;
+    if (events & REACTOR_OUT) {
+        if (state->sendq[conn].size) raw |= REACTOR_OUT;
+        if (shape->connecting) {
+            if (shape->connected) {
+                shape_timer(shape->connect_due);
+            } else {
+                raw |= REACTOR_OUT;
+            }
+        }
+    }
+    int wait = socket_delay_wait(&shape->up);
+    if (wait >= 0) reactor_timer(wait);
+
+    // Data is taken in whenever there's room for it, like a network would
+    if (shape->listening) raw |= events & REACTOR_IN;
+    if ((shape->udp || shape->connected) && !shape->error) {
+        unsigned room = socket_delay_room(&shape->down);
+        if (shape->udp ? room >= SHAPE_DATAGRAM_MAX : room) raw |= REACTOR_IN;
+    }
+    if (events & REACTOR_IN) {
+        wait = socket_delay_wait(&shape->down);
+        if (wait >= 0) {
+            reactor_timer(wait);
+        } else if (shape->error) {
+            shape_timer(shape->error_due);
+        }
+    }
+    direct_watch(state, conn, raw);
 }
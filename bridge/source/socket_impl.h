@@ -1,44 +1,117 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #pragma once
 
-// mobile.h start
-#include <stdbool.h>
-#define MOBILE_MAX_CONNECTIONS 2
-#define MOBILE_HOSTLEN_IPV4 4
-#define MOBILE_HOSTLEN_IPV6 16
-enum mobile_socktype {
-    MOBILE_SOCKTYPE_TCP,
-    MOBILE_SOCKTYPE_UDP,
-};
-enum mobile_addrtype {
-    MOBILE_ADDRTYPE_NONE,
-    MOBILE_ADDRTYPE_IPV4,
-    MOBILE_ADDRTYPE_IPV6,
-};
-struct mobile_addr4 {
-    enum mobile_addrtype type;
-    unsigned port;
-    unsigned char host[MOBILE_HOSTLEN_IPV4];
-};
-struct mobile_addr6 {
-    enum mobile_addrtype type;
-    unsigned port;
-    unsigned char host[MOBILE_HOSTLEN_IPV6];
-};
-struct mobile_addr {
-    // Make sure it's big enough to hold all types
-    union {
-        enum mobile_addrtype type;
-
-        // Don't access these directly, cast instead
-        struct mobile_addr4 _addr4;
-        struct mobile_addr6 _addr6;
-    };
-};
-// mobile.h end
+#include <stdint.h>
+
+#include "mobile.h"
+#include "socket.h"
+#include "uring.h"
+
+// Data accepted for sending that the socket couldn't take yet
+#define SOCKET_IMPL_SENDQ_SIZE 0x1000
+struct socket_impl_sendq {
+    bool failed;  // Sending queued data failed, report it on the next send
+    unsigned start;
+    unsigned size;
+    bool has_addr;
+    struct mobile_addr addr;
+    unsigned char buf[SOCKET_IMPL_SENDQ_SIZE];
+};
+
+// Socket closed while data was still queued on it, kept until it's sent
+struct socket_impl_closing {
+    int sock;
+    uint32_t time;
+    struct socket_impl_sendq sendq;
+};
+
+// Connected socket whose data goes through io_uring, see uring.c
+// One receive is always in flight while there's room for it, and one send
+//   whenever there's data queued.
+#define SOCKET_IMPL_URING_RECV_SIZE 0x1000
+struct socket_impl_uring {
+    bool ready;  // The ring has taken over the socket
+    bool udp;
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    struct uring_msg recv_msg;
+    struct uring_msg send_msg;
+    struct sockaddr_storage recv_name;
+    struct sockaddr_storage send_name;
+    struct socket_impl_sendq *sendq;  // Queue being sent from
+    int error;  // Receive error held back until the data before it is out
+    unsigned start;
+    unsigned size;  // Received data that hasn't been taken out yet
+    struct mobile_addr addr;  // Where the received datagram came from
+    unsigned char buf[SOCKET_IMPL_URING_RECV_SIZE];
+};
+
+// Data held back until a given time, in the order it came in
+#define SOCKET_DELAY_MAX_SEGMENTS 0x40
+struct socket_delay_segment {
+    uint32_t due;  // Time it can be taken out at
+    unsigned size;
+    bool has_addr;
+    struct mobile_addr addr;  // Where a datagram was sent to, or came from
+};
+struct socket_delay {
+    unsigned char *buf;
+    unsigned capacity;
+    unsigned start;
+    unsigned size;
+    struct socket_delay_segment segments[SOCKET_DELAY_MAX_SEGMENTS];
+    unsigned first;
+    unsigned count;
+};
+
+// Connection served in memory by the loopback backend, see socket_loop.c
+struct socket_loop_conn {
+    bool open;
+    bool udp;
+    bool connecting;
+    bool connected;
+    bool sink;  // Everything sent is dropped, instead of echoed back
+    uint32_t connect_time;
+    struct socket_delay back;  // Data on its way back from the echo endpoint
+};
+
+// Connection whose traffic is held back like a slower network would, see
+//   socket_shape.c
+#define SOCKET_SHAPE_QUEUE_SIZE 0x1000
+struct socket_shape_conn {
+    bool open;
+    bool udp;
+    bool listening;
+    bool connecting;  // connect() has been asked for, and not reported yet
+    bool connected;  // The socket is connected, and its data is taken in
+    uint32_t connect_due;  // Time to report the connection at
+    int error;  // Receive error held back until the data before it is out
+    uint32_t error_due;
+    bool failed;  // Sending held back data failed, report it on the next send
+    uint32_t up_busy;  // Time the link is done sending what's been sent
+    uint32_t down_busy;  // Time the link is done receiving
+    struct socket_delay up;  // Data on its way to the network
+    struct socket_delay down;  // Data on its way to the adapter
+};
 
 struct socket_impl {
     int sockets[MOBILE_MAX_CONNECTIONS];
+
+    // Known about every socket, to avoid asking the system
+    enum mobile_socktype types[MOBILE_MAX_CONNECTIONS];
+    bool connecting[MOBILE_MAX_CONNECTIONS];  // connect() is in progress
+    struct socket_impl_sendq sendq[MOBILE_MAX_CONNECTIONS];
+    struct socket_impl_closing closing[MOBILE_MAX_CONNECTIONS];
+    struct socket_impl_uring uring[MOBILE_MAX_CONNECTIONS];
+
+    // Connections never reach the system, and are served in memory instead
+    bool loopback;
+    struct socket_loop_conn loop[MOBILE_MAX_CONNECTIONS];
+
+    // Traffic is delayed, limited and lost on its way through the sockets
+    bool shaping;
+    uint32_t shape_random;
+    struct socket_shape_conn shape[MOBILE_MAX_CONNECTIONS];
 };
 
 void socket_impl_init(struct socket_impl *state);
@@ -50,4 +123,7 @@ int socket_impl_connect(struct socket_impl *state, unsigned conn, const struct m
 bool socket_impl_listen(struct socket_impl *state, unsigned conn);
 bool socket_impl_accept(struct socket_impl *state, unsigned conn);
 int socket_impl_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr);
+int socket_impl_flush(struct socket_impl *state, unsigned conn);
+bool socket_impl_flush_closing(struct socket_impl *state);
 int socket_impl_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr);
+void socket_impl_watch(struct socket_impl *state, unsigned conn, unsigned events);
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "socket_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reactor.h"
+#include "socket_delay.h"
+#include "timer.h"
+
+// Loopback backend, serving every connection in memory without ever touching
+//   the system's sockets, to measure the link with the adapter on its own.
+// Whatever is sent comes back from an echo endpoint, except when it's sent
+//   to the sink port, where it's dropped. Connections are made after the
+//   configured latency, and data comes back after it as well.
+// Nobody ever connects to a listening socket.
+
+struct socket_loop_config {
+    unsigned latency_ms;  // Time for data to come back, and to connect
+    unsigned buffer;  // Bytes on their way back, before sends are refused
+    unsigned segment;  // Most bytes handed out by a single receive
+};
+
+static bool enabled;
+static struct socket_loop_config config = {
+    .latency_ms = 0,
+    .buffer = 0x4000,
+    .segment = 0x10000,
+};
+
+// Read the settings from a comma-separated list of name=value pairs, and
+//   enable the loopback backend for every adapter
+// Has to happen before any adapter is served, as it's shared by all of them.
+bool socket_loop_configure(const char *spec)
+{
+    char buf[0x100];
+    if (strlen(spec) >= sizeof(buf)) return false;
+    strcpy(buf, spec);
+
+    for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        if (strcmp(item, "on") == 0) continue;
+
+        char *value = strchr(item, '=');
+        if (!value) {
+            fprintf(stderr, "loopback: missing value: %s\n", item);
+            return false;
+        }
+        *value++ = '\0';
+
+        char *end;
+        unsigned long num = strtoul(value, &end, 0);
+        if (!*value || *end) {
+            fprintf(stderr, "loopback: invalid value: %s\n", value);
+            return false;
+        }
+
+        if (strcmp(item, "latency") == 0) {
+            config.latency_ms = num;
+        } else if (strcmp(item, "buffer") == 0 && num) {
+            config.buffer = num;
+        } else if (strcmp(item, "segment") == 0 && num) {
+            config.segment = num;
+        } else {
+            fprintf(stderr, "loopback: invalid setting: %s\n", item);
+            return false;
+        }
+    }
+    enabled = true;
+    return true;
+}
+
+bool socket_loop_enabled(void)
+{
+    return enabled;
+}
+
+static unsigned addr_port(const struct mobile_addr *addr)
+{
+    if (!addr) return 0;
+    if (addr->type == MOBILE_ADDRTYPE_IPV4) {
+        return ((const struct mobile_addr4 *)addr)->port;
+    }
+    if (addr->type == MOBILE_ADDRTYPE_IPV6) {
+        return ((const struct mobile_addr6 *)addr)->port;
+    }
+    return 0;
+}
+
+// Time left until a connection made at a given time is done, in ms
+static unsigned time_left(uint32_t time)
+{
+    uint32_t elapsed = timer_get() - time;
+    if (elapsed >= config.latency_ms * 1000) return 0;
+    return (config.latency_ms * 1000 - elapsed + 999) / 1000;
+}
+
+void socket_loop_stop(struct socket_impl *state)
+{
+    for (unsigned i = 0; i < MOBILE_MAX_CONNECTIONS; i++) {
+        if (state->loop[i].open) socket_loop_close(state, i);
+    }
+}
+
+bool socket_loop_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    *loop = (struct socket_loop_conn){
+        .open = true,
+        .udp = type == MOBILE_SOCKTYPE_UDP,
+    };
+    if (!socket_delay_init(&loop->back, config.buffer)) {
+        loop->open = false;
+        return false;
+    }
+    return true;
+}
+
+void socket_loop_close(struct socket_impl *state, unsigned conn)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    socket_delay_free(&loop->back);
+    *loop = (struct socket_loop_conn){0};
+}
+
+int socket_loop_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    if (loop->connected) return 1;
+    if (!loop->connecting) {
+        loop->connecting = true;
+        loop->connect_time = timer_get();
+        loop->sink = addr_port(addr) == SOCKET_LOOP_SINK_PORT;
+    }
+    if (time_left(loop->connect_time)) return 0;
+    loop->connecting = false;
+    loop->connected = true;
+    return 1;
+}
+
+int socket_loop_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    if (!loop->udp && !loop->connected) {
+        fprintf(stderr, "loopback: send: not connected\n");
+        return -1;
+    }
+    bool sink = loop->udp ? addr_port(addr) == SOCKET_LOOP_SINK_PORT :
+        loop->sink;
+    if (sink) return size;
+
+    // Datagrams come back from where they were sent to
+    return socket_delay_put(&loop->back, data, size, addr,
+        timer_get() + config.latency_ms * 1000, loop->udp);
+}
+
+int socket_loop_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    if (!loop->udp && !loop->connected) {
+        fprintf(stderr, "loopback: recv: not connected\n");
+        return -1;
+    }
+    if (!data) return 0;
+
+    if (size > config.segment) size = config.segment;
+    return socket_delay_get(&loop->back, data, size, loop->udp ? addr : NULL,
+        loop->udp);
+}
+
+// Wake the reactor up when a connection is made, or data comes back
+void socket_loop_watch(struct socket_impl *state, unsigned conn, unsigned events)
+{
+    struct socket_loop_conn *loop = &state->loop[conn];
+    if (!loop->open) return;
+    if ((events & REACTOR_OUT) && loop->connecting) {
+        reactor_timer(time_left(loop->connect_time));
+    }
+    int wait = socket_delay_wait(&loop->back);
+    if ((events & REACTOR_IN) && wait >= 0) reactor_timer(wait);
+}
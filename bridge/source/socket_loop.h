@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#include "socket_impl.h"
+
+// Port of the endpoint that drops everything, like the discard protocol
+#define SOCKET_LOOP_SINK_PORT 9
+
+bool socket_loop_configure(const char *spec);
+bool socket_loop_enabled(void);
+
+void socket_loop_stop(struct socket_impl *state);
+bool socket_loop_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type);
+void socket_loop_close(struct socket_impl *state, unsigned conn);
+int socket_loop_connect(struct socket_impl *state, unsigned conn, const struct mobile_addr *addr);
+int socket_loop_send(struct socket_impl *state, unsigned conn, const void *data, const unsigned size, const struct mobile_addr *addr);
+int socket_loop_recv(struct socket_impl *state, unsigned conn, void *data, unsigned size, struct mobile_addr *addr);
+void socket_loop_watch(struct socket_impl *state, unsigned conn, unsigned events);
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "socket_shape.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "socket_delay.h"
+#include "timer.h"
+
+// Shaping layer, holding back the traffic of every connection like a slower
+//   network would, to find out how the adapter copes with one.
+// Data leaves in the order it came in, after waiting for its turn on a link
+//   of limited bandwidth, and then for the configured delay, give or take
+//   the jitter. Lost datagrams are dropped, while lost TCP segments arrive
+//   late, after being sent again.
+
+struct socket_shape_config {
+    unsigned delay_ms;  // Time for data to get across, each way
+    unsigned jitter_ms;  // Most time the delay varies by, either way
+    unsigned rate;  // Bits per second in each direction, 0 for unlimited
+    double loss;  // Percentage of data that's lost
+    uint32_t seed;  // Start of the random sequence, to repeat a run
+};
+
+// Close to a PDC packet connection, like the adapter's original service
+static const struct socket_shape_config config_pdc = {
+    .delay_ms = 250,
+    .jitter_ms = 50,
+    .rate = 9600,
+    .loss = 1,
+    .seed = 1,
+};
+
+static bool enabled;
+static struct socket_shape_config config = {
+    .seed = 1,
+};
+
+// Read the settings from a comma-separated list of name=value pairs, or
+//   profiles, and enable shaping for every adapter
+// Has to happen before any adapter is served, as it's shared by all of them.
+bool socket_shape_configure(const char *spec)
+{
+    char buf[0x100];
+    if (strlen(spec) >= sizeof(buf)) return false;
+    strcpy(buf, spec);
+
+    for (char *item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+        if (strcmp(item, "on") == 0) continue;
+        if (strcmp(item, "pdc") == 0) {
+            config = config_pdc;
+            continue;
+        }
+
+        char *value = strchr(item, '=');
+        if (!value) {
+            fprintf(stderr, "shaping: missing value: %s\n", item);
+            return false;
+        }
+        *value++ = '\0';
+
+        char *end;
+        if (strcmp(item, "loss") == 0) {
+            double num = strtod(value, &end);
+            if (!*value || *end || num < 0 || num > 100) {
+                fprintf(stderr, "shaping: invalid value: %s\n", value);
+                return false;
+            }
+            config.loss = num;
+            continue;
+        }
+
+        unsigned long num = strtoul(value, &end, 0);
+        if (!*value || *end) {
+            fprintf(stderr, "shaping: invalid value: %s\n", value);
+            return false;
+        }
+
+        if (strcmp(item, "delay") == 0) {
+            config.delay_ms = num;
+        } else if (strcmp(item, "jitter") == 0) {
+            config.jitter_ms = num;
+        } else if (strcmp(item, "rate") == 0) {
+            config.rate = num;
+        } else if (strcmp(item, "seed") == 0 && num) {
+            config.seed = num;
+        } else {
+            fprintf(stderr, "shaping: invalid setting: %s\n", item);
+            return false;
+        }
+    }
+    enabled = true;
+    return true;
+}
+
+bool socket_shape_enabled(void)
+{
+    return enabled;
+}
+
+// Start of the random sequence, spread out so that small seeds don't start
+//   it off with small numbers
+uint32_t socket_shape_seed(void)
+{
+    return config.seed * 0x9E3779B9;
+}
+
+// Xorshift, good enough to pick delays and losses, and repeatable
+static uint32_t random_next(struct socket_impl *state)
+{
+    uint32_t x = state->shape_random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state->shape_random = x;
+    return x;
+}
+
+static bool lost(struct socket_impl *state)
+{
+    if (!config.loss) return false;
+    return random_next(state) * (100.0 / 4294967296.0) < config.loss;
+}
+
+// One way delay, in us
+static uint32_t delay_us(struct socket_impl *state)
+{
+    int32_t delay = config.delay_ms;
+    if (config.jitter_ms) {
+        delay += (int32_t)(random_next(state) % (config.jitter_ms * 2 + 1)) -
+            (int32_t)config.jitter_ms;
+    }
+    if (delay < 0) delay = 0;
+    return delay * 1000;
+}
+
+// Time a lost TCP segment takes to be sent again, in us
+// Like the retransmission timeout of most systems, four deviations above the
+//   round trip, but never less than 200ms.
+static uint32_t retransmit_us(void)
+{
+    uint32_t rto = config.delay_ms * 2 + config.jitter_ms * 4;
+    if (rto < 200) rto = 200;
+    return rto * 1000;
+}
+
+// Time data arrives at, once it's had its turn on the link
+static uint32_t schedule(struct socket_impl *state, uint32_t *busy, unsigned size)
+{
+    uint32_t now = timer_get();
+    if ((int32_t)(*busy - now) < 0) *busy = now;
+    if (config.rate) *busy += (uint64_t)size * 8 * 1000000 / config.rate;
+    return *busy + delay_us(state);
+}
+
+bool socket_shape_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    *shape = (struct socket_shape_conn){
+        .udp = type == MOBILE_SOCKTYPE_UDP,
+    };
+    if (!socket_delay_init(&shape->up, SOCKET_SHAPE_QUEUE_SIZE)) return false;
+    if (!socket_delay_init(&shape->down, SOCKET_SHAPE_QUEUE_SIZE)) {
+        socket_delay_free(&shape->up);
+        return false;
+    }
+    shape->open = true;
+    return true;
+}
+
+void socket_shape_close(struct socket_impl *state, unsigned conn)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    socket_delay_free(&shape->up);
+    socket_delay_free(&shape->down);
+    *shape = (struct socket_shape_conn){0};
+}
+
+// Hold back data sent by the adapter
+// Returns the amount of bytes accepted, which is only less than the size
+//   given if the queue is full.
+unsigned socket_shape_up(struct socket_impl *state, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    unsigned room = socket_delay_room(&shape->up);
+    if (size > room) {
+        if (shape->udp) return 0;
+        size = room;
+    }
+    if (!size) return 0;
+
+    uint32_t due = schedule(state, &shape->up_busy, size);
+    if (lost(state)) {
+        if (shape->udp) return size;
+        due += retransmit_us();
+    }
+    return socket_delay_put(&shape->up, data, size, addr, due, shape->udp);
+}
+
+// Hold back data received from the network
+// Datagrams that don't fit are dropped, like a full router would.
+void socket_shape_down(struct socket_impl *state, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    uint32_t due = schedule(state, &shape->down_busy, size);
+    if (lost(state)) {
+        if (shape->udp) return;
+        due += retransmit_us();
+    }
+    socket_delay_put(&shape->down, data, size, addr, due, shape->udp);
+}
+
+// Report a connection after a round trip, as it takes one to make it
+void socket_shape_connected(struct socket_impl *state, unsigned conn)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    shape->connected = true;
+    shape->connect_due = timer_get() + delay_us(state) + delay_us(state);
+}
+
+// Report a receive error once everything before it has arrived
+void socket_shape_error(struct socket_impl *state, unsigned conn, int error)
+{
+    struct socket_shape_conn *shape = &state->shape[conn];
+    shape->error = error;
+    shape->error_due = schedule(state, &shape->down_busy, 0);
+}
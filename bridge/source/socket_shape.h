@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#include "socket_impl.h"
+
+bool socket_shape_configure(const char *spec);
+bool socket_shape_enabled(void);
+uint32_t socket_shape_seed(void);
+
+bool socket_shape_open(struct socket_impl *state, unsigned conn, enum mobile_socktype type);
+void socket_shape_close(struct socket_impl *state, unsigned conn);
+unsigned socket_shape_up(struct socket_impl *state, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr);
+void socket_shape_down(struct socket_impl *state, unsigned conn, const void *data, unsigned size, const struct mobile_addr *addr);
+void socket_shape_connected(struct socket_impl *state, unsigned conn);
+void socket_shape_error(struct socket_impl *state, unsigned conn, int error);
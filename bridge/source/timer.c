@@ -0,0 +1,34 @@
+#include "timer.h"
+
+#if defined(__unix__)
+#include <time.h>
+#elif defined(__WIN32__)
+#include <windows.h>
+#endif
+
+// Get a monotonic timestamp in microseconds, that may wrap around
+uint32_t timer_get(void)
+{
+#if defined(__unix__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif defined(__WIN32__)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (count.QuadPart / freq.QuadPart) * 1000000 +
+        (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#endif
+}
+
+// Wait for a while, without doing anything else
+void timer_sleep(uint32_t us)
+{
+#if defined(__unix__)
+    struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+    nanosleep(&ts, NULL);
+#elif defined(__WIN32__)
+    Sleep((us + 999) / 1000);
+#endif
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+uint32_t timer_get(void);
+void timer_sleep(uint32_t us);
@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Hands socket operations to the kernel through io_uring, without a system
+//   call for each of them. They're only submitted once the reactor goes to
+//   sleep, all of them along with the wait, and what they did is picked up
+//   when it wakes up.
+// The reactor's epoll file descriptor is waited on through the ring as well,
+//   so everything else it watches still wakes it up.
+// Every thread has a ring of its own, next to its reactor. Where io_uring
+//   isn't available, nothing uses it, and the sockets are waited on by the
+//   reactor instead.
+
+// Operations that can be queued before they have to be submitted
+#define URING_ENTRIES 64
+
+static bool enabled;
+
+#if defined(__linux__)
+struct ring {
+    int fd;
+    unsigned entries;
+    unsigned tail;  // Where the next operation is queued
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *map;
+    size_t map_size;
+};
+static _Thread_local struct ring ring = {.fd = -1};
+
+// The file descriptor waited on by uring_wait(), once it's readable
+static _Thread_local struct uring_op wait_op;
+static _Thread_local bool wait_ready;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+        flags, arg, argsz);
+}
+
+static void ring_free(void)
+{
+    if (ring.sqes) munmap(ring.sqes, ring.entries * sizeof(*ring.sqes));
+    if (ring.map) munmap(ring.map, ring.map_size);
+    if (ring.fd != -1) close(ring.fd);
+    ring = (struct ring){.fd = -1};
+    wait_op = (struct uring_op){0};
+    wait_ready = false;
+}
+
+static unsigned to_submit(void)
+{
+    return ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+#endif
+
+// Use io_uring for the sockets, on every thread that starts a reactor after
+//   this
+void uring_enable(void)
+{
+    enabled = true;
+}
+
+// Set up the ring for the current thread, if it's been enabled
+bool uring_init(void)
+{
+#if defined(__linux__)
+    ring_free();
+    if (!enabled) return false;
+
+    // Whatever's done is only picked up when the thread enters the kernel
+    //   anyway, instead of interrupting it
+    struct io_uring_params params = {.flags = IORING_SETUP_COOP_TASKRUN};
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd == -1 && errno == EINVAL) {
+        params = (struct io_uring_params){0};
+        ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring.fd == -1) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    // Waiting with a timeout, and mapping everything at once, makes it a lot
+    //   simpler, and every kernel that can do the rest has them.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: unsupported by the kernel\n");
+        ring_free();
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring.map = mmap(NULL, ring.map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.map == MAP_FAILED) {
+        ring.map = NULL;
+        perror("mmap");
+        ring_free();
+        return false;
+    }
+    ring.entries = params.sq_entries;
+    ring.sqes = mmap(NULL, ring.entries * sizeof(*ring.sqes),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+        IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        perror("mmap");
+        ring_free();
+        return false;
+    }
+
+    char *map = ring.map;
+    ring.sq_head = (unsigned *)(map + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(map + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(map + params.sq_off.ring_mask);
+    ring.cq_head = (unsigned *)(map + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(map + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(map + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+    ring.tail = *ring.sq_tail;
+
+    // Every entry is always submitted from the same slot
+    unsigned *array = (unsigned *)(map + params.sq_off.array);
+    for (unsigned i = 0; i < ring.entries; i++) array[i] = i;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Check if the current thread has a ring to hand operations to
+bool uring_ready(void)
+{
+#if defined(__linux__)
+    return ring.fd != -1;
+#else
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+// Tell every operation that's done about it
+static void reap(void)
+{
+    unsigned head = *ring.cq_head;
+    for (;;) {
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+        // Cancellations aren't told about
+        if (!op) continue;
+        op->busy = false;
+        op->done(op, res);
+    }
+}
+
+// Queue an operation, to be submitted along with the next wait
+// If the ring is full, everything in it is submitted first.
+static struct io_uring_sqe *queue(struct uring_op *op, unsigned char opcode, int fd, const void *addr, unsigned len)
+{
+    if (to_submit() >= ring.entries) {
+        if (uring_enter(to_submit(), 0, 0, NULL, 0) == -1) {
+            perror("io_uring_enter");
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring.sqes[ring.tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = (uintptr_t)op;
+    __atomic_store_n(ring.sq_tail, ++ring.tail, __ATOMIC_RELEASE);
+    if (op) op->busy = true;
+    return sqe;
+}
+#endif
+
+void uring_recv(struct uring_op *op, int fd, void *buf, unsigned size)
+{
+#if defined(__linux__)
+    queue(op, IORING_OP_RECV, fd, buf, size);
+#else
+    (void)op; (void)fd; (void)buf; (void)size;
+#endif
+}
+
+// Receive a datagram, along with where it came from
+// The message and the address have to be kept until it's done.
+void uring_recvmsg(struct uring_op *op, int fd, struct uring_msg *msg, void *buf, unsigned size, void *name, unsigned namelen)
+{
+#if defined(__linux__)
+    msg->iov = (struct iovec){.iov_base = buf, .iov_len = size};
+    msg->hdr = (struct msghdr){
+        .msg_name = name,
+        .msg_namelen = namelen,
+        .msg_iov = &msg->iov,
+        .msg_iovlen = 1,
+    };
+    queue(op, IORING_OP_RECVMSG, fd, &msg->hdr, 1);
+#else
+    (void)op; (void)fd; (void)msg; (void)buf; (void)size; (void)name;
+    (void)namelen;
+#endif
+}
+
+void uring_send(struct uring_op *op, int fd, const void *buf, unsigned size)
+{
+#if defined(__linux__)
+    struct io_uring_sqe *sqe = queue(op, IORING_OP_SEND, fd, buf, size);
+    sqe->msg_flags = MSG_NOSIGNAL;
+#else
+    (void)op; (void)fd; (void)buf; (void)size;
+#endif
+}
+
+// Send a datagram to a given address
+// The message and the address have to be kept until it's done.
+void uring_sendmsg(struct uring_op *op, int fd, struct uring_msg *msg, const void *buf, unsigned size, const void *name, unsigned namelen)
+{
+#if defined(__linux__)
+    msg->iov = (struct iovec){.iov_base = (void *)buf, .iov_len = size};
+    msg->hdr = (struct msghdr){
+        .msg_name = (void *)name,
+        .msg_namelen = namelen,
+        .msg_iov = &msg->iov,
+        .msg_iovlen = 1,
+    };
+    struct io_uring_sqe *sqe = queue(op, IORING_OP_SENDMSG, fd, &msg->hdr, 1);
+    sqe->msg_flags = MSG_NOSIGNAL;
+#else
+    (void)op; (void)fd; (void)msg; (void)buf; (void)size; (void)name;
+    (void)namelen;
+#endif
+}
+
+// Cancel an operation, and wait until it's done
+// Its buffers may be reused right after. It may have finished before it
+//   could be cancelled, in which case it's told about it like any other time.
+void uring_cancel(struct uring_op *op)
+{
+#if defined(__linux__)
+    if (!op->busy) return;
+    queue(NULL, IORING_OP_ASYNC_CANCEL, -1, op, 0);
+    while (op->busy) {
+        if (uring_enter(to_submit(), 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+                && errno != EINTR) {
+            // Nothing can be done about it anymore
+            perror("io_uring_enter");
+            op->busy = false;
+            return;
+        }
+        reap();
+    }
+#else
+    (void)op;
+#endif
+}
+
+// Submit everything that's been queued without waiting, and pick up what's
+//   done already
+// Takes the place of uring_wait() while there's no time to sleep.
+void uring_submit(void)
+{
+#if defined(__linux__)
+    if (!uring_ready()) return;
+    if (to_submit() && uring_enter(to_submit(), 0, 0, NULL, 0) == -1) {
+        perror("io_uring_enter");
+    }
+    reap();
+#endif
+}
+
+#if defined(__linux__)
+static void wait_done(struct uring_op *op, int res)
+{
+    (void)op;
+    if (res >= 0) wait_ready = true;
+}
+#endif
+
+// Submit everything that's been queued, and sleep until any of it is done,
+//   the file descriptor is readable, or the timeout runs out, -1 meaning no
+//   timeout
+// Returns 1 if the file descriptor is readable, 0 if it isn't, or -1 if
+//   waiting failed.
+int uring_wait(int fd, int timeout_ms)
+{
+#if defined(__linux__)
+    // It may have become readable while something else was being waited for
+    if (wait_ready) {
+        timeout_ms = 0;
+    } else if (!wait_op.busy) {
+        wait_op.done = wait_done;
+        struct io_uring_sqe *sqe = queue(&wait_op, IORING_OP_POLL_ADD, fd,
+            NULL, 0);
+        sqe->poll32_events = POLLIN;
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = timeout_ms % 1000 * 1000000L,
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = timeout_ms >= 0 ? (uintptr_t)&ts : 0,
+    };
+    if (uring_enter(to_submit(), 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+            &arg, sizeof(arg)) == -1) {
+        if (errno != ETIME && errno != EINTR) {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+    reap();
+
+    if (!wait_ready) return 0;
+    wait_ready = false;
+    return 1;
+#else
+    (void)fd;
+    (void)timeout_ms;
+    return -1;
+#endif
+}
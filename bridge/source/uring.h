@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#pragma once
+
+#include <stdbool.h>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+// Operation handed to the ring, told about its result once it's done
+struct uring_op {
+    void (*done)(struct uring_op *op, int res);
+    bool busy;  // Submitted, and not done yet
+};
+
+// Message sent or received through the ring, kept until it's done
+struct uring_msg {
+#if defined(__linux__)
+    struct msghdr hdr;
+    struct iovec iov;
+#else
+    char unused;
+#endif
+};
+
+void uring_enable(void);
+bool uring_init(void);
+bool uring_ready(void);
+void uring_recv(struct uring_op *op, int fd, void *buf, unsigned size);
+void uring_recvmsg(struct uring_op *op, int fd, struct uring_msg *msg, void *buf, unsigned size, void *name, unsigned namelen);
+void uring_send(struct uring_op *op, int fd, const void *buf, unsigned size);
+void uring_sendmsg(struct uring_op *op, int fd, struct uring_msg *msg, const void *buf, unsigned size, const void *name, unsigned namelen);
+void uring_cancel(struct uring_op *op);
+void uring_submit(void);
+int uring_wait(int fd, int timeout_ms);